@@ -6,319 +6,89 @@
 
 #include <iostream>
 #include <string>
-#include <vector>
-#include <cstdlib>
-#include <exception>
+#include <ctime>
+#include "Library.h"
 using namespace std;
 
-// Custom exception for library errors
-class LibraryException : public exception {
-private:
-    string message;
-public:
-    LibraryException(const string &msg) : message(msg) {}
-    virtual const char* what() const noexcept {
-        return message.c_str();
-    }
-};
-
-// Book class: Represents a book with book ID, title, author, and ISBN.
-class Book {
-private:
-    static int nextBookID; 
-    int bookID;
-    string title;
-    string author;
-    string isbn;
-    bool available;
-public:
-    Book(string t, string a, string i) {
-        bookID = nextBookID++;
-        title = t;
-        author = a;
-        isbn = i;
-        available = true;
-    }
-    
-    int getBookID() { return bookID; }
-    string getTitle() { return title; }
-    string getAuthor() { return author; }
-    string getISBN() { return isbn; }
-    bool isAvailable() { return available; }
-    void setAvailable(bool avail) { available = avail; }
-    
-    void editBook(string newTitle, string newAuthor, string newISBN) {
-        title = newTitle;
-        author = newAuthor;
-        isbn = newISBN;
-    }
-};
-
-int Book::nextBookID = 0;  
-
-// User class: Base class for users with an ID, name, and list of borrowed book IDs.
-class User {
-protected:
-    static int nextUserID;  
-    int userID;
-    string name;
-    vector<int> borrowedBooks;  
-public:
-    User(string n) {
-        userID = nextUserID++;
-        name = n;
-    }
-    virtual ~User() {}
-    
-    int getUserID() { return userID; }
-    string getName() { return name; }
-    
-    // Virtual function so derived classes can indicate type (Student/Faculty)
-    virtual string getUserType() = 0;
-    
-    // Maximum books allowed (default 3)
-    virtual int getMaxBooks() { return 3; }
-    
-    bool canBorrow() { return borrowedBooks.size() < static_cast<unsigned>(getMaxBooks()); }
-    
-    void borrowBook(int bookID) {
-        borrowedBooks.push_back(bookID);
-    }
-    
-    void returnBook(int bookID) {
-        bool found = false;
-        for (size_t i = 0; i < borrowedBooks.size(); i++) {
-            if (borrowedBooks[i] == bookID) {
-                borrowedBooks.erase(borrowedBooks.begin() + i);
-                found = true;
-                break;
-            }
-        }
-        if (!found)
-            throw LibraryException("Book not borrowed by user.");
-    }
-    
-    const vector<int>& getBorrowedBooks() { return borrowedBooks; }
-    
-    void editUser(string newName) {
-        name = newName;
-    }
-};
-
-int User::nextUserID = 0;  
-
-// Derived class: Student
-class Student : public User {
-public:
-    Student(string n) : User(n) {}
-    string getUserType() { return "Student"; }
-    int getMaxBooks() { return 3; }
-};
-
-// Derived class: Faculty
-class Faculty : public User {
-public:
-    Faculty(string n) : User(n) {}
-    string getUserType() { return "Faculty"; }
-    int getMaxBooks() { return 5; }
-};
+// Prints an import summary, showing at most the first few rejected rows
+void printImportReport(const ImportReport &report, const string &what) {
+    cout << "Imported " << report.imported << " " << what << endl;
+    const size_t MaxShown = 10;
+    for (size_t i = 0; i < report.errors.size() && i < MaxShown; i++)
+        cout << "ERROR: Line " << report.errors[i].first << ": " << report.errors[i].second << endl;
+    if (report.errors.size() > MaxShown)
+        cout << "... and " << report.errors.size() - MaxShown << " more rejected rows" << endl;
+}
 
-// Factory for creating Book objects
-class BookFactory {
-public:
-    static Book* createBook(string title, string author, string isbn) {
-        return new Book(title, author, isbn);
-    }
-};
+// Formats seconds since the epoch as a local YYYY-MM-DD date
+string formatDate(int64_t seconds) {
+    time_t t = static_cast<time_t>(seconds);
+    char text[16];
+    strftime(text, sizeof(text), "%Y-%m-%d", localtime(&t));
+    return text;
+}
 
-// Factory for creating User objects
-class UserFactory {
-public:
-    static User* createUser(int userType, string name) {
-        if (userType == 1)
-            return new Student(name);
-        else if (userType == 2)
-            return new Faculty(name);
-        else
-            throw LibraryException("Only valid options are 1 or 2");
-    }
-};
+// Prints an amount of cents as dollars
+string formatMoney(int64_t cents) {
+    string digits = to_string(cents % 100);
+    return "$" + to_string(cents / 100) + (digits.size() == 1 ? ".0" : ".") + digits;
+}
 
-// Singleton that manages Books and Users, and handles transactions.
-class Library {
-private:
-    vector<Book*> books;    
-    vector<User*> users;   
+void clearInput() {
+    cin.clear();
+    cin.ignore(10000, '\n');
+}
 
-    Library() {}  
+// Where the library is saved between runs: a snapshot plus a log of the
+// changes made since it was taken
+const char* const SnapshotFile = "library.dat";
+const char* const LogFile = "library.log";
 
-    Library(const Library&) = delete;
-    Library& operator=(const Library&) = delete;
-public:
-    static Library& getInstance() {
-        static Library instance;
-        return instance;
-    }
-    
-    // Book management
-    void addBook(Book* book) {
-        books.push_back(book);
-    }
-    
-    Book* getBook(int bookID) {
-        for (size_t i = 0; i < books.size(); i++) {
-            Book* b = books[i];
-            if (b->getBookID() == bookID)
-                return b;
-        }
-        return nullptr;
-    }
-    
-    void editBook(int bookID, string newTitle, string newAuthor, string newISBN) {
-        Book* book = getBook(bookID);
-        if (!book)
-            throw LibraryException("Book not found.");
-        book->editBook(newTitle, newAuthor, newISBN);
-    }
-    
-    void removeBook(int bookID) {
-        for (vector<Book*>::iterator it = books.begin(); it != books.end(); ++it) {
-            if ((*it)->getBookID() == bookID) {
-                delete *it;
-                books.erase(it);
-                return;
-            }
-        }
-        throw LibraryException("Book not found.");
-    }
-    
-    // Find a book by title 
-    Book* findBookByTitle(string title) {
-        for (size_t i = 0; i < books.size(); i++) {
-            Book* b = books[i];
-            if (b->getTitle() == title)
-                return b;
-        }
-        return nullptr;
-    }
-    
-    // User management
-    void registerUser(User* user) {
-        users.push_back(user);
-    }
-    
-    User* getUser(int userID) {
-        for (size_t i = 0; i < users.size(); i++) {
-            User* u = users[i];
-            if (u->getUserID() == userID)
-                return u;
-        }
-        return nullptr;
-    }
+int main() {
+    Library &library = Library::getInstance();
+    int choice;
     
-    void editUser(int userID, string newName) {
-        User* user = getUser(userID);
-        if (!user)
-            throw LibraryException("User not found.");
-        user->editUser(newName);
+    try {
+        library.recover(SnapshotFile, LogFile);
     }
-    
-    void removeUser(int userID) {
-        for (vector<User*>::iterator it = users.begin(); it != users.end(); ++it) {
-            if ((*it)->getUserID() == userID) {
-                delete *it;
-                users.erase(it);
-                return;
-            }
-        }
-        throw LibraryException("User not found.");
+    catch (LibraryException &e) {
+        // Carrying on would save over the files at exit, losing the library
+        cout << "ERROR: Could not load saved library: " << e.what() << endl;
+        cout << "Move " << SnapshotFile << " and " << LogFile << " aside to start an empty library." << endl;
+        return 1;
     }
-    
-    // Borrow a book (by user and book IDs)
-    void borrowBook(int userID, int bookID) {
-        User* user = getUser(userID);
-        if (!user)
-            throw LibraryException("No User with that ID Exists");
-        Book* book = getBook(bookID);
-        if (!book)
-            throw LibraryException("No Book with that ID Exists");
-        if (!book->isAvailable())
-            throw LibraryException("Book is not available for borrowing.");
-        if (!user->canBorrow())
-            throw LibraryException("User has reached borrowing limit.");
-        
-        book->setAvailable(false);
-        user->borrowBook(bookID);
+#ifndef LIBRARY_NO_METRICS
+    // Optionally keep a metrics dump up to date in a file
+    MetricsReporter* reporter = nullptr;
+    const char* metricsFile = getenv("LIBRARY_METRICS_FILE");
+    if (metricsFile && *metricsFile)
+        reporter = new MetricsReporter(metricsFile, chrono::seconds(10));
+#endif
+    TransactionLog* log = nullptr;
+    try {
+        log = new TransactionLog(LogFile);
+        library.attachLog(log);
     }
-    
-    // Return a book (by user and book IDs)
-    void returnBook(int userID, int bookID) {
-        User* user = getUser(userID);
-        if (!user)
-            throw LibraryException("No User with that ID Exists");
-        Book* book = getBook(bookID);
-        if (!book)
-            throw LibraryException("No Book with that ID Exists");
-        
-        user->returnBook(bookID);
-        book->setAvailable(true);
+    catch (LibraryException &e) {
+        cout << "ERROR: Changes will not be saved: " << e.what() << endl;
     }
-    
-    // List all books with details 
-    void listAllBooks() {
-        cout << "List All Books" << endl;
-        for (size_t i = 0; i < books.size(); i++) {
-            Book* b = books[i];
-            cout << "Book " << b->getBookID() << ":" << endl;
-            cout << "Title: " << b->getTitle() << endl;
-            cout << "Author: " << b->getAuthor() << endl;
-            cout << "ISBN: " << b->getISBN() << endl;
+    // Optionally record every library call for library_replay
+    TraceRecorder* recorder = nullptr;
+    const char* traceFile = getenv("LIBRARY_TRACE_FILE");
+    if (traceFile && *traceFile) {
+        try {
+            recorder = new TraceRecorder(traceFile);
+            library.attachTrace(recorder);
         }
-    }
-    
-    // List all users with their borrowed books.
-    void listAllUsers() {
-        cout << "List All Users" << endl;
-        for (size_t i = 0; i < users.size(); i++) {
-            User* u = users[i];
-            cout << "User " << u->getUserID() << ":" << endl;
-            cout << "Name: " << u->getName() << endl;
-            cout << "Class: " << u->getUserType() << endl;
-            cout << "Books Checked Out:" << endl;
-            const vector<int>& borrowed = u->getBorrowedBooks();
-            for (size_t j = 0; j < borrowed.size(); j++) {
-                int bid = borrowed[j];
-                Book* b = getBook(bid);
-                if (b) {
-                    cout << "Book " << b->getBookID() << ":" << endl;
-                    cout << "Title: " << b->getTitle() << endl;
-                    cout << "Author: " << b->getAuthor() << endl;
-                    cout << "ISBN: " << b->getISBN() << endl;
-                }
-            }
+        catch (LibraryException &e) {
+            cout << "ERROR: Calls will not be recorded: " << e.what() << endl;
+            delete recorder;
+            recorder = nullptr;
         }
     }
     
-    ~Library() {
-        for (size_t i = 0; i < books.size(); i++) {
-            delete books[i];
-        }
-        for (size_t i = 0; i < users.size(); i++) {
-            delete users[i];
-        }
-    }
-};
-
-void clearInput() {
-    cin.clear();
-    cin.ignore(10000, '\n');
-}
-
-int main() {
-    Library &library = Library::getInstance();
-    int choice;
-    
     while (true) {
+        library.expireHolds();
         cout << "Welcome to the Norco Library:" << endl;
         cout << "1. Manage Books" << endl;
         cout << "2. Manage Users" << endl;
@@ -336,7 +106,8 @@ int main() {
                 cout << "1. Add a Book" << endl;
                 cout << "2. Edit a Book" << endl;
                 cout << "3. Remove a Book" << endl;
-                cout << "4. Go Back" << endl;
+                cout << "4. Import Books from File" << endl;
+                cout << "5. Go Back" << endl;
                 cout << "\nEnter your choice: ";
                 cin >> bookChoice;
                 clearInput();
@@ -353,9 +124,35 @@ int main() {
                     cout << "Enter the ISBN (0 to cancel): ";
                     getline(cin, isbn);
                     if (isbn == "0") continue;
-                    Book* newBook = BookFactory::createBook(title, author, isbn);
-                    library.addBook(newBook);
-                    cout << "Book Added" << endl;
+                    int copies = 1;
+                    cout << "Number of copies (Enter for 1): ";
+                    string copiesInput;
+                    getline(cin, copiesInput);
+                    if (!copiesInput.empty()) {
+                        try {
+                            copies = stoi(copiesInput);
+                        }
+                        catch (...) {
+                            copies = 0;
+                        }
+                        if (copies < 1) {
+                            cout << "Error: Invalid number of copies" << endl;
+                            continue;
+                        }
+                    }
+                    vector<Book*> newBooks;
+                    try {
+                        for (int i = 0; i < copies; i++)
+                            newBooks.push_back(BookFactory::createBook(title, author, isbn));
+                        library.addBooks(newBooks);
+                    }
+                    catch (LibraryException &e) {
+                        for (size_t i = 0; i < newBooks.size(); i++)
+                            BookFactory::destroyBook(newBooks[i]);
+                        cout << "ERROR: " << e.what() << endl;
+                        continue;
+                    }
+                    cout << (copies == 1 ? "Book Added" : to_string(copies) + " Copies Added") << endl;
                 }
                 else if (bookChoice == 2) {
                     int bookID;
@@ -399,6 +196,19 @@ int main() {
                     }
                 }
                 else if (bookChoice == 4) {
+                    string path;
+                    cout << "\nImport Books:" << endl;
+                    cout << "CSV or TSV file with title, author, ISBN (0 to cancel): ";
+                    getline(cin, path);
+                    if (path == "0") continue;
+                    try {
+                        printImportReport(CatalogImporter::importBooks(library, path), "books");
+                    }
+                    catch (LibraryException &e) {
+                        cout << "ERROR: " << e.what() << endl;
+                    }
+                }
+                else if (bookChoice == 5) {
                     break;
                 }
                 else {
@@ -414,7 +224,8 @@ int main() {
                 cout << "1. Add a User" << endl;
                 cout << "2. Edit a User" << endl;
                 cout << "3. Remove a User" << endl;
-                cout << "4. Go Back" << endl;
+                cout << "4. Import Users from File" << endl;
+                cout << "5. Go Back" << endl;
                 cout << "\nEnter your choice: ";
                 cin >> userChoice;
                 clearInput();
@@ -424,13 +235,17 @@ int main() {
                     string name;
                     cout << "Add a User:" << endl;
                     while (true) {
-                        cout << "Enter 1 for student or 2 for faculty (0 to cancel): ";
+                        cout << "User types:" << endl;
+                        for (int i = 0; i < UserCategoryCount; i++)
+                            cout << i + 1 << ". " << userCategoryPolicies[i].name << " (up to "
+                                 << userCategoryPolicies[i].maxBooks << " books)" << endl;
+                        cout << "Enter a user type (0 to cancel): ";
                         cin >> userType;
                         clearInput();
                         if (userType == 0)
                             break;
-                        if (userType != 1 && userType != 2) {
-                            cout << "ERROR: Only valid options are 1 or 2" << endl;
+                        if (!isUserCategoryCode(userType)) {
+                            cout << "ERROR: Only valid options are 1 to " << UserCategoryCount << endl;
                         } else {
                             cout << "Enter name (0 to cancel): ";
                             getline(cin, name);
@@ -486,6 +301,19 @@ int main() {
                     }
                 }
                 else if (userChoice == 4) {
+                    string path;
+                    cout << "Import Users:" << endl;
+                    cout << "CSV or TSV file with type, name (0 to cancel): ";
+                    getline(cin, path);
+                    if (path == "0") continue;
+                    try {
+                        printImportReport(CatalogImporter::importUsers(library, path), "users");
+                    }
+                    catch (LibraryException &e) {
+                        cout << "ERROR: " << e.what() << endl;
+                    }
+                }
+                else if (userChoice == 5) {
                     break;
                 }
                 else {
@@ -502,7 +330,12 @@ int main() {
                 cout << "2. Check In A Book" << endl;
                 cout << "3. List All Books" << endl;
                 cout << "4. List All Users" << endl;
-                cout << "5. Go Back" << endl;
+                cout << "5. Search Books" << endl;
+                cout << "6. Export a Report" << endl;
+                cout << "7. Show Performance Statistics" << endl;
+                cout << "8. List Overdue Loans" << endl;
+                cout << "9. Show Circulation Statistics" << endl;
+                cout << "10. Go Back" << endl;
                 cout << "\nEnter your choice: ";
                 cin >> transChoice;
                 clearInput();
@@ -543,12 +376,28 @@ int main() {
                             cout << "Error: No User with that ID Exists" << endl;
                             continue;
                         }
-                        try {
-                            library.borrowBook(userID, book->getBookID());
-                            cout << book->getTitle() << " checked out by User " << userID << endl;
-                        }
-                        catch (LibraryException &e) {
-                            cout << "Error: " << e.what() << endl;
+                        int copyID;
+                        TxnStatus status = library.tryBorrowAnyCopy(userID, book->getBookID(), &copyID);
+                        if (status == TxnStatus::OK) {
+                            cout << book->getTitle() << " (Book " << copyID << ") checked out by User " << userID << endl;
+                            vector<LoanRecord> loans = library.getLoans(userID);
+                            for (size_t i = 0; i < loans.size(); i++)
+                                if (loans[i].bookID == copyID)
+                                    cout << "Due back " << formatDate(loans[i].due) << endl;
+                        } else {
+                            cout << "Error: " << txnStatusMessage(status) << endl;
+                            if (status == TxnStatus::BookUnavailable) {
+                                cout << "Place a hold on it? (y/n): ";
+                                string answer;
+                                getline(cin, answer);
+                                if (answer == "y" || answer == "Y") {
+                                    status = library.placeHold(userID, book->getBookID());
+                                    if (status == TxnStatus::OK)
+                                        cout << "Hold placed; " << library.holdQueueLength(book->getBookID()) << " hold(s) on this title" << endl;
+                                    else
+                                        cout << "Error: " << txnStatusMessage(status) << endl;
+                                }
+                            }
                         }
                         break;
                     }
@@ -589,13 +438,12 @@ int main() {
                             cout << "Error: No User with that ID Exists" << endl;
                             continue;
                         }
-                        try {
-                            library.returnBook(userID, book->getBookID());
-                            cout << book->getTitle() << " checked in by User " << userID << endl;
-                        }
-                        catch (LibraryException &e) {
-                            cout << "Error: " << e.what() << endl;
-                        }
+                        int copyID;
+                        TxnStatus status = library.tryReturnAnyCopy(userID, book->getBookID(), &copyID);
+                        if (status == TxnStatus::OK)
+                            cout << book->getTitle() << " (Book " << copyID << ") checked in by User " << userID << endl;
+                        else
+                            cout << "Error: " << txnStatusMessage(status) << endl;
                         break;
                     }
                 }
@@ -606,6 +454,111 @@ int main() {
                     library.listAllUsers();
                 }
                 else if (transChoice == 5) {
+                    string query;
+                    cout << "\nSearch Books:" << endl;
+                    cout << "Keywords (or 0 to cancel): ";
+                    getline(cin, query);
+                    if (query == "0")
+                        continue;
+                    vector<Book*> results = library.searchBooks(query);
+                    if (results.empty())
+                        cout << "No books matched" << endl;
+                    for (size_t i = 0; i < results.size(); i++) {
+                        Book* b = results[i];
+                        cout << "Book " << b->getBookID() << ":" << endl;
+                        cout << "Title: " << b->getTitle() << endl;
+                        cout << "Author: " << b->getAuthor() << endl;
+                        cout << "ISBN: " << b->getISBN() << endl;
+                        cout << "Copies: " << library.countCopies(b->getBookID()) << " ("
+                             << library.countAvailableCopies(b->getBookID()) << " available)" << endl;
+                    }
+                }
+                else if (transChoice == 6) {
+                    int reportType, formatChoice;
+                    string path;
+                    cout << "\nExport a Report:" << endl;
+                    cout << "Enter 1 for books or 2 for users (0 to cancel): ";
+                    cin >> reportType;
+                    clearInput();
+                    if (reportType != 1 && reportType != 2)
+                        continue;
+                    cout << "Enter 1 for text, 2 for CSV or 3 for JSON (0 to cancel): ";
+                    cin >> formatChoice;
+                    clearInput();
+                    if (formatChoice < 1 || formatChoice > 3)
+                        continue;
+                    cout << "File name (0 to cancel): ";
+                    getline(cin, path);
+                    if (path == "0")
+                        continue;
+                    FILE* file = fopen(path.c_str(), "wb");
+                    if (!file) {
+                        cout << "ERROR: Cannot write " << path << endl;
+                        continue;
+                    }
+                    ReportFormat format = formatChoice == 1 ? ReportFormat::Text :
+                                          formatChoice == 2 ? ReportFormat::CSV : ReportFormat::JSON;
+                    size_t count;
+                    {
+                        ReportSink out(file);
+                        if (reportType == 1)
+                            count = library.exportBooks(out, format);
+                        else
+                            count = library.exportUsers(out, format);
+                    }
+                    fclose(file);
+                    cout << "Exported " << count << (reportType == 1 ? " books" : " users") << " to " << path << endl;
+                }
+                else if (transChoice == 7) {
+#ifdef LIBRARY_NO_METRICS
+                    cout << "Performance statistics are not included in this build" << endl;
+#else
+                    ReportSink out(stdout);
+                    Metrics::dump(out);
+#endif
+                }
+                else if (transChoice == 8) {
+                    vector<LoanRecord> overdue = library.overdueLoans();
+                    if (overdue.empty())
+                        cout << "No loans are overdue" << endl;
+                    int64_t total = 0;
+                    for (size_t i = 0; i < overdue.size(); i++) {
+                        Book* b = library.getBook(overdue[i].bookID);
+                        cout << "Book " << overdue[i].bookID << " (" << (b ? b->getTitle() : string("?")) << ") "
+                             << "User " << overdue[i].userID << ", due " << formatDate(overdue[i].due)
+                             << ", fine " << formatMoney(overdue[i].fineCents) << endl;
+                        total += overdue[i].fineCents;
+                    }
+                    if (!overdue.empty())
+                        cout << overdue.size() << " overdue loan(s), " << formatMoney(total) << " in fines" << endl;
+                }
+                else if (transChoice == 9) {
+                    vector<TitleLoans> top = library.topTitles(10);
+                    cout << "\nMost Borrowed Titles:" << endl;
+                    if (top.empty())
+                        cout << "No books have been borrowed yet" << endl;
+                    for (size_t i = 0; i < top.size(); i++)
+                        cout << (i + 1) << ". " << top[i].title << " by " << top[i].author
+                             << " (" << top[i].loans << " loan(s))" << endl;
+                    CirculationAnalytics stats(library.readSnapshot());
+                    vector<CategoryLoans> byType = stats.loansByUserType();
+                    cout << "\nLoans by User Type:" << endl;
+                    for (size_t i = 0; i < byType.size(); i++)
+                        cout << userCategoryPolicy(byType[i].category).name << ": " << byType[i].loans
+                             << " loan(s) by " << byType[i].users << " user(s)" << endl;
+                    vector<size_t> histogram = stats.loanHistogram();
+                    cout << "\nBooks by Times Borrowed:" << endl;
+                    for (size_t b = 0; b < histogram.size(); b++) {
+                        if (b == 0)
+                            cout << "Never";
+                        else if (b == 1)
+                            cout << "Once";
+                        else
+                            cout << (uint64_t(1) << (b - 1)) << " to " << ((uint64_t(1) << b) - 1) << " times";
+                        cout << ": " << histogram[b] << " book(s)" << endl;
+                    }
+                }
+                else if (transChoice == 10) {
                     break;
                 }
                 else {
@@ -614,6 +567,19 @@ int main() {
             }
         }
         else if (choice == 4) {
+            try {
+                library.checkpoint(SnapshotFile);
+            }
+            catch (LibraryException &e) {
+                cout << "ERROR: Could not save library: " << e.what() << endl;
+            }
+            library.attachLog(nullptr);
+            delete log;
+            library.attachTrace(nullptr);
+            delete recorder;
+#ifndef LIBRARY_NO_METRICS
+            delete reporter;
+#endif
             cout << "Thank you for using the Library System!" << endl;
             break;
         }
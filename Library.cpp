@@ -0,0 +1,6 @@
+// Definitions for the static members of the library core.
+
+#include "Library.h"
+
+IDSequence Book::nextBookID;
+IDSequence User::nextUserID;
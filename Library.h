@@ -0,0 +1,5873 @@
+// Core of the library management system: books, users, the Library
+// singleton that manages them, and the persistence, search, import,
+// report and analytics facilities built on top of it.
+
+#ifndef LIBRARY_H
+#define LIBRARY_H
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <map>
+#include <set>
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <cstddef>
+#include <new>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <shared_mutex>
+#include <condition_variable>
+#include <functional>
+#include <thread>
+#include <deque>
+#include <string_view>
+#include <chrono>
+#include <exception>
+#include <fstream>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+using namespace std;
+
+// Why a library call failed. Failures are counted by kind rather than by
+// message, so the counts stay a fixed size. The first kinds are the
+// failed TxnStatus values that the try* calls return.
+enum class LibraryError : unsigned char {
+    NoSuchUser, NoSuchBook, BookUnavailable, LimitReached, NotBorrowed,
+    HoldNotNeeded, AlreadyHeld, NoSuchHold, NoSuchTransfer,
+    InvalidInput,       // a bad ISBN, user type or the like
+    ISBNTaken,          // the ISBN belongs to another title
+    FileError,          // a file could not be opened, read or written
+    CorruptData,        // saved data, a log or a trace is unreadable
+    SocketError,        // a server socket could not be set up
+    Count
+};
+
+inline const char* libraryErrorName(LibraryError kind) {
+    static const char* const names[] = {
+        "noSuchUser", "noSuchBook", "bookUnavailable", "limitReached", "notBorrowed",
+        "holdNotNeeded", "alreadyHeld", "noSuchHold", "noSuchTransfer",
+        "invalidInput", "isbnTaken", "fileError", "corruptData", "socketError"
+    };
+    return names[static_cast<int>(kind)];
+}
+
+// Counts one failure (defined with the metrics below)
+inline void recordLibraryError(LibraryError kind);
+
+// Custom exception for library errors
+class LibraryException : public exception {
+private:
+    string message;
+    LibraryError kind;
+public:
+    // counted is set when a try* call's status is turned into an
+    // exception, as the status was counted already
+    LibraryException(const string &msg, LibraryError k, bool counted = false) : message(msg), kind(k) {
+        if (!counted)
+            recordLibraryError(kind);
+    }
+    LibraryError getKind() const { return kind; }
+    virtual const char* what() const noexcept {
+        return message.c_str();
+    }
+};
+
+// Interned, reference-counted strings. Equal strings share one copy, and a
+// pointer returned by intern() stays valid until it has been released as
+// many times as it was interned.
+class StringPool {
+private:
+    mutex lock;
+    unordered_map<string, size_t> refs;
+public:
+    static StringPool& shared() {
+        static StringPool instance;
+        return instance;
+    }
+    
+    const string* intern(const string &s) {
+        lock_guard<mutex> guard(lock);
+        unordered_map<string, size_t>::iterator it = refs.emplace(s, 0).first;
+        it->second++;
+        return &it->first;
+    }
+    
+    // intern() for n strings under one lock; out[i] is s[i]'s copy
+    void intern(const string_view* s, size_t n, const string** out) {
+        lock_guard<mutex> guard(lock);
+        refs.reserve(refs.size() + n);
+        for (size_t i = 0; i < n; i++) {
+            unordered_map<string, size_t>::iterator it = refs.emplace(string(s[i]), 0).first;
+            it->second++;
+            out[i] = &it->first;
+        }
+    }
+    
+    void release(const string* s) {
+        release(&s, 1);
+    }
+    
+    void release(const string* const* s, size_t n) {
+        lock_guard<mutex> guard(lock);
+        for (size_t i = 0; i < n; i++) {
+            unordered_map<string, size_t>::iterator it = refs.find(*s[i]);
+            if (--it->second == 0)
+                refs.erase(it);
+        }
+    }
+    
+    size_t size() {
+        lock_guard<mutex> guard(lock);
+        return refs.size();
+    }
+};
+
+// Hands out book or user IDs. A branch of a sharded library (shard s of n)
+// hands out s, s + n, s + 2n, ..., so an ID names the branch that owns the
+// record (ID % n) and branches never hand out the same ID.
+class IDSequence {
+private:
+    atomic<int> next;
+    int shard;
+    int shardCount;
+
+    // First ID at or after id that belongs to this shard
+    int align(int id) const {
+        if (id < 0)
+            id = 0;
+        return id + (shard - id % shardCount + shardCount) % shardCount;
+    }
+public:
+    IDSequence() : next(0), shard(0), shardCount(1) {}
+
+    int allocate() { return next.fetch_add(shardCount); }
+    int peek() const { return next; }
+    void reset(int id) { next = align(id); }
+
+    // Set before any IDs are handed out, e.g. at startup
+    void setShard(int s, int count) {
+        shard = s;
+        shardCount = count;
+        next = align(next);
+    }
+};
+
+// ISBN as a packed 64-bit key: the ISBN-13's digits read as one number
+// (ISBN-10s are converted to their 978 form), or 0 for none. Parsing
+// ignores hyphens and spaces and checks the check digit, so every way of
+// writing an ISBN gives the same key and typos are caught. The thirteen
+// digits are validated, checksummed and packed with SSE2 where available,
+// which keeps bulk loads cheap.
+class ISBN {
+private:
+    uint64_t key;
+    
+    // Validates and packs 13 ASCII digits held at buf[3..16) after three
+    // '0's, checking the ISBN-13 check digit
+    static bool pack13(const char* buf, uint64_t &out) {
+#if defined(__SSE2__) || defined(_M_X64)
+        __m128i zero = _mm_setzero_si128();
+        __m128i v = _mm_sub_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(buf)), _mm_set1_epi8('0'));
+        // Bytes that were not digits are now above 9 (those below '0' wrap)
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_subs_epu8(v, _mm_set1_epi8(9)), zero)) != 0xFFFF)
+            return false;
+        __m128i lo = _mm_unpacklo_epi8(v, zero);
+        __m128i hi = _mm_unpackhi_epi8(v, zero);
+        // ISBN digits alternate weights 1 and 3, starting with 1 at buf[3]
+        __m128i weights = _mm_setr_epi16(3, 1, 3, 1, 3, 1, 3, 1);
+        __m128i sum = _mm_add_epi32(_mm_madd_epi16(lo, weights), _mm_madd_epi16(hi, weights));
+        sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+        sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+        if (_mm_cvtsi128_si32(sum) % 10 != 0)
+            return false;
+        // Combine digits into pairs, the pairs into fours and the fours into
+        // two eight-digit halves
+        __m128i tens = _mm_setr_epi16(10, 1, 10, 1, 10, 1, 10, 1);
+        __m128i pairs = _mm_packs_epi32(_mm_madd_epi16(lo, tens), _mm_madd_epi16(hi, tens));
+        __m128i fours = _mm_madd_epi16(pairs, _mm_setr_epi16(100, 1, 100, 1, 100, 1, 100, 1));
+        fours = _mm_packs_epi32(fours, fours);
+        __m128i eights = _mm_madd_epi16(fours, _mm_setr_epi16(10000, 1, 10000, 1, 10000, 1, 10000, 1));
+        uint64_t high = static_cast<uint32_t>(_mm_cvtsi128_si32(eights));
+        uint64_t low = static_cast<uint32_t>(_mm_cvtsi128_si32(_mm_shuffle_epi32(eights, _MM_SHUFFLE(1, 1, 1, 1))));
+        out = high * 100000000 + low;
+        return true;
+#else
+        uint64_t n = 0;
+        int sum = 0;
+        for (int i = 0; i < 13; i++) {
+            unsigned d = static_cast<unsigned char>(buf[3 + i]) - '0';
+            if (d > 9)
+                return false;
+            n = n * 10 + d;
+            sum += (i % 2 ? 3 : 1) * static_cast<int>(d);
+        }
+        if (sum % 10 != 0)
+            return false;
+        out = n;
+        return true;
+#endif
+    }
+public:
+    ISBN() : key(0) {}
+    explicit ISBN(uint64_t k) : key(k) {}
+    
+    uint64_t value() const { return key; }
+    bool empty() const { return key == 0; }
+    bool operator==(const ISBN &o) const { return key == o.key; }
+    
+    // The thirteen digits, without hyphens
+    string str() const { return key ? to_string(key) : string(); }
+    
+    // The ISBN-13 made of twelve digits (e.g. 978 and nine more) and the
+    // check digit that completes them
+    static ISBN withCheckDigit(uint64_t first12) {
+        int sum = 0;
+        uint64_t n = first12;
+        for (int i = 11; i >= 0; i--, n /= 10)
+            sum += (i % 2 ? 3 : 1) * static_cast<int>(n % 10);
+        return ISBN(first12 * 10 + static_cast<uint64_t>((10 - sum % 10) % 10));
+    }
+    
+    // Reads an ISBN-10 or ISBN-13; false if text is not a valid one
+    static bool parse(string_view text, ISBN &out) {
+        char buf[16] = { '0', '0', '0' };
+        char* digits = buf + 3;
+        size_t n = 0;
+        for (size_t i = 0; i < text.size(); i++) {
+            if (text[i] == '-' || text[i] == ' ')
+                continue;
+            if (n == 13)
+                return false;
+            digits[n++] = text[i];
+        }
+        if (n == 10) {
+            // Nine digits and a check digit (X for 10) weighted 10 down to 1;
+            // the same book's ISBN-13 is 978, those nine digits and a new
+            // check digit
+            int sum = 0;
+            for (int i = 0; i < 9; i++) {
+                unsigned d = static_cast<unsigned char>(digits[i]) - '0';
+                if (d > 9)
+                    return false;
+                sum += (10 - i) * static_cast<int>(d);
+            }
+            char c = digits[9];
+            if (c == 'X' || c == 'x')
+                sum += 10;
+            else if (c >= '0' && c <= '9')
+                sum += c - '0';
+            else
+                return false;
+            if (sum % 11 != 0)
+                return false;
+            memmove(digits + 3, digits, 9);
+            memcpy(digits, "978", 3);
+            int sum13 = 0;
+            for (int i = 0; i < 12; i++)
+                sum13 += (i % 2 ? 3 : 1) * (digits[i] - '0');
+            digits[12] = static_cast<char>('0' + (10 - sum13 % 10) % 10);
+            n = 13;
+        }
+        uint64_t k;
+        if (n != 13 || !pack13(buf, k))
+            return false;
+        uint64_t prefix = k / 10000000000ULL;
+        if (prefix != 978 && prefix != 979)
+            return false;
+        out.key = k;
+        return true;
+    }
+    
+    // text as thirteen digits; empty stays empty, anything else that is not
+    // a valid ISBN throws
+    static string normalize(const string &text) {
+        ISBN isbn;
+        if (parse(text, isbn))
+            return isbn.str();
+        if (text.find_first_not_of(' ') == string::npos)
+            return string();
+        throw LibraryException("Invalid ISBN: " + text, LibraryError::InvalidInput);
+    }
+    
+    // text as thirteen digits if it is a valid ISBN, otherwise unchanged;
+    // for saved data from before ISBNs were checked
+    static string canonical(const string &text) {
+        ISBN isbn;
+        return parse(text, isbn) ? isbn.str() : text;
+    }
+};
+
+class Library;
+
+// Bibliographic record shared by every copy with the same title, author and
+// ISBN. It also carries the library's per-title circulation state (which
+// copies it has, which of them are free, and how many holds are waiting),
+// which only Library touches, under the title's record stripe.
+class TitleRecord {
+    friend class TitleRegistry;
+    friend class Library;
+private:
+    int titleID;
+    const string* title;
+    const string* author;
+    const string* isbn;
+    ISBN isbnKey;               // empty when isbn is (or is not a valid ISBN)
+    size_t refs;                // Books and catalog rows sharing this record
+    
+    vector<int> copies;         // IDs of the copies in the library
+    vector<int> freeCopies;     // IDs of the copies available to borrow
+    uint32_t holds;             // holds on the title, ready or waiting
+    uint32_t loans;             // times the copies in the library have been lent
+    
+    TitleRecord(int id, const string* t, const string* a, const string* i)
+        : titleID(id), title(t), author(a), isbn(i), refs(1), holds(0), loans(0) {
+        ISBN::parse(*i, isbnKey);
+    }
+public:
+    int getTitleID() const { return titleID; }
+    const string& getTitle() const { return *title; }
+    const string& getAuthor() const { return *author; }
+    const string& getISBN() const { return *isbn; }
+    ISBN getISBNKey() const { return isbnKey; }
+};
+
+// Hands out one TitleRecord per distinct title, author and ISBN, and
+// deletes it when the last holder (a Book or a catalog row) lets it go.
+// Thread-safe.
+class TitleRegistry {
+private:
+    // The strings are interned, so equal keys have equal pointers
+    struct Key {
+        const string* title;
+        const string* author;
+        const string* isbn;
+        bool operator==(const Key &o) const { return title == o.title && author == o.author && isbn == o.isbn; }
+    };
+    struct KeyHash {
+        size_t operator()(const Key &k) const {
+            hash<const void*> h;
+            return h(k.title) ^ (h(k.author) * 31) ^ (h(k.isbn) * 1009);
+        }
+    };
+    
+    mutex lock;
+    unordered_map<Key, TitleRecord*, KeyHash> records;
+    int nextTitleID;
+    
+    static void releaseStrings(const Key &key) {
+        StringPool &strings = StringPool::shared();
+        strings.release(key.title);
+        strings.release(key.author);
+        strings.release(key.isbn);
+    }
+public:
+    TitleRegistry() : nextTitleID(0) {}
+    
+    static TitleRegistry& shared() {
+        static TitleRegistry instance;
+        return instance;
+    }
+    
+    TitleRecord* acquire(const string &title, const string &author, const string &isbn) {
+        StringPool &strings = StringPool::shared();
+        Key key = { strings.intern(title), strings.intern(author), strings.intern(isbn) };
+        lock_guard<mutex> guard(lock);
+        unordered_map<Key, TitleRecord*, KeyHash>::iterator it = records.find(key);
+        if (it != records.end()) {
+            releaseStrings(key);
+            it->second->refs++;
+            return it->second;
+        }
+        TitleRecord* record = new TitleRecord(nextTitleID++, key.title, key.author, key.isbn);
+        records[key] = record;
+        return record;
+    }
+    
+    // A title wanted by a bulk load, and the record acquire() found or
+    // made for it with refs references
+    struct Wanted {
+        string_view title;
+        string_view author;
+        string_view isbn;
+        size_t refs;
+        TitleRecord* record;
+    };
+    
+    // acquire() for many titles, taking the string pool's lock and then
+    // the registry's once for the lot
+    void acquire(vector<Wanted> &wanted) {
+        vector<string_view> fields;
+        fields.reserve(wanted.size() * 3);
+        for (size_t i = 0; i < wanted.size(); i++) {
+            fields.push_back(wanted[i].title);
+            fields.push_back(wanted[i].author);
+            fields.push_back(wanted[i].isbn);
+        }
+        vector<const string*> interned(fields.size());
+        StringPool::shared().intern(fields.data(), fields.size(), interned.data());
+        vector<const string*> unneeded;     // strings of records that already existed
+        {
+            lock_guard<mutex> guard(lock);
+            records.reserve(records.size() + wanted.size());
+            for (size_t i = 0; i < wanted.size(); i++) {
+                Key key = { interned[i * 3], interned[i * 3 + 1], interned[i * 3 + 2] };
+                pair<unordered_map<Key, TitleRecord*, KeyHash>::iterator, bool> found = records.emplace(key, nullptr);
+                if (found.second) {
+                    found.first->second = new TitleRecord(nextTitleID++, key.title, key.author, key.isbn);
+                    found.first->second->refs = wanted[i].refs;
+                } else {
+                    unneeded.insert(unneeded.end(), &interned[i * 3], &interned[i * 3] + 3);
+                    found.first->second->refs += wanted[i].refs;
+                }
+                wanted[i].record = found.first->second;
+            }
+        }
+        if (!unneeded.empty())
+            StringPool::shared().release(unneeded.data(), unneeded.size());
+    }
+    
+    // Adds a reference to a record already held, for a holder other than
+    // a Book; each retain needs its own release
+    void retain(TitleRecord* record) {
+        lock_guard<mutex> guard(lock);
+        record->refs++;
+    }
+    
+    void retain(const vector<TitleRecord*> &held) {
+        lock_guard<mutex> guard(lock);
+        for (size_t i = 0; i < held.size(); i++)
+            held[i]->refs++;
+    }
+    
+    void release(TitleRecord* record) {
+        lock_guard<mutex> guard(lock);
+        if (--record->refs != 0)
+            return;
+        Key key = { record->title, record->author, record->isbn };
+        records.erase(key);
+        releaseStrings(key);
+        delete record;
+    }
+    
+    size_t size() {
+        lock_guard<mutex> guard(lock);
+        return records.size();
+    }
+};
+
+// Book class: one copy of a title, identified by its book ID. The title,
+// author and ISBN live in the TitleRecord shared by all copies, and whether
+// the copy is out is tracked by the Library, so a Book is just two fields.
+class Book {
+private:
+    static IDSequence nextBookID;
+    int bookID;
+    TitleRecord* record;
+public:
+    Book(string t, string a, string i) {
+        bookID = nextBookID.allocate();
+        record = TitleRegistry::shared().acquire(t, a, i);
+    }
+    
+    // Recreates a saved book with its original ID
+    Book(int id, string t, string a, string i) {
+        bookID = id;
+        record = TitleRegistry::shared().acquire(t, a, i);
+    }
+    // A new copy of a title the caller has already taken a reference to
+    // for it, as TitleRegistry's bulk acquire() does
+    explicit Book(TitleRecord* r) {
+        bookID = nextBookID.allocate();
+        record = r;
+    }
+    ~Book() { TitleRegistry::shared().release(record); }
+    Book(const Book&) = delete;
+    Book& operator=(const Book&) = delete;
+    
+    static int getNextBookID() { return nextBookID.peek(); }
+    static void setNextBookID(int id) { nextBookID.reset(id); }
+    static void setIDShard(int shard, int shardCount) { nextBookID.setShard(shard, shardCount); }
+    
+    int getBookID() { return bookID; }
+    TitleRecord* getTitleRecord() { return record; }
+    const string& getTitle() { return record->getTitle(); }
+    const string& getAuthor() { return record->getAuthor(); }
+    const string& getISBN() { return record->getISBN(); }
+    
+    // Makes this a copy of a different title
+    void editBook(string newTitle, string newAuthor, string newISBN) {
+        TitleRecord* edited = TitleRegistry::shared().acquire(newTitle, newAuthor, newISBN);
+        TitleRegistry::shared().release(record);
+        record = edited;
+    }
+};
+
+// User categories. The values are the type codes shown in the menu and
+// stored in snapshots and the log, so existing ones must not change.
+enum class UserCategory : unsigned char {
+    Student = 1,
+    Faculty = 2,
+    Staff = 3,
+    Alumni = 4,
+    Guest = 5
+};
+
+// What each category is called, how many books it may hold at once, and
+// where its holds queue (lower priorities are served first)
+struct UserCategoryPolicy {
+    UserCategory category;
+    const char* name;
+    int maxBooks;
+    int holdPriority;
+    int loanDays;           // loan period
+    int fineCentsPerDay;    // charged for each day or part day overdue
+};
+
+// One row per category, in type code order. Adding a category means adding
+// an enum value and a row here.
+constexpr UserCategoryPolicy userCategoryPolicies[] = {
+    { UserCategory::Student, "Student", 3, 2, 21, 25 },
+    { UserCategory::Faculty, "Faculty", 5, 0, 90, 10 },
+    { UserCategory::Staff,   "Staff",   4, 1, 30, 10 },
+    { UserCategory::Alumni,  "Alumni",  2, 3, 14, 50 },
+    { UserCategory::Guest,   "Guest",   1, 4,  7, 100 }
+};
+
+constexpr int UserCategoryCount = sizeof(userCategoryPolicies) / sizeof(userCategoryPolicies[0]);
+
+constexpr const UserCategoryPolicy& userCategoryPolicy(UserCategory category) {
+    return userCategoryPolicies[static_cast<int>(category) - 1];
+}
+
+inline bool isUserCategoryCode(int code) { return code >= 1 && code <= UserCategoryCount; }
+
+// Accepts a type code ("1") or a category name in any case ("faculty").
+// Returns 0 when the text names no category.
+inline int parseUserCategory(string_view text) {
+    if (text.size() == 1 && isUserCategoryCode(text[0] - '0'))
+        return text[0] - '0';
+    for (int i = 0; i < UserCategoryCount; i++) {
+        const char* name = userCategoryPolicies[i].name;
+        if (text.size() != strlen(name))
+            continue;
+        size_t j = 0;
+        while (j < text.size() && tolower(static_cast<unsigned char>(text[j])) == tolower(static_cast<unsigned char>(name[j])))
+            j++;
+        if (j == text.size())
+            return i + 1;
+    }
+    return 0;
+}
+
+// User: an ID, name, category and list of borrowed book IDs. Behaviour that
+// differs between kinds of user comes from the category's policy row.
+class User {
+private:
+    static IDSequence nextUserID;
+    int userID;
+    UserCategory category;
+    string name;
+    vector<int> borrowedBooks;  
+public:
+    User(UserCategory c, string n) {
+        userID = nextUserID.allocate();
+        category = c;
+        name = n;
+    }
+    
+    // Recreates a saved user with its original ID
+    User(int id, UserCategory c, string n) {
+        userID = id;
+        category = c;
+        name = n;
+    }
+    
+    static int getNextUserID() { return nextUserID.peek(); }
+    static void setNextUserID(int id) { nextUserID.reset(id); }
+    static void setIDShard(int shard, int shardCount) { nextUserID.setShard(shard, shardCount); }
+    
+    int getUserID() { return userID; }
+    const string& getName() { return name; }
+    UserCategory getCategory() { return category; }
+    
+    // Category name, e.g. "Student"
+    const char* getUserType() { return userCategoryPolicy(category).name; }
+    
+    // Type code as accepted by UserFactory::createUser
+    int getUserTypeCode() { return static_cast<int>(category); }
+    
+    int getMaxBooks() { return userCategoryPolicy(category).maxBooks; }
+    
+    bool canBorrow() { return borrowedBooks.size() < static_cast<unsigned>(getMaxBooks()); }
+    
+    // Adds bookID to the borrowed list and returns its position there
+    size_t borrowBook(int bookID) {
+        borrowedBooks.push_back(bookID);
+        return borrowedBooks.size() - 1;
+    }
+    
+    // Removes the loan at position pos in O(1) by moving the last loan into
+    // its place. Returns the ID of the book that moved, or -1 if none did.
+    int removeLoanAt(size_t pos) {
+        int moved = -1;
+        if (pos != borrowedBooks.size() - 1) {
+            moved = borrowedBooks.back();
+            borrowedBooks[pos] = moved;
+        }
+        borrowedBooks.pop_back();
+        return moved;
+    }
+    
+    // Books the user has out; order changes as books are returned
+    const vector<int>& getBorrowedBooks() { return borrowedBooks; }
+    
+    void editUser(string newName) {
+        name = newName;
+    }
+};
+
+// Fixed-size slab allocator. Objects are carved out of large blocks and
+// freed slots are recycled through an intrusive free list, so creating and
+// destroying books or users does not hit malloc once a block exists.
+template <size_t SlotSize>
+class SlabPool {
+private:
+    union Slot {
+        Slot* next;
+        alignas(max_align_t) unsigned char storage[SlotSize];
+    };
+    static const size_t SlotsPerBlock = 1024;
+    
+    mutex lock;
+    vector<Slot*> blocks;
+    vector<Slot*> spareBlocks;   // allocated by reserve() but not yet in use
+    Slot* freeList;
+    size_t nextInBlock;          // first never-used slot in blocks.back()
+    
+    void addBlock() {
+        if (!spareBlocks.empty()) {
+            blocks.push_back(spareBlocks.back());
+            spareBlocks.pop_back();
+        } else {
+            blocks.push_back(new Slot[SlotsPerBlock]);
+        }
+        nextInBlock = 0;
+    }
+public:
+    SlabPool() : freeList(nullptr), nextInBlock(SlotsPerBlock) {}
+    ~SlabPool() {
+        for (size_t i = 0; i < blocks.size(); i++)
+            delete[] blocks[i];
+        for (size_t i = 0; i < spareBlocks.size(); i++)
+            delete[] spareBlocks[i];
+    }
+    SlabPool(const SlabPool&) = delete;
+    SlabPool& operator=(const SlabPool&) = delete;
+    
+    void* allocate() {
+        lock_guard<mutex> guard(lock);
+        if (freeList) {
+            Slot* slot = freeList;
+            freeList = slot->next;
+            return slot;
+        }
+        if (nextInBlock == SlotsPerBlock)
+            addBlock();
+        return &blocks.back()[nextInBlock++];
+    }
+    
+    void release(void* p) {
+        lock_guard<mutex> guard(lock);
+        Slot* slot = static_cast<Slot*>(p);
+        slot->next = freeList;
+        freeList = slot;
+    }
+    
+    // Pre-allocates enough blocks that the next n allocations need no new memory
+    void reserve(size_t n) {
+        lock_guard<mutex> guard(lock);
+        size_t spare = SlotsPerBlock - nextInBlock + spareBlocks.size() * SlotsPerBlock;
+        while (spare < n) {
+            spareBlocks.push_back(new Slot[SlotsPerBlock]);
+            spare += SlotsPerBlock;
+        }
+    }
+    
+    // Bytes held by the pool, including unused slots
+    size_t capacityBytes() { 
+        lock_guard<mutex> guard(lock);
+        return (blocks.size() + spareBlocks.size()) * SlotsPerBlock * sizeof(Slot);
+    }
+};
+
+// Factory for creating Book objects
+class BookFactory {
+public:
+    typedef SlabPool<sizeof(Book)> Pool;
+    
+    static Pool& pool() {
+        static Pool instance;
+        return instance;
+    }
+    
+    // The ISBN may be empty; otherwise it must be valid, and is stored as
+    // thirteen digits
+    static Book* createBook(string title, string author, string isbn) {
+        string normalized = ISBN::normalize(isbn);
+        return new (pool().allocate()) Book(title, author, normalized);
+    }
+    
+    // A copy of an acquired title; the book takes over one of the
+    // caller's references to it
+    static Book* createBook(TitleRecord* record) {
+        return new (pool().allocate()) Book(record);
+    }
+    
+    // Saved ISBNs are not checked, but valid ones are normalized
+    static Book* restoreBook(int bookID, string title, string author, string isbn) {
+        string normalized = ISBN::canonical(isbn);
+        return new (pool().allocate()) Book(bookID, title, author, normalized);
+    }
+    
+    static void destroyBook(Book* book) {
+        book->~Book();
+        pool().release(book);
+    }
+};
+
+// Factory for creating User objects
+class UserFactory {
+public:
+    typedef SlabPool<sizeof(User)> Pool;
+    
+    static Pool& pool() {
+        static Pool instance;
+        return instance;
+    }
+    
+    static User* createUser(int userType, string name) {
+        if (!isUserCategoryCode(userType))
+            throw LibraryException("Only valid options are 1 to " + to_string(UserCategoryCount), LibraryError::InvalidInput);
+        return new (pool().allocate()) User(static_cast<UserCategory>(userType), name);
+    }
+    
+    static User* restoreUser(int userType, int userID, string name) {
+        if (!isUserCategoryCode(userType))
+            throw LibraryException("Unknown user type in saved data.", LibraryError::CorruptData);
+        return new (pool().allocate()) User(userID, static_cast<UserCategory>(userType), name);
+    }
+    
+    static void destroyUser(User* user) {
+        user->~User();
+        pool().release(user);
+    }
+};
+
+// Book fields that have a secondary index
+enum class BookField { Title, Author, ISBN };
+
+// How a search string is compared against an indexed field
+enum class MatchMode { Exact, Prefix, IgnoreCase, PrefixIgnoreCase };
+
+// Secondary index over one field of the titles in the catalog. A title is
+// indexed once, however many copies it has. Keys are stored lowercased in
+// an ordered map, so every match mode is a range scan starting at
+// lower_bound; case-sensitive modes then check the title's actual field.
+// Each title remembers its entry, so removing it needs no search.
+class FieldIndex {
+private:
+    typedef multimap<string, TitleRecord*>::iterator Entry;
+    BookField field;
+    multimap<string, TitleRecord*> entries;
+    unordered_map<const TitleRecord*, Entry> positions;
+
+    static string toLower(const string &s) {
+        string out(s);
+        for (size_t i = 0; i < out.size(); i++)
+            out[i] = static_cast<char>(tolower(static_cast<unsigned char>(out[i])));
+        return out;
+    }
+
+    const string& fieldOf(const TitleRecord* t) const {
+        if (field == BookField::Title)
+            return t->getTitle();
+        if (field == BookField::Author)
+            return t->getAuthor();
+        return t->getISBN();
+    }
+public:
+    FieldIndex(BookField f) : field(f) {}
+
+    void insert(TitleRecord* title) {
+        positions[title] = entries.insert(make_pair(toLower(fieldOf(title)), title));
+    }
+
+    // insert() for many titles. They go in sorted, each starting from
+    // where the last one went, so a bulk load does not search the tree.
+    void insert(const vector<TitleRecord*> &titles) {
+        vector<pair<string, TitleRecord*>> keyed;
+        keyed.reserve(titles.size());
+        for (size_t i = 0; i < titles.size(); i++)
+            keyed.push_back(make_pair(toLower(fieldOf(titles[i])), titles[i]));
+        sort(keyed.begin(), keyed.end());
+        positions.reserve(positions.size() + keyed.size());
+        Entry hint = entries.end();
+        for (size_t i = 0; i < keyed.size(); i++) {
+            Entry at = entries.emplace_hint(hint, move(keyed[i].first), keyed[i].second);
+            positions[keyed[i].second] = at;
+            hint = next(at);
+        }
+    }
+
+    void erase(TitleRecord* title) {
+        unordered_map<const TitleRecord*, Entry>::iterator it = positions.find(title);
+        if (it == positions.end())
+            return;
+        entries.erase(it->second);
+        positions.erase(it);
+    }
+
+    // Returns every title whose field matches text, in index order.
+    vector<TitleRecord*> find(const string &text, MatchMode mode) const {
+        vector<TitleRecord*> result;
+        string key = toLower(text);
+        bool prefix = (mode == MatchMode::Prefix || mode == MatchMode::PrefixIgnoreCase);
+        bool caseSensitive = (mode == MatchMode::Exact || mode == MatchMode::Prefix);
+        for (multimap<string, TitleRecord*>::const_iterator it = entries.lower_bound(key); it != entries.end(); ++it) {
+            if (prefix ? it->first.compare(0, key.size(), key) != 0 : it->first != key)
+                break;
+            if (caseSensitive && fieldOf(it->second).compare(0, prefix ? text.size() : string::npos, text) != 0)
+                continue;
+            result.push_back(it->second);
+        }
+        return result;
+    }
+    
+    void clear() {
+        entries.clear();
+        positions.clear();
+    }
+};
+
+// Inverted index over the words in each title and author, one posting per
+// title. Postings lists are sorted by title ID so a multi-term AND query is
+// an intersection of sorted lists. Each posting carries a weight (title
+// words count double) that is summed across terms to rank the results.
+// Removing a title leaves tombstones in its lists, which are compacted once
+// they make up half of a list, so removal costs O(log n) per word and no
+// shifting.
+class TextIndex {
+private:
+    struct Posting {
+        int titleID;
+        int weight;
+        TitleRecord* title;         // null once removed
+    };
+    struct PostingList {
+        vector<Posting> postings;
+        size_t removed = 0;
+    };
+    unordered_map<string, PostingList> lists;
+
+    // Splits text into lowercase alphanumeric words, calling add(word)
+    // for each
+    template <typename Add>
+    static void forEachWord(const string &text, Add add) {
+        string word;
+        for (size_t i = 0; i <= text.size(); i++) {
+            unsigned char c = i < text.size() ? static_cast<unsigned char>(text[i]) : ' ';
+            if (isalnum(c)) {
+                word += static_cast<char>(tolower(c));
+            } else if (!word.empty()) {
+                add(word);
+                word.clear();
+            }
+        }
+    }
+
+    static vector<string> tokenize(const string &text) {
+        vector<string> words;
+        forEachWord(text, [&words](const string &w) { words.push_back(w); });
+        return words;
+    }
+
+    // Each distinct word of the title and author with its weight, sorted
+    static vector<pair<string, int>> termsOf(const TitleRecord* title) {
+        vector<pair<string, int>> terms;
+        forEachWord(title->getTitle(), [&terms](const string &w) { terms.push_back(make_pair(w, 2)); });
+        forEachWord(title->getAuthor(), [&terms](const string &w) { terms.push_back(make_pair(w, 1)); });
+        sort(terms.begin(), terms.end());
+        size_t kept = 0;
+        for (size_t i = 0; i < terms.size(); i++) {
+            if (kept > 0 && terms[kept - 1].first == terms[i].first)
+                terms[kept - 1].second += terms[i].second;
+            else if (kept++ != i)
+                terms[kept - 1] = move(terms[i]);
+        }
+        terms.resize(kept);
+        return terms;
+    }
+
+    static bool byTitleID(const Posting &p, int titleID) { return p.titleID < titleID; }
+    static bool isRemoved(const Posting &p) { return p.title == nullptr; }
+public:
+    void insert(TitleRecord* title) {
+        vector<pair<string, int>> terms = termsOf(title);
+        for (vector<pair<string, int>>::iterator t = terms.begin(); t != terms.end(); ++t) {
+            PostingList &list = lists[t->first];
+            Posting p = { title->getTitleID(), t->second, title };
+            // Title IDs are handed out in increasing order, so this is usually an append
+            if (list.postings.empty() || list.postings.back().titleID < p.titleID) {
+                list.postings.push_back(p);
+                continue;
+            }
+            vector<Posting>::iterator at = lower_bound(list.postings.begin(), list.postings.end(), p.titleID, byTitleID);
+            if (at != list.postings.end() && at->titleID == p.titleID) {
+                if (isRemoved(*at))
+                    list.removed--;
+                *at = p;
+            } else {
+                list.postings.insert(at, p);
+            }
+        }
+    }
+
+    void erase(TitleRecord* title) {
+        vector<pair<string, int>> terms = termsOf(title);
+        for (vector<pair<string, int>>::iterator t = terms.begin(); t != terms.end(); ++t) {
+            unordered_map<string, PostingList>::iterator it = lists.find(t->first);
+            if (it == lists.end())
+                continue;
+            PostingList &list = it->second;
+            vector<Posting>::iterator p = lower_bound(list.postings.begin(), list.postings.end(), title->getTitleID(), byTitleID);
+            if (p == list.postings.end() || p->titleID != title->getTitleID() || isRemoved(*p))
+                continue;
+            p->title = nullptr;
+            list.removed++;
+            if (list.removed == list.postings.size()) {
+                lists.erase(it);
+            } else if (list.removed * 2 >= list.postings.size()) {
+                list.postings.erase(remove_if(list.postings.begin(), list.postings.end(), isRemoved), list.postings.end());
+                list.removed = 0;
+            }
+        }
+    }
+
+    // Returns the titles containing every word in query, best match first
+    vector<TitleRecord*> search(const string &query) const {
+        vector<string> words = tokenize(query);
+        sort(words.begin(), words.end());
+        words.erase(unique(words.begin(), words.end()), words.end());
+        
+        vector<const vector<Posting>*> found;
+        for (size_t i = 0; i < words.size(); i++) {
+            unordered_map<string, PostingList>::const_iterator it = lists.find(words[i]);
+            if (it == lists.end())
+                return vector<TitleRecord*>();
+            found.push_back(&it->second.postings);
+        }
+        if (found.empty())
+            return vector<TitleRecord*>();
+        
+        // Walk the shortest list and probe the others
+        sort(found.begin(), found.end(),
+             [](const vector<Posting>* a, const vector<Posting>* b) { return a->size() < b->size(); });
+        vector<pair<int, const Posting*>> hits;   // (score, posting)
+        vector<vector<Posting>::const_iterator> cursors;
+        for (size_t i = 0; i < found.size(); i++)
+            cursors.push_back(found[i]->begin());
+        for (size_t k = 0; k < found[0]->size(); k++) {
+            const Posting &candidate = (*found[0])[k];
+            if (isRemoved(candidate))
+                continue;
+            int score = candidate.weight;
+            bool inAll = true;
+            for (size_t i = 1; i < found.size() && inAll; i++) {
+                cursors[i] = lower_bound(cursors[i], found[i]->end(), candidate.titleID, byTitleID);
+                if (cursors[i] == found[i]->end() || cursors[i]->titleID != candidate.titleID || isRemoved(*cursors[i]))
+                    inAll = false;
+                else
+                    score += cursors[i]->weight;
+            }
+            if (inAll)
+                hits.push_back(make_pair(score, &candidate));
+        }
+        
+        sort(hits.begin(), hits.end(), [](const pair<int, const Posting*> &a, const pair<int, const Posting*> &b) {
+            return a.first != b.first ? a.first > b.first : a.second->titleID < b.second->titleID;
+        });
+        vector<TitleRecord*> result;
+        for (size_t i = 0; i < hits.size(); i++)
+            result.push_back(hits[i].second->title);
+        return result;
+    }
+    
+    void clear() { lists.clear(); }
+};
+
+// Read-only view of a whole file. Uses mmap where available so loading a
+// snapshot doesn't copy it through read() first.
+class MappedFile {
+private:
+    const char* data;
+    size_t length;
+#ifdef _WIN32
+    vector<char> buffer;
+#endif
+public:
+    MappedFile(const string &path) : data(nullptr), length(0) {
+#ifdef _WIN32
+        ifstream in(path.c_str(), ios::binary);
+        if (!in)
+            throw LibraryException("Cannot open " + path, LibraryError::FileError);
+        buffer.assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+        data = buffer.data();
+        length = buffer.size();
+#else
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            throw LibraryException("Cannot open " + path, LibraryError::FileError);
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            close(fd);
+            throw LibraryException("Cannot read " + path, LibraryError::FileError);
+        }
+        length = static_cast<size_t>(st.st_size);
+        if (length > 0) {
+            void* p = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p == MAP_FAILED) {
+                close(fd);
+                throw LibraryException("Cannot map " + path, LibraryError::FileError);
+            }
+            madvise(p, length, MADV_SEQUENTIAL);
+            data = static_cast<const char*>(p);
+        }
+        close(fd);
+#endif
+    }
+    ~MappedFile() {
+#ifndef _WIN32
+        if (data)
+            munmap(const_cast<char*>(data), length);
+#endif
+    }
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    
+    const char* begin() const { return data; }
+    size_t size() const { return length; }
+};
+
+// Appends fixed-width integers and length-prefixed strings to a byte buffer.
+// Integers are written in host byte order.
+class BinaryWriter {
+private:
+    string out;
+public:
+    void putU8(uint8_t v) { out.push_back(static_cast<char>(v)); }
+    void putU32(uint32_t v) { out.append(reinterpret_cast<const char*>(&v), sizeof(v)); }
+    void putI32(int32_t v) { out.append(reinterpret_cast<const char*>(&v), sizeof(v)); }
+    void putI64(int64_t v) { out.append(reinterpret_cast<const char*>(&v), sizeof(v)); }
+    void putString(const string &s) {
+        putU32(static_cast<uint32_t>(s.size()));
+        out.append(s);
+    }
+    // Seven bits per byte, low bits first; small values take one byte
+    void putVarint(uint64_t v) {
+        while (v >= 0x80) {
+            out.push_back(static_cast<char>((v & 0x7f) | 0x80));
+            v >>= 7;
+        }
+        out.push_back(static_cast<char>(v));
+    }
+    void putBytes(const char* p, size_t n) { out.append(p, n); }
+    const string& bytes() const { return out; }
+    void clear() { out.clear(); }
+};
+
+// Reads back what BinaryWriter wrote, throwing if the data runs short.
+class BinaryReader {
+private:
+    const char* pos;
+    const char* end;
+    
+    void need(size_t n) {
+        if (static_cast<size_t>(end - pos) < n)
+            throw LibraryException("Saved data is truncated or corrupt.", LibraryError::CorruptData);
+    }
+public:
+    BinaryReader(const char* data, size_t size) : pos(data), end(data + size) {}
+    
+    uint8_t getU8() {
+        need(1);
+        return static_cast<uint8_t>(*pos++);
+    }
+    uint32_t getU32() {
+        uint32_t v;
+        need(sizeof(v));
+        memcpy(&v, pos, sizeof(v));
+        pos += sizeof(v);
+        return v;
+    }
+    int32_t getI32() {
+        int32_t v;
+        need(sizeof(v));
+        memcpy(&v, pos, sizeof(v));
+        pos += sizeof(v);
+        return v;
+    }
+    int64_t getI64() {
+        int64_t v;
+        need(sizeof(v));
+        memcpy(&v, pos, sizeof(v));
+        pos += sizeof(v);
+        return v;
+    }
+    string getString() {
+        uint32_t n = getU32();
+        need(n);
+        string s(pos, n);
+        pos += n;
+        return s;
+    }
+    uint64_t getVarint() {
+        uint64_t v = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            uint8_t b = getU8();
+            v |= static_cast<uint64_t>(b & 0x7f) << shift;
+            if (!(b & 0x80))
+                return v;
+        }
+        throw LibraryException("Saved data is truncated or corrupt.", LibraryError::CorruptData);
+    }
+    string getBytes(size_t n) {
+        need(n);
+        string s(pos, n);
+        pos += n;
+        return s;
+    }
+    bool atEnd() const { return pos == end; }
+};
+
+// Pushes a stdio stream's buffered data all the way to disk
+inline bool syncStream(FILE* f) {
+    if (fflush(f) != 0)
+        return false;
+#ifdef _WIN32
+    return _commit(_fileno(f)) == 0;
+#else
+    return fsync(fileno(f)) == 0;
+#endif
+}
+
+// Append-only log of mutating Library operations.
+//
+// Each record is framed as u32 payload length, u32 checksum, payload, so a
+// record torn by a crash is detected on replay and everything from it on is
+// ignored. append() only buffers the record and returns its sequence
+// number; waitDurable() makes it durable with group commit. The first
+// waiter becomes the leader, writes everything buffered so far and fsyncs
+// once. Waiters that arrive meanwhile are covered by the leader's write or
+// by the next one. A failed write or fsync may leave part of a batch in the
+// file, so the log is then marked failed: durableLSN stays where it was and
+// every wait throws until a checkpoint truncates the log.
+class TransactionLog {
+private:
+    string path;
+    FILE* file;
+    mutex lock;
+    condition_variable flushed;
+    string pending;
+    uint64_t appendedLSN;
+    uint64_t durableLSN;
+    bool flushing;
+    bool failed;
+public:
+    // FNV-1a; also frames the chunks of a TraceRecorder
+    static uint32_t checksum(const char* data, size_t n) {
+        uint32_t h = 2166136261u;
+        for (size_t i = 0; i < n; i++) {
+            h ^= static_cast<unsigned char>(data[i]);
+            h *= 16777619u;
+        }
+        return h;
+    }
+    
+    TransactionLog(const string &logPath)
+        : path(logPath), file(nullptr), appendedLSN(0), durableLSN(0), flushing(false), failed(false) {
+        file = fopen(path.c_str(), "ab");
+        if (!file)
+            throw LibraryException("Cannot open " + path, LibraryError::FileError);
+    }
+    ~TransactionLog() {
+        try {
+            flush();
+        }
+        catch (LibraryException &) {
+        }
+        if (file)
+            fclose(file);
+    }
+    TransactionLog(const TransactionLog&) = delete;
+    TransactionLog& operator=(const TransactionLog&) = delete;
+    
+    // Buffers one record and returns its sequence number
+    uint64_t append(const string &payload) {
+        uint32_t header[2] = { static_cast<uint32_t>(payload.size()), checksum(payload.data(), payload.size()) };
+        lock_guard<mutex> guard(lock);
+        pending.append(reinterpret_cast<const char*>(header), sizeof(header));
+        pending.append(payload);
+        return ++appendedLSN;
+    }
+    
+    // Blocks until record lsn (and everything before it) is on disk
+    void waitDurable(uint64_t lsn) {
+        unique_lock<mutex> guard(lock);
+        while (durableLSN < lsn) {
+            if (failed)
+                throw LibraryException("Cannot write " + path, LibraryError::FileError);
+            if (flushing) {
+                flushed.wait(guard);
+                continue;
+            }
+            flushing = true;
+            string batch;
+            batch.swap(pending);
+            uint64_t batchEnd = appendedLSN;
+            guard.unlock();
+            bool ok = fwrite(batch.data(), 1, batch.size(), file) == batch.size() && syncStream(file);
+            guard.lock();
+            flushing = false;
+            if (ok)
+                durableLSN = batchEnd;
+            else
+                failed = true;
+            flushed.notify_all();
+        }
+    }
+    
+    void flush() {
+        uint64_t last;
+        {
+            lock_guard<mutex> guard(lock);
+            last = appendedLSN;
+        }
+        waitDurable(last);
+    }
+    
+    // Discards every record, buffered or written, and clears a failure.
+    // Used once a checkpoint snapshot covers them; the caller must keep new
+    // records from being appended meanwhile.
+    void truncate() {
+        unique_lock<mutex> guard(lock);
+        while (flushing)
+            flushed.wait(guard);
+        pending.clear();
+        durableLSN = appendedLSN;
+        FILE* fresh = file ? freopen(path.c_str(), "wb", file) : fopen(path.c_str(), "wb");
+        if (!fresh) {
+            file = nullptr;         // freopen closed it
+            failed = true;
+            throw LibraryException("Cannot truncate " + path, LibraryError::FileError);
+        }
+        file = fresh;
+        failed = !syncStream(file);
+    }
+    
+    // Calls apply once per intact record in the log at logPath and returns
+    // how many were applied. A missing log has no records.
+    static size_t replay(const string &logPath, const function<void(BinaryReader&)> &apply) {
+        ifstream exists(logPath.c_str());
+        if (!exists)
+            return 0;
+        exists.close();
+        MappedFile file(logPath);
+        const char* pos = file.begin();
+        const char* end = pos + file.size();
+        size_t count = 0;
+        while (static_cast<size_t>(end - pos) >= 2 * sizeof(uint32_t)) {
+            uint32_t header[2];
+            memcpy(header, pos, sizeof(header));
+            const char* payload = pos + sizeof(header);
+            if (static_cast<size_t>(end - payload) < header[0] || checksum(payload, header[0]) != header[1])
+                break;
+            BinaryReader r(payload, header[0]);
+            apply(r);
+            pos = payload + header[0];
+            count++;
+        }
+        return count;
+    }
+};
+
+// Operation codes written to the transaction log
+enum class LogOp : uint8_t {
+    AddBook = 1,
+    EditBook,
+    RemoveBook,
+    RegisterUser,
+    EditUser,
+    RemoveUser,
+    Borrow,
+    Return,
+    PlaceHold,
+    CancelHold,
+    ExpireHold,
+    PrepareTransfer,
+    CommitTransfer,
+    AbortTransfer,
+    LendRemote,
+    ReturnRemote,
+    EndRemoteLoan
+};
+
+// Output formats for book and user reports
+enum class ReportFormat { Text, CSV, JSON };
+
+// Buffered destination for reports. Output collects in a 64 KB buffer and
+// reaches the FILE* in large writes, rather than one flush per line.
+class ReportSink {
+private:
+    FILE* out;
+    string buffer;
+    static const size_t Capacity = 1 << 16;
+public:
+    ReportSink(FILE* f) : out(f) { buffer.reserve(Capacity); }
+    ~ReportSink() { flush(); }
+    ReportSink(const ReportSink&) = delete;
+    ReportSink& operator=(const ReportSink&) = delete;
+    
+    void write(const char* p, size_t n) {
+        if (buffer.size() + n > Capacity)
+            flush();
+        if (n >= Capacity)
+            fwrite(p, 1, n, out);
+        else
+            buffer.append(p, n);
+    }
+    
+    ReportSink& operator<<(const string &s) { write(s.data(), s.size()); return *this; }
+    ReportSink& operator<<(const char* s) { write(s, strlen(s)); return *this; }
+    ReportSink& operator<<(char c) { write(&c, 1); return *this; }
+    ReportSink& operator<<(int v) {
+        char digits[16];
+        int n = snprintf(digits, sizeof(digits), "%d", v);
+        write(digits, static_cast<size_t>(n));
+        return *this;
+    }
+    
+    // Writes s as a CSV field, quoted only when it needs to be
+    void csvField(const string &s) {
+        if (s.find_first_of(",\"\r\n") == string::npos) {
+            *this << s;
+            return;
+        }
+        *this << '"';
+        for (size_t i = 0; i < s.size(); i++) {
+            if (s[i] == '"')
+                *this << '"';
+            *this << s[i];
+        }
+        *this << '"';
+    }
+    
+    // Writes s as a quoted JSON string
+    void jsonString(const string &s) {
+        *this << '"';
+        for (size_t i = 0; i < s.size(); i++) {
+            unsigned char c = static_cast<unsigned char>(s[i]);
+            if (c == '"' || c == '\\') {
+                *this << '\\' << static_cast<char>(c);
+            } else if (c < 0x20) {
+                char escaped[8];
+                snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                *this << escaped;
+            } else {
+                *this << static_cast<char>(c);
+            }
+        }
+        *this << '"';
+    }
+    
+    void flush() {
+        if (!buffer.empty()) {
+            fwrite(buffer.data(), 1, buffer.size(), out);
+            buffer.clear();
+        }
+        fflush(out);
+    }
+};
+
+// Public Library operations that the metrics time
+enum class LibraryOp {
+    AddBook, AddBooks, GetBook, EditBook, RemoveBook,
+    FindBookByTitle, FindBooks, SearchBooks,
+    RegisterUser, RegisterUsers, GetUser, EditUser, RemoveUser,
+    BorrowBook, ReturnBook, ApplyBatch,
+    SaveSnapshot, LoadSnapshot, Recover, Checkpoint,
+    ExportBooks, ExportUsers, ReadSnapshot, CountAvailableBooks, BooksOnLoan, GetBorrower,
+    PlaceHold, CancelHold, ExpireHolds, BorrowAnyCopy, ReturnAnyCopy,
+    GetLoans, OverdueLoans, TopTitles,
+    PrepareTransfer, CommitTransfer, AbortTransfer, LendRemote, ReturnRemote, EndRemoteLoan,
+    Count
+};
+
+inline const char* libraryOpName(LibraryOp op) {
+    static const char* const names[] = {
+        "addBook", "addBooks", "getBook", "editBook", "removeBook",
+        "findBookByTitle", "findBooks", "searchBooks",
+        "registerUser", "registerUsers", "getUser", "editUser", "removeUser",
+        "borrowBook", "returnBook", "applyBatch",
+        "saveSnapshot", "loadSnapshot", "recover", "checkpoint",
+        "exportBooks", "exportUsers", "readSnapshot", "countAvailableBooks", "booksOnLoan", "getBorrower",
+        "placeHold", "cancelHold", "expireHolds", "borrowAnyCopy", "returnAnyCopy",
+        "getLoans", "overdueLoans", "topTitles",
+        "prepareTransfer", "commitTransfer", "abortTransfer", "lendRemote", "returnRemote", "endRemoteLoan"
+    };
+    return names[static_cast<int>(op)];
+}
+
+// Per-operation call counts and latency histograms for Library.
+//
+// Each thread records into its own block, so timing a call costs two clock
+// reads and two uncontended stores. Latencies go into log-linear buckets
+// (8 per power of two, so about 12% resolution) from which percentiles are
+// read. dump() merges every thread's block on demand. Failures, whether
+// thrown or returned as a TxnStatus, are counted by LibraryError kind in
+// the same blocks. Define LIBRARY_NO_METRICS to compile all of this out.
+class Metrics {
+public:
+    static const int SubBuckets = 8;
+    static const int Buckets = 62 * SubBuckets;
+    static const int Ops = static_cast<int>(LibraryOp::Count);
+    static const int ErrorKinds = static_cast<int>(LibraryError::Count);
+    
+    // Bucket holding a latency of ns nanoseconds
+    static int bucketOf(uint64_t ns) {
+        if (ns < SubBuckets)
+            return static_cast<int>(ns);
+        int msb = 63;
+        while (!(ns >> msb))
+            msb--;
+        int shift = msb - 3;
+        return (shift + 1) * SubBuckets + static_cast<int>((ns >> shift) & (SubBuckets - 1));
+    }
+    
+    // Smallest latency that falls into bucket b
+    static uint64_t bucketFloor(int b) {
+        if (b < SubBuckets)
+            return static_cast<uint64_t>(b);
+        int shift = b / SubBuckets - 1;
+        return static_cast<uint64_t>(SubBuckets + b % SubBuckets) << shift;
+    }
+    
+    // One thread's counters. Only the owning thread writes; relaxed atomics
+    // let dump() read them from another thread without a data race.
+    struct Block {
+        atomic<uint64_t> totalNs[Ops];
+        atomic<uint64_t> maxNs[Ops];
+        atomic<uint64_t> histogram[Ops][Buckets];
+        atomic<uint64_t> errors[ErrorKinds];
+        
+        Block() { reset(); }
+        void reset() {
+            for (int op = 0; op < Ops; op++) {
+                totalNs[op].store(0, memory_order_relaxed);
+                maxNs[op].store(0, memory_order_relaxed);
+                for (int b = 0; b < Buckets; b++)
+                    histogram[op][b].store(0, memory_order_relaxed);
+            }
+            for (int e = 0; e < ErrorKinds; e++)
+                errors[e].store(0, memory_order_relaxed);
+        }
+        
+        static void bump(atomic<uint64_t> &counter, uint64_t by) {
+            counter.store(counter.load(memory_order_relaxed) + by, memory_order_relaxed);
+        }
+        
+        void addFrom(const Block &other) {
+            for (int op = 0; op < Ops; op++) {
+                bump(totalNs[op], other.totalNs[op].load(memory_order_relaxed));
+                uint64_t m = other.maxNs[op].load(memory_order_relaxed);
+                if (m > maxNs[op].load(memory_order_relaxed))
+                    maxNs[op].store(m, memory_order_relaxed);
+                for (int b = 0; b < Buckets; b++)
+                    bump(histogram[op][b], other.histogram[op][b].load(memory_order_relaxed));
+            }
+            for (int e = 0; e < ErrorKinds; e++)
+                bump(errors[e], other.errors[e].load(memory_order_relaxed));
+        }
+    };
+private:
+    // Every live thread's block, plus the totals of threads that have exited
+    struct Registry {
+        mutex lock;
+        vector<Block*> live;
+        Block retired;
+    };
+    
+    static Registry& registry() {
+        static Registry* instance = new Registry();   // never destroyed, so threads can exit in any order
+        return *instance;
+    }
+    
+    // Registers this thread's block on first use and folds it into the
+    // retired totals when the thread exits
+    struct ThreadSlot {
+        Block* block;
+        ThreadSlot() : block(new Block()) {
+            Registry &r = registry();
+            lock_guard<mutex> guard(r.lock);
+            r.live.push_back(block);
+        }
+        ~ThreadSlot() {
+            Registry &r = registry();
+            lock_guard<mutex> guard(r.lock);
+            r.retired.addFrom(*block);
+            r.live.erase(find(r.live.begin(), r.live.end(), block));
+            delete block;
+        }
+    };
+public:
+    static Block& local() {
+        thread_local ThreadSlot slot;
+        return *slot.block;
+    }
+    
+    static void record(LibraryOp op, uint64_t ns) {
+        Block &b = local();
+        int i = static_cast<int>(op);
+        Block::bump(b.histogram[i][bucketOf(ns)], 1);
+        Block::bump(b.totalNs[i], ns);
+        if (ns > b.maxNs[i].load(memory_order_relaxed))
+            b.maxNs[i].store(ns, memory_order_relaxed);
+    }
+    
+    // A failed status is an ordinary outcome on hot paths, so errors are
+    // counted per thread like the timings
+    static void recordError(LibraryError kind) {
+        int e = static_cast<int>(kind);
+        if (e < ErrorKinds)
+            Block::bump(local().errors[e], 1);
+    }
+    
+    // Writes one line per operation that has been called (count, mean and
+    // percentiles in microseconds) followed by one per kind of error seen
+    static void dump(ReportSink &out) {
+        Block* total = new Block();
+        {
+            Registry &r = registry();
+            lock_guard<mutex> guard(r.lock);
+            total->addFrom(r.retired);
+            for (size_t i = 0; i < r.live.size(); i++)
+                total->addFrom(*r.live[i]);
+        }
+        char line[160];
+        snprintf(line, sizeof(line), "%-16s %10s %10s %10s %10s %10s %10s\n",
+                 "operation", "count", "mean_us", "p50_us", "p90_us", "p99_us", "max_us");
+        out << line;
+        for (int op = 0; op < Ops; op++) {
+            uint64_t count = 0;
+            for (int b = 0; b < Buckets; b++)
+                count += total->histogram[op][b].load(memory_order_relaxed);
+            if (count == 0)
+                continue;
+            double maxUs = static_cast<double>(total->maxNs[op].load(memory_order_relaxed)) / 1000.0;
+            double pct[3] = { 0.50, 0.90, 0.99 };
+            double value[3] = { 0, 0, 0 };
+            for (int k = 0; k < 3; k++) {
+                uint64_t rank = static_cast<uint64_t>(pct[k] * static_cast<double>(count - 1)) + 1;
+                uint64_t seen = 0;
+                for (int b = 0; b < Buckets; b++) {
+                    seen += total->histogram[op][b].load(memory_order_relaxed);
+                    if (seen >= rank) {
+                        value[k] = min(maxUs, static_cast<double>(bucketFloor(b) + bucketFloor(b + 1)) / 2000.0);
+                        break;
+                    }
+                }
+            }
+            snprintf(line, sizeof(line), "%-16s %10llu %10.3f %10.3f %10.3f %10.3f %10.3f\n",
+                     libraryOpName(static_cast<LibraryOp>(op)), static_cast<unsigned long long>(count),
+                     static_cast<double>(total->totalNs[op].load(memory_order_relaxed)) / 1000.0 / static_cast<double>(count),
+                     value[0], value[1], value[2], maxUs);
+            out << line;
+        }
+        bool header = false;
+        for (int e = 0; e < ErrorKinds; e++) {
+            uint64_t count = total->errors[e].load(memory_order_relaxed);
+            if (count == 0)
+                continue;
+            if (!header) {
+                snprintf(line, sizeof(line), "%-16s %10s\n", "error", "count");
+                out << line;
+                header = true;
+            }
+            snprintf(line, sizeof(line), "%-16s %10llu\n", libraryErrorName(static_cast<LibraryError>(e)),
+                     static_cast<unsigned long long>(count));
+            out << line;
+        }
+        delete total;
+    }
+    
+    // Clears every counter and error count
+    static void reset() {
+        Registry &r = registry();
+        lock_guard<mutex> guard(r.lock);
+        r.retired.reset();
+        for (size_t i = 0; i < r.live.size(); i++)
+            r.live[i]->reset();
+    }
+};
+
+// Times the enclosing scope as one call of op
+class ScopedOpTimer {
+private:
+    LibraryOp op;
+    chrono::steady_clock::time_point start;
+public:
+    explicit ScopedOpTimer(LibraryOp o) : op(o), start(chrono::steady_clock::now()) {}
+    ~ScopedOpTimer() {
+        uint64_t ns = static_cast<uint64_t>(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count());
+        Metrics::record(op, ns);
+    }
+};
+
+// Rewrites a metrics dump to a file every interval until destroyed
+class MetricsReporter {
+private:
+    string path;
+    chrono::milliseconds interval;
+    mutex lock;
+    condition_variable wake;
+    bool stopping;
+    thread worker;
+    
+    void writeOnce() {
+        string tmp = path + ".tmp";
+        FILE* f = fopen(tmp.c_str(), "wb");
+        if (!f)
+            return;
+        {
+            ReportSink out(f);
+            Metrics::dump(out);
+        }
+        fclose(f);
+        remove(path.c_str());
+        rename(tmp.c_str(), path.c_str());
+    }
+    
+    void run() {
+        unique_lock<mutex> guard(lock);
+        while (!stopping) {
+            wake.wait_for(guard, interval);
+            guard.unlock();
+            writeOnce();
+            guard.lock();
+        }
+    }
+public:
+    MetricsReporter(const string &file, chrono::milliseconds every)
+        : path(file), interval(every), stopping(false) {
+        worker = thread(&MetricsReporter::run, this);
+    }
+    ~MetricsReporter() {
+        {
+            lock_guard<mutex> guard(lock);
+            stopping = true;
+        }
+        wake.notify_all();
+        worker.join();
+    }
+    MetricsReporter(const MetricsReporter&) = delete;
+    MetricsReporter& operator=(const MetricsReporter&) = delete;
+};
+
+#ifdef LIBRARY_NO_METRICS
+#define LIBRARY_TIMED(op)
+inline void recordLibraryError(LibraryError) {}
+#else
+#define LIBRARY_TIMED(op) ScopedOpTimer libraryOpTimer(op)
+inline void recordLibraryError(LibraryError kind) { Metrics::recordError(kind); }
+#endif
+
+// Records Library calls to a trace file for library_replay.
+//
+// The file starts with "NTRC", u32 version, the library clock (i64
+// seconds) when recording began and the library as it was then, in
+// snapshot format (u32 length and the bytes), so a replay starts from the
+// same state. Calls follow in chunks framed like transaction log records
+// (u32 length, u32 checksum), so a trace cut short by a crash reads up to
+// its last whole chunk. Each thread fills a chunk of its own and only
+// takes the file lock once per 64 KB, so chunks of different threads
+// interleave and load() puts the calls back in order of start time.
+// A call is:
+//   u8 operation, u8 flags (1: it threw), varint thread number,
+//   varint start (ns since recording began), varint duration (ns),
+//   zigzag library clock minus the one in the header, zigzag result,
+//   varint count then zigzag integer arguments,
+//   varint count then string arguments (varint length, bytes)
+// Library decides which arguments and result each operation records.
+class TraceRecorder {
+public:
+    static const uint32_t Version = 1;
+    
+    struct Call {
+        LibraryOp op;
+        bool threw;
+        uint32_t thread;
+        uint64_t startNs;
+        uint64_t durationNs;
+        int64_t now;                    // library clock, in seconds
+        int64_t result;
+        vector<int64_t> ints;
+        vector<string> text;
+    };
+    
+    struct Trace {
+        int64_t clockStart;
+        string snapshot;
+        vector<Call> calls;             // in order of start time
+    };
+private:
+    static const size_t ChunkBytes = 1 << 16;
+    
+    // One recording thread's unwritten calls
+    struct Buffer {
+        mutex lock;
+        uint32_t thread;
+        BinaryWriter chunk;
+    };
+    
+    string path;
+    FILE* file;
+    mutex fileLock;
+    bool failed;
+    mutex buffersLock;
+    vector<unique_ptr<Buffer>> buffers;
+    uint64_t serial;                    // tells this recorder's buffers from a destroyed one's
+    chrono::steady_clock::time_point origin;
+    int64_t clockStart;
+    
+    static uint64_t zigzag(int64_t v) { return (static_cast<uint64_t>(v) << 1) ^ static_cast<uint64_t>(v >> 63); }
+    static int64_t unzigzag(uint64_t v) { return static_cast<int64_t>(v >> 1) ^ -static_cast<int64_t>(v & 1); }
+    
+    static uint64_t nextSerial() {
+        static atomic<uint64_t> serials(0);
+        return ++serials;
+    }
+    
+    // The calling thread's buffer, registered on its first call
+    Buffer& local() {
+        struct Cached {
+            uint64_t serial;
+            Buffer* buffer;
+        };
+        thread_local Cached cached = { 0, nullptr };
+        if (cached.serial != serial) {
+            lock_guard<mutex> guard(buffersLock);
+            buffers.push_back(unique_ptr<Buffer>(new Buffer()));
+            buffers.back()->thread = static_cast<uint32_t>(buffers.size() - 1);
+            cached.serial = serial;
+            cached.buffer = buffers.back().get();
+        }
+        return *cached.buffer;
+    }
+    
+    // Caller holds b.lock
+    void writeChunk(Buffer &b) {
+        const string &bytes = b.chunk.bytes();
+        if (bytes.empty())
+            return;
+        uint32_t header[2] = { static_cast<uint32_t>(bytes.size()), TransactionLog::checksum(bytes.data(), bytes.size()) };
+        lock_guard<mutex> guard(fileLock);
+        if (fwrite(header, 1, sizeof(header), file) != sizeof(header) ||
+            fwrite(bytes.data(), 1, bytes.size(), file) != bytes.size())
+            failed = true;
+        b.chunk.clear();
+    }
+    
+    static Call decodeCall(BinaryReader &r, int64_t clockStart) {
+        Call call;
+        uint8_t op = r.getU8();
+        if (op >= static_cast<uint8_t>(LibraryOp::Count))
+            throw LibraryException("Unknown operation in trace.", LibraryError::CorruptData);
+        call.op = static_cast<LibraryOp>(op);
+        call.threw = (r.getU8() & 1) != 0;
+        call.thread = static_cast<uint32_t>(r.getVarint());
+        call.startNs = r.getVarint();
+        call.durationNs = r.getVarint();
+        call.now = clockStart + unzigzag(r.getVarint());
+        call.result = unzigzag(r.getVarint());
+        uint64_t ints = r.getVarint();
+        for (uint64_t i = 0; i < ints; i++)
+            call.ints.push_back(unzigzag(r.getVarint()));
+        uint64_t strings = r.getVarint();
+        for (uint64_t i = 0; i < strings; i++)
+            call.text.push_back(r.getBytes(static_cast<size_t>(r.getVarint())));
+        return call;
+    }
+public:
+    TraceRecorder(const string &tracePath)
+        : path(tracePath), file(nullptr), failed(false), serial(nextSerial()), clockStart(0) {
+        file = fopen(path.c_str(), "wb");
+        if (!file)
+            throw LibraryException("Cannot open " + path, LibraryError::FileError);
+    }
+    ~TraceRecorder() {
+        try {
+            flush();
+        }
+        catch (LibraryException &) {
+        }
+        fclose(file);
+    }
+    TraceRecorder(const TraceRecorder&) = delete;
+    TraceRecorder& operator=(const TraceRecorder&) = delete;
+    
+    // Writes the header; Library::attachTrace calls this before the first
+    // call is recorded
+    void begin(const string &snapshot, int64_t clockNow) {
+        BinaryWriter w;
+        w.putU8('N'); w.putU8('T'); w.putU8('R'); w.putU8('C');
+        w.putU32(Version);
+        w.putI64(clockNow);
+        w.putString(snapshot);
+        lock_guard<mutex> guard(fileLock);
+        if (fwrite(w.bytes().data(), 1, w.bytes().size(), file) != w.bytes().size())
+            failed = true;
+        clockStart = clockNow;
+        origin = chrono::steady_clock::now();
+    }
+    
+    // Adds a call that started at start; the thread number is filled in
+    void record(const Call &call, chrono::steady_clock::time_point start) {
+        Buffer &b = local();
+        lock_guard<mutex> guard(b.lock);
+        BinaryWriter &w = b.chunk;
+        w.putU8(static_cast<uint8_t>(call.op));
+        w.putU8(call.threw ? 1 : 0);
+        w.putVarint(b.thread);
+        w.putVarint(static_cast<uint64_t>(max<int64_t>(0, chrono::duration_cast<chrono::nanoseconds>(start - origin).count())));
+        w.putVarint(call.durationNs);
+        w.putVarint(zigzag(call.now - clockStart));
+        w.putVarint(zigzag(call.result));
+        w.putVarint(call.ints.size());
+        for (size_t i = 0; i < call.ints.size(); i++)
+            w.putVarint(zigzag(call.ints[i]));
+        w.putVarint(call.text.size());
+        for (size_t i = 0; i < call.text.size(); i++) {
+            w.putVarint(call.text[i].size());
+            w.putBytes(call.text[i].data(), call.text[i].size());
+        }
+        if (w.bytes().size() >= ChunkBytes)
+            writeChunk(b);
+    }
+    
+    // Writes every thread's unwritten calls; throws if any write failed
+    void flush() {
+        lock_guard<mutex> guard(buffersLock);
+        for (size_t i = 0; i < buffers.size(); i++) {
+            lock_guard<mutex> bufferGuard(buffers[i]->lock);
+            writeChunk(*buffers[i]);
+        }
+        lock_guard<mutex> fileGuard(fileLock);
+        if (fflush(file) != 0)
+            failed = true;
+        if (failed)
+            throw LibraryException("Cannot write " + path, LibraryError::FileError);
+    }
+    
+    // Reads the trace at tracePath
+    static Trace load(const string &tracePath) {
+        MappedFile file(tracePath);
+        BinaryReader r(file.begin(), file.size());
+        if (file.size() < 4 || r.getU8() != 'N' || r.getU8() != 'T' || r.getU8() != 'R' || r.getU8() != 'C')
+            throw LibraryException(tracePath + " is not a library trace.", LibraryError::CorruptData);
+        if (r.getU32() != Version)
+            throw LibraryException(tracePath + " was recorded by an unsupported version.", LibraryError::CorruptData);
+        Trace trace;
+        trace.clockStart = r.getI64();
+        trace.snapshot = r.getString();
+        const char* pos = file.begin() + 4 + sizeof(uint32_t) + sizeof(int64_t) + sizeof(uint32_t) + trace.snapshot.size();
+        const char* end = file.begin() + file.size();
+        while (static_cast<size_t>(end - pos) >= 2 * sizeof(uint32_t)) {
+            uint32_t header[2];
+            memcpy(header, pos, sizeof(header));
+            const char* payload = pos + sizeof(header);
+            if (static_cast<size_t>(end - payload) < header[0] || TransactionLog::checksum(payload, header[0]) != header[1])
+                break;
+            BinaryReader chunk(payload, header[0]);
+            while (!chunk.atEnd())
+                trace.calls.push_back(decodeCall(chunk, trace.clockStart));
+            pos = payload + header[0];
+        }
+        stable_sort(trace.calls.begin(), trace.calls.end(), [](const Call &a, const Call &b) { return a.startNs < b.startNs; });
+        return trace;
+    }
+};
+
+// Kind of transaction in a batch
+enum class TxnOp : unsigned char { Borrow, Return };
+
+// One borrow or return in a batch
+struct TxnRecord {
+    int userID;
+    int bookID;
+    TxnOp op;
+};
+
+// Result of a transaction, reported by the batch API and the try* calls
+// instead of an exception
+enum class TxnStatus : unsigned char {
+    OK,
+    NoSuchUser,
+    NoSuchBook,
+    BookUnavailable,
+    LimitReached,
+    NotBorrowed,
+    HoldNotNeeded,
+    AlreadyHeld,
+    NoSuchHold,
+    NoSuchTransfer
+};
+
+// Message used when a status is reported as a LibraryException
+inline const char* txnStatusMessage(TxnStatus status) {
+    switch (status) {
+    case TxnStatus::OK:              return "OK";
+    case TxnStatus::NoSuchUser:      return "No User with that ID Exists";
+    case TxnStatus::NoSuchBook:      return "No Book with that ID Exists";
+    case TxnStatus::BookUnavailable: return "Book is not available for borrowing.";
+    case TxnStatus::LimitReached:    return "User has reached borrowing limit.";
+    case TxnStatus::NotBorrowed:     return "Book not borrowed by user.";
+    case TxnStatus::HoldNotNeeded:   return "Book is available or already borrowed by user.";
+    case TxnStatus::AlreadyHeld:     return "User already has a hold on this book.";
+    case TxnStatus::NoSuchHold:      return "User has no hold on this book.";
+    case TxnStatus::NoSuchTransfer:  return "No such transfer is pending.";
+    }
+    return "Unknown status";
+}
+
+// The kind a failed status is counted as
+inline LibraryError txnStatusError(TxnStatus status) {
+    switch (status) {
+    case TxnStatus::OK:              break;
+    case TxnStatus::NoSuchUser:      return LibraryError::NoSuchUser;
+    case TxnStatus::NoSuchBook:      return LibraryError::NoSuchBook;
+    case TxnStatus::BookUnavailable: return LibraryError::BookUnavailable;
+    case TxnStatus::LimitReached:    return LibraryError::LimitReached;
+    case TxnStatus::NotBorrowed:     return LibraryError::NotBorrowed;
+    case TxnStatus::HoldNotNeeded:   return LibraryError::HoldNotNeeded;
+    case TxnStatus::AlreadyHeld:     return LibraryError::AlreadyHeld;
+    case TxnStatus::NoSuchHold:      return LibraryError::NoSuchHold;
+    case TxnStatus::NoSuchTransfer:  return LibraryError::NoSuchTransfer;
+    }
+    return LibraryError::Count;
+}
+
+// Counts status if it is a failure
+inline void recordTxnStatus(TxnStatus status) {
+    if (status != TxnStatus::OK)
+        recordLibraryError(txnStatusError(status));
+}
+
+// One loan as reported by getLoans and overdueLoans. Times are seconds
+// since the epoch; the fine is what the loan has run up by the time of the
+// call (0 until it is overdue).
+struct LoanRecord {
+    int userID;
+    int bookID;
+    int64_t checkedOut;
+    int64_t due;
+    int64_t fineCents;
+};
+
+// A transfer prepared on the user's branch that has been neither committed
+// nor aborted
+struct PendingTransfer {
+    int64_t txn;
+    int userID;
+    int bookID;
+};
+
+// A loan of another branch's book as the user's branch keeps it, with the
+// transfer that made it
+struct RemoteLoan {
+    int64_t txn;
+    LoanRecord loan;
+};
+
+// Hashed timing wheel. A timer lands in the slot for the first tick at or
+// after its deadline, so scheduling is O(1) and advance() costs one visit
+// per tick passed (at most one revolution) plus one per timer in the slots
+// visited. Timers more than a revolution out stay in their slot until a
+// later pass finds them due. There is no cancel: owners tag timers with an
+// id and generation and ignore stale ones when they come due.
+class TimerWheel {
+public:
+    struct Timer {
+        int64_t deadline;
+        uint32_t id;
+        uint32_t generation;
+    };
+private:
+    static const int64_t Slots = 4096;
+    int64_t tick;           // seconds per slot
+    int64_t current;        // last tick advanced to
+    size_t pending;
+    vector<vector<Timer>> slots;
+public:
+    explicit TimerWheel(int64_t tickSeconds) : tick(tickSeconds), current(0), pending(0), slots(Slots) {}
+    
+    size_t size() const { return pending; }
+    
+    void schedule(int64_t deadline, uint32_t id, uint32_t generation) {
+        int64_t t = (deadline + tick - 1) / tick;
+        if (t <= current)
+            t = current + 1;
+        Timer timer = { deadline, id, generation };
+        slots[t % Slots].push_back(timer);
+        pending++;
+    }
+    
+    // Moves the wheel to now and appends the timers that are due to due. If
+    // the clock went backwards, timers already scheduled may fire up to one
+    // revolution late.
+    void advance(int64_t now, vector<Timer> &due) {
+        int64_t target = now / tick;
+        if (target < current)
+            current = target;
+        int64_t steps = target - current < Slots ? target - current : Slots;
+        for (int64_t i = 1; i <= steps; i++) {
+            vector<Timer> &slot = slots[(current + i) % Slots];
+            size_t kept = 0;
+            for (size_t j = 0; j < slot.size(); j++) {
+                if (slot[j].deadline <= now)
+                    due.push_back(slot[j]);
+                else
+                    slot[kept++] = slot[j];
+            }
+            pending -= slot.size() - kept;
+            slot.resize(kept);
+        }
+        current = target;
+    }
+    
+    void clear() {
+        for (size_t i = 0; i < slots.size(); i++)
+            slots[i].clear();
+        current = 0;
+        pending = 0;
+    }
+};
+
+// Hold queues for all titles. A title's holds are served by priority
+// (lower first), then in the order they were placed. When a copy comes free
+// the first waiting hold becomes ready: the copy is kept for its user until
+// a pickup deadline tracked on a TimerWheel. Ready holds stay at the front
+// of their title's queue. Holds live in one node array recycled through a
+// free list and are linked both per title and per user, so placing,
+// cancelling, promoting and expiring are O(1) apart from the walk back past
+// lower-priority holds when queueing. Not thread-safe; Library guards it.
+class HoldQueues {
+private:
+    static const uint32_t None = UINT32_MAX;
+    
+    struct Hold {
+        int userID;
+        TitleRecord* title;
+        int readyCopy;              // copy kept for the user, or -1 while waiting
+        int64_t readyUntil;         // pickup deadline once ready
+        uint32_t generation;        // bumped on reuse so stale timers are ignored
+        uint32_t prev, next;        // neighbours in the title's queue
+        uint32_t userPrev, userNext;
+        int priority;
+    };
+    struct List {
+        uint32_t head, tail;
+        uint32_t firstWaiting;      // titles only: first hold that is not ready
+        uint32_t count;
+    };
+    
+    vector<Hold> nodes;
+    vector<uint32_t> freeNodes;
+    unordered_map<TitleRecord*, List> byTitle;
+    unordered_map<int, List> byUser;
+    unordered_map<uint64_t, uint32_t> byPair;   // (user, title) -> node
+    TimerWheel wheel;
+    
+    static uint64_t pairKey(int userID, TitleRecord* title) {
+        return (static_cast<uint64_t>(static_cast<uint32_t>(userID)) << 32) | static_cast<uint32_t>(title->getTitleID());
+    }
+    
+    uint32_t find(int userID, TitleRecord* title) const {
+        unordered_map<uint64_t, uint32_t>::const_iterator it = byPair.find(pairKey(userID, title));
+        return it == byPair.end() ? None : it->second;
+    }
+    
+    // Links node n into its title's queue after node after (None: at the front)
+    void linkAfter(List &queue, uint32_t n, uint32_t after) {
+        Hold &h = nodes[n];
+        h.prev = after;
+        h.next = after == None ? queue.head : nodes[after].next;
+        (h.prev == None ? queue.head : nodes[h.prev].next) = n;
+        (h.next == None ? queue.tail : nodes[h.next].prev) = n;
+    }
+    
+    void unlinkFromTitle(List &queue, uint32_t n) {
+        Hold &h = nodes[n];
+        if (queue.firstWaiting == n)
+            queue.firstWaiting = h.next;
+        (h.prev == None ? queue.head : nodes[h.prev].next) = h.next;
+        (h.next == None ? queue.tail : nodes[h.next].prev) = h.prev;
+    }
+    
+    void unlink(uint32_t n) {
+        Hold &h = nodes[n];
+        List &queue = byTitle[h.title];
+        unlinkFromTitle(queue, n);
+        if (--queue.count == 0)
+            byTitle.erase(h.title);
+        List &user = byUser[h.userID];
+        (h.userPrev == None ? user.head : nodes[h.userPrev].userNext) = h.userNext;
+        (h.userNext == None ? user.tail : nodes[h.userNext].userPrev) = h.userPrev;
+        if (--user.count == 0)
+            byUser.erase(h.userID);
+        byPair.erase(pairKey(h.userID, h.title));
+        h.generation++;
+        freeNodes.push_back(n);
+    }
+public:
+    HoldQueues() : wheel(60) {}
+    
+    size_t size() const { return byPair.size(); }
+    
+    bool contains(int userID, TitleRecord* title) const { return find(userID, title) != None; }
+    
+    // Holds on title, ready or waiting
+    size_t queueLength(TitleRecord* title) const {
+        unordered_map<TitleRecord*, List>::const_iterator it = byTitle.find(title);
+        return it == byTitle.end() ? 0 : it->second.count;
+    }
+    
+    // Queues a hold behind every hold of equal or lower priority value.
+    // The caller checks contains() first.
+    void enqueue(int userID, TitleRecord* title, int priority) {
+        uint32_t n;
+        if (!freeNodes.empty()) {
+            n = freeNodes.back();
+            freeNodes.pop_back();
+        } else {
+            n = static_cast<uint32_t>(nodes.size());
+            nodes.push_back(Hold());
+            nodes[n].generation = 0;
+        }
+        Hold &h = nodes[n];
+        h.userID = userID;
+        h.title = title;
+        h.readyCopy = -1;
+        h.readyUntil = 0;
+        h.priority = priority;
+        
+        List &queue = byTitle.emplace(title, List{ None, None, None, 0 }).first->second;
+        uint32_t after = queue.tail;
+        while (after != None && nodes[after].readyCopy < 0 && nodes[after].priority > priority)
+            after = nodes[after].prev;
+        linkAfter(queue, n, after);
+        if (after == None || nodes[after].readyCopy >= 0)
+            queue.firstWaiting = n;
+        queue.count++;
+        
+        List &user = byUser.emplace(userID, List{ None, None, None, 0 }).first->second;
+        h.userPrev = user.tail;
+        h.userNext = None;
+        (user.tail == None ? user.head : nodes[user.tail].userNext) = n;
+        user.tail = n;
+        user.count++;
+        byPair[pairKey(userID, title)] = n;
+    }
+    
+    // Drops userID's hold on title and reports through readyCopy the copy
+    // that was kept for it (-1 if it was waiting). False if there was none.
+    bool cancel(int userID, TitleRecord* title, int &readyCopy) {
+        uint32_t n = find(userID, title);
+        if (n == None)
+            return false;
+        readyCopy = nodes[n].readyCopy;
+        unlink(n);
+        return true;
+    }
+    
+    // Copy kept for userID's ready hold on title, or -1
+    int readyCopy(int userID, TitleRecord* title) const {
+        uint32_t n = find(userID, title);
+        return n == None ? -1 : nodes[n].readyCopy;
+    }
+    
+    // Pickup deadline of userID's hold on title, or 0 if it is not ready
+    int64_t readyUntil(int userID, TitleRecord* title) const {
+        uint32_t n = find(userID, title);
+        return n == None || nodes[n].readyCopy < 0 ? 0 : nodes[n].readyUntil;
+    }
+    
+    // Keeps copyID for the first waiting hold on title until deadline and
+    // returns its user, or -1 if nobody is waiting
+    int promote(TitleRecord* title, int copyID, int64_t deadline) {
+        unordered_map<TitleRecord*, List>::iterator it = byTitle.find(title);
+        if (it == byTitle.end() || it->second.firstWaiting == None)
+            return -1;
+        uint32_t n = it->second.firstWaiting;
+        it->second.firstWaiting = nodes[n].next;
+        nodes[n].readyCopy = copyID;
+        nodes[n].readyUntil = deadline;
+        wheel.schedule(deadline, n, nodes[n].generation);
+        return nodes[n].userID;
+    }
+    
+    // Turns userID's ready hold on title back into the first waiting hold,
+    // for when the copy kept for it leaves the library
+    void revert(int userID, TitleRecord* title) {
+        uint32_t n = find(userID, title);
+        if (n == None || nodes[n].readyCopy < 0)
+            return;
+        List &queue = byTitle[title];
+        unlinkFromTitle(queue, n);
+        uint32_t after = queue.firstWaiting == None ? queue.tail : nodes[queue.firstWaiting].prev;
+        linkAfter(queue, n, after);
+        queue.firstWaiting = n;
+        nodes[n].readyCopy = -1;
+        nodes[n].readyUntil = 0;
+        nodes[n].generation++;
+    }
+    
+    // Drops every hold on title
+    void removeTitle(TitleRecord* title) {
+        unordered_map<TitleRecord*, List>::iterator it;
+        while ((it = byTitle.find(title)) != byTitle.end())
+            unlink(it->second.head);
+    }
+    
+    // Drops every hold userID has; returns each hold's title and the copy
+    // that was kept for it (-1 if it was waiting)
+    vector<pair<TitleRecord*, int>> removeUser(int userID) {
+        vector<pair<TitleRecord*, int>> dropped;
+        unordered_map<int, List>::iterator it = byUser.find(userID);
+        if (it == byUser.end())
+            return dropped;
+        for (uint32_t n = it->second.head; n != None; n = nodes[n].userNext)
+            dropped.push_back(make_pair(nodes[n].title, nodes[n].readyCopy));
+        int readyCopy;
+        for (size_t i = 0; i < dropped.size(); i++)
+            cancel(userID, dropped[i].first, readyCopy);
+        return dropped;
+    }
+    
+    // Appends the copies kept for ready holds whose deadline has passed
+    void expired(int64_t now, vector<int> &copies) {
+        vector<TimerWheel::Timer> due;
+        wheel.advance(now, due);
+        for (size_t i = 0; i < due.size(); i++) {
+            const Hold &h = nodes[due[i].id];
+            if (h.generation == due[i].generation && h.readyCopy >= 0 && h.readyUntil <= now)
+                copies.push_back(h.readyCopy);
+        }
+    }
+    
+    // Calls f(userID, title, readyCopy, readyUntil) for every hold, each
+    // title's queue in service order
+    template <class F>
+    void forEach(F f) const {
+        for (unordered_map<TitleRecord*, List>::const_iterator it = byTitle.begin(); it != byTitle.end(); ++it)
+            for (uint32_t n = it->second.head; n != None; n = nodes[n].next)
+                f(nodes[n].userID, nodes[n].title, nodes[n].readyCopy, nodes[n].readyUntil);
+    }
+    
+    void clear() {
+        nodes.clear();
+        freeNodes.clear();
+        byTitle.clear();
+        byUser.clear();
+        byPair.clear();
+        wheel.clear();
+    }
+};
+
+inline int popcount64(uint64_t x) {
+#if defined(__GNUC__)
+    return __builtin_popcountll(x);
+#else
+    x = x - ((x >> 1) & 0x5555555555555555ULL);
+    x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+    x = (x + (x >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+    return static_cast<int>((x * 0x0101010101010101ULL) >> 56);
+#endif
+}
+
+// Growable array of atomics, for per-record columns that are updated under
+// record stripes while other threads scan them. Elements are read and
+// written with relaxed ordering (the stripes provide the ordering that
+// matters); growing or shrinking needs the owner's exclusive lock.
+template <class T>
+class AtomicColumn {
+private:
+    unique_ptr<atomic<T>[]> data;
+    size_t count;
+    size_t capacity;
+public:
+    AtomicColumn() : count(0), capacity(0) {}
+    
+    size_t size() const { return count; }
+    T load(size_t i) const { return data[i].load(memory_order_relaxed); }
+    void store(size_t i, T v) { data[i].store(v, memory_order_relaxed); }
+    atomic<T>& operator[](size_t i) { return data[i]; }
+    
+    void reserve(size_t n) {
+        if (n <= capacity)
+            return;
+        unique_ptr<atomic<T>[]> grown(new atomic<T>[n]);
+        for (size_t i = 0; i < count; i++)
+            grown[i].store(load(i), memory_order_relaxed);
+        data = move(grown);
+        capacity = n;
+    }
+    
+    void push_back(T v) {
+        if (count == capacity)
+            reserve(capacity < 16 ? 16 : capacity * 2);
+        data[count++].store(v, memory_order_relaxed);
+    }
+    
+    void pop_back() { count--; }
+    void clear() { count = 0; }
+};
+
+// Growable bitset on top of AtomicColumn. Neighbouring bits share a word,
+// so set() is an atomic or/and and concurrent updates to different bits
+// are safe. Bits past size() are always zero, which lets count() and
+// scans work a whole word at a time.
+class BitColumn {
+private:
+    AtomicColumn<uint64_t> words;
+    size_t bits;
+public:
+    BitColumn() : bits(0) {}
+    
+    size_t size() const { return bits; }
+    
+    bool test(size_t i) const { return (words.load(i / 64) >> (i % 64)) & 1; }
+    
+    void set(size_t i, bool v) {
+        uint64_t mask = uint64_t(1) << (i % 64);
+        if (v)
+            words[i / 64].fetch_or(mask, memory_order_relaxed);
+        else
+            words[i / 64].fetch_and(~mask, memory_order_relaxed);
+    }
+    
+    void reserve(size_t n) { words.reserve((n + 63) / 64); }
+    
+    void push_back(bool v) {
+        if (bits % 64 == 0)
+            words.push_back(0);
+        bits++;
+        set(bits - 1, v);
+    }
+    
+    void pop_back() {
+        bits--;
+        set(bits, false);
+        if (bits % 64 == 0)
+            words.pop_back();
+    }
+    
+    void clear() {
+        words.clear();
+        bits = 0;
+    }
+    
+    // Number of set bits
+    size_t count() const {
+        size_t n = 0;
+        for (size_t w = 0; w < words.size(); w++)
+            n += popcount64(words.load(w));
+        return n;
+    }
+    
+    // Calls f(i) for every clear bit below size(), in order
+    template <class F>
+    void forEachClear(F f) const {
+        for (size_t w = 0; w < words.size(); w++) {
+            uint64_t word = words.load(w);
+            if (word == ~uint64_t(0))
+                continue;
+            size_t end = (w + 1) * 64 < bits ? (w + 1) * 64 : bits;
+            for (size_t i = w * 64; i < end; i++)
+                if (!((word >> (i % 64)) & 1))
+                    f(i);
+        }
+    }
+};
+
+// Column of rows kept in fixed-size pages, so a reader can freeze a
+// consistent copy of the whole column by copying the page table instead of
+// the rows. Every freeze starts a new version; the first write after it to
+// a page older than that version copies the page, leaving the old one to
+// the readers still holding it. update() may run concurrently for
+// different rows under the owner's shared lock (writers to the same page
+// meet on its page lock); everything else needs the owner's exclusive
+// lock.
+template <class Row>
+class CowColumn {
+private:
+    static const size_t PageRows = 512;
+    static const size_t PageLocks = 64;
+    
+    struct Page {
+        uint64_t version;
+        Row rows[PageRows];
+    };
+    
+    vector<shared_ptr<Page>> pages;
+    size_t count;
+    uint64_t version;
+    mutex pageLocks[PageLocks];
+    
+    // Page p, copied first if a frozen view may still share it
+    Page& writable(size_t p) {
+        if (pages[p]->version != version) {
+            shared_ptr<Page> copy = make_shared<Page>(*pages[p]);
+            copy->version = version;
+            pages[p] = move(copy);
+        }
+        return *pages[p];
+    }
+public:
+    // Read-only copy of a column as it was when frozen
+    class Frozen {
+        friend class CowColumn;
+    private:
+        vector<shared_ptr<const Page>> pages;
+        size_t count;
+    public:
+        Frozen() : count(0) {}
+        size_t size() const { return count; }
+        const Row& operator[](size_t i) const { return pages[i / PageRows]->rows[i % PageRows]; }
+    };
+    
+    CowColumn() : count(0), version(0) {}
+    
+    size_t size() const { return count; }
+    const Row& operator[](size_t i) const { return pages[i / PageRows]->rows[i % PageRows]; }
+    
+    // Calls f(row) on row i with the row's page locked
+    template <class F>
+    void update(size_t i, F f) {
+        lock_guard<mutex> guard(pageLocks[(i / PageRows) % PageLocks]);
+        f(writable(i / PageRows).rows[i % PageRows]);
+    }
+    
+    void push_back(const Row &row) {
+        if (count % PageRows == 0) {
+            pages.push_back(make_shared<Page>());
+            pages.back()->version = version;
+        }
+        writable(count / PageRows).rows[count % PageRows] = row;
+        count++;
+    }
+    
+    void pop_back() {
+        count--;
+        if (count % PageRows == 0)
+            pages.pop_back();
+    }
+    
+    void clear() {
+        pages.clear();
+        count = 0;
+    }
+    
+    Frozen freeze() {
+        Frozen frozen;
+        frozen.pages.assign(pages.begin(), pages.end());
+        frozen.count = count;
+        version++;
+        return frozen;
+    }
+};
+
+// A book or user as a catalog snapshot sees it. The title record and the
+// interned name are kept alive for as long as any snapshot can see the row.
+// The loan counts are how many times the copy has been lent and how many
+// loans the user has taken.
+struct BookRow {
+    int bookID;
+    int borrower;               // user ID, or -1
+    bool available;
+    uint32_t loans;
+    TitleRecord* record;
+};
+
+struct UserRow {
+    int userID;
+    UserCategory category;
+    uint32_t loans;
+    const string* name;         // interned in StringPool
+};
+
+// Consistent, read-only view of every book and user at one moment, from
+// Library::readSnapshot(). Reading it takes no locks, so long reports and
+// audits run alongside borrows, returns and catalog changes without
+// holding any of them up. Rows are in the listing order of the moment it
+// was taken.
+class CatalogSnapshot {
+    friend class Library;
+private:
+    CowColumn<BookRow>::Frozen books;
+    CowColumn<UserRow>::Frozen users;
+    uint64_t epoch;
+    
+    // Positions in books of each user's loans, built on first use
+    mutable once_flag loansBuilt;
+    mutable unordered_map<int, vector<size_t>> loans;
+    
+    const vector<size_t>& loansOf(int userID) const {
+        call_once(loansBuilt, [this]() {
+            for (size_t i = 0; i < books.size(); i++)
+                if (books[i].borrower >= 0)
+                    loans[books[i].borrower].push_back(i);
+        });
+        static const vector<size_t> none;
+        unordered_map<int, vector<size_t>>::const_iterator it = loans.find(userID);
+        return it == loans.end() ? none : it->second;
+    }
+    
+    static void writeBookText(ReportSink &out, const BookRow &b) {
+        out << "Book " << b.bookID << ":\n";
+        out << "Title: " << b.record->getTitle() << '\n';
+        out << "Author: " << b.record->getAuthor() << '\n';
+        out << "ISBN: " << b.record->getISBN() << '\n';
+    }
+    
+    CatalogSnapshot() : epoch(0) {}
+public:
+    size_t bookCount() const { return books.size(); }
+    const BookRow& book(size_t i) const { return books[i]; }
+    size_t userCount() const { return users.size(); }
+    const UserRow& user(size_t i) const { return users[i]; }
+    
+    // Writes up to limit books starting at position offset in listing
+    // order, and returns how many were written. CSV output starts with a
+    // header row and JSON output is one array, so every page stands alone.
+    size_t exportBooks(ReportSink &out, ReportFormat format, size_t offset = 0, size_t limit = SIZE_MAX) const {
+        size_t first = offset < books.size() ? offset : books.size();
+        size_t last = books.size() - first < limit ? books.size() : first + limit;
+        if (format == ReportFormat::CSV)
+            out << "id,title,author,isbn,available\n";
+        else if (format == ReportFormat::JSON)
+            out << '[';
+        for (size_t i = first; i < last; i++) {
+            const BookRow &b = books[i];
+            if (format == ReportFormat::Text) {
+                writeBookText(out, b);
+            } else if (format == ReportFormat::CSV) {
+                out << b.bookID << ',';
+                out.csvField(b.record->getTitle());
+                out << ',';
+                out.csvField(b.record->getAuthor());
+                out << ',';
+                out.csvField(b.record->getISBN());
+                out << ',' << (b.available ? "yes" : "no") << '\n';
+            } else {
+                out << (i == first ? "\n" : ",\n") << "{\"id\":" << b.bookID << ",\"title\":";
+                out.jsonString(b.record->getTitle());
+                out << ",\"author\":";
+                out.jsonString(b.record->getAuthor());
+                out << ",\"isbn\":";
+                out.jsonString(b.record->getISBN());
+                out << ",\"available\":" << (b.available ? "true" : "false") << '}';
+            }
+        }
+        if (format == ReportFormat::JSON)
+            out << "\n]\n";
+        return last - first;
+    }
+    
+    // Same paging as exportBooks, for users and the books they have out
+    size_t exportUsers(ReportSink &out, ReportFormat format, size_t offset = 0, size_t limit = SIZE_MAX) const {
+        size_t first = offset < users.size() ? offset : users.size();
+        size_t last = users.size() - first < limit ? users.size() : first + limit;
+        if (format == ReportFormat::CSV)
+            out << "id,name,type,borrowed\n";
+        else if (format == ReportFormat::JSON)
+            out << '[';
+        for (size_t i = first; i < last; i++) {
+            const UserRow &u = users[i];
+            const char* type = userCategoryPolicy(u.category).name;
+            const vector<size_t> &borrowed = loansOf(u.userID);
+            if (format == ReportFormat::Text) {
+                out << "User " << u.userID << ":\n";
+                out << "Name: " << *u.name << '\n';
+                out << "Class: " << type << '\n';
+                out << "Books Checked Out:\n";
+                for (size_t j = 0; j < borrowed.size(); j++)
+                    writeBookText(out, books[borrowed[j]]);
+            } else if (format == ReportFormat::CSV) {
+                out << u.userID << ',';
+                out.csvField(*u.name);
+                out << ',' << type << ',';
+                for (size_t j = 0; j < borrowed.size(); j++)
+                    out << (j ? " " : "") << books[borrowed[j]].bookID;
+                out << '\n';
+            } else {
+                out << (i == first ? "\n" : ",\n") << "{\"id\":" << u.userID << ",\"name\":";
+                out.jsonString(*u.name);
+                out << ",\"type\":\"" << type << "\",\"borrowed\":[";
+                for (size_t j = 0; j < borrowed.size(); j++)
+                    out << (j ? "," : "") << books[borrowed[j]].bookID;
+                out << "]}";
+            }
+        }
+        if (format == ReportFormat::JSON)
+            out << "\n]\n";
+        return last - first;
+    }
+};
+
+// A title and how many times its copies have been lent
+struct TitleLoans {
+    int titleID;
+    string title;
+    string author;
+    string isbn;
+    uint64_t loans;
+};
+
+// The titles lent most often, updated loan by loan so that reading them
+// costs O(Capacity) rather than a pass over the catalog. Titles are ranked
+// by a score packing the loan count above the inverted title ID, so ties
+// go to the older title and every score is distinct. A loan of a title
+// scoring no more than the lowest entry of a full list is turned away
+// without taking the lock. Counts only rise between refills; whoever
+// lowers a listed title's count (removing or moving a copy) refills the
+// list from the library's full ranking.
+class TopTitles {
+public:
+    static const size_t Capacity = 16;
+private:
+    struct Entry {
+        uint64_t score;
+        TitleRecord* record;
+    };
+    mutex lock;
+    vector<Entry> entries;          // best first
+    atomic<uint64_t> floor;         // lowest score that makes the list, or 0 while it has room
+    
+    void updateFloor() { floor.store(entries.size() == Capacity ? entries.back().score : 0, memory_order_relaxed); }
+public:
+    TopTitles() : floor(0) {}
+    
+    static uint64_t score(uint32_t loans, int titleID) {
+        return (static_cast<uint64_t>(loans) << 32) | (UINT32_MAX - static_cast<uint32_t>(titleID));
+    }
+    
+    // The record's score has risen to s
+    void raised(TitleRecord* record, uint64_t s) {
+        if (s <= floor.load(memory_order_relaxed))
+            return;
+        lock_guard<mutex> guard(lock);
+        size_t i = 0;
+        while (i < entries.size() && entries[i].record != record)
+            i++;
+        if (i == entries.size()) {
+            if (entries.size() < Capacity) {
+                Entry e = { s, record };
+                entries.push_back(e);
+            } else if (s > entries.back().score) {
+                i = entries.size() - 1;
+                entries[i].record = record;
+            } else {
+                return;
+            }
+        }
+        entries[i].score = s;
+        for (; i > 0 && entries[i - 1].score < s; i--)
+            swap(entries[i - 1], entries[i]);
+        updateFloor();
+    }
+    
+    bool contains(TitleRecord* record) {
+        lock_guard<mutex> guard(lock);
+        for (size_t i = 0; i < entries.size(); i++)
+            if (entries[i].record == record)
+                return true;
+        return false;
+    }
+    
+    // Replaces the list with the best of ranked, a (score, record) per title
+    void reset(vector<pair<uint64_t, TitleRecord*>> &ranked) {
+        size_t n = ranked.size() < Capacity ? ranked.size() : Capacity;
+        partial_sort(ranked.begin(), ranked.begin() + n, ranked.end(), greater<pair<uint64_t, TitleRecord*>>());
+        lock_guard<mutex> guard(lock);
+        entries.clear();
+        for (size_t i = 0; i < n; i++) {
+            Entry e = { ranked[i].first, ranked[i].second };
+            entries.push_back(e);
+        }
+        updateFloor();
+    }
+    
+    void clear() {
+        lock_guard<mutex> guard(lock);
+        entries.clear();
+        updateFloor();
+    }
+    
+    // The best k titles, best first
+    vector<TitleRecord*> top(size_t k) {
+        lock_guard<mutex> guard(lock);
+        vector<TitleRecord*> out;
+        for (size_t i = 0; i < entries.size() && i < k; i++)
+            out.push_back(entries[i].record);
+        return out;
+    }
+};
+
+// Singleton that manages Books and Users, and handles transactions.
+//
+// Library is safe to use from many threads. catalogLock guards the
+// containers and indexes: adding, editing or removing records takes it
+// exclusively, everything else takes it shared. Borrow and return also lock
+// the user's stripe and the stripe of the book's title (always user
+// first), so transactions on different records proceed in parallel. Pointers returned
+// by getBook/getUser stay valid only until that record is removed.
+//
+// What circulation touches on every call lives in columns indexed by the
+// record's position in books/users rather than in the objects themselves:
+// an availability bitset and the borrower of each book, and each user's
+// loan count and limit. Borrow checks and "what is out" scans then read a
+// few packed words instead of visiting every Book.
+//
+// Each Book is one copy of a TitleRecord. The record lists the title's
+// copies and its free copies, so borrowing "any copy" takes the last free
+// one without a search. A copy that is not available and has no borrower
+// is being kept for the user whose hold on its title is ready. Holds are
+// guarded by holdLock, taken after any stripes; the record's hold count
+// lets returns of titles nobody is waiting for skip it.
+//
+// Reports read a CatalogSnapshot instead of the live records. Every change
+// that a report shows is mirrored into copy-on-write rows (bookRows and
+// userRows), and readSnapshot() freezes them under a brief exclusive lock
+// costing one pointer copy per page. Title records and names a row drops
+// are released only when no snapshot older than the drop is left
+// (epoch-based reclamation), so snapshots never see freed memory.
+class Library {
+private:
+    // Mutex padded to its own cache line so neighbouring stripes don't contend
+    struct alignas(64) Stripe {
+        mutex lock;
+    };
+    static const size_t LockStripes = 256;
+    
+    mutable shared_mutex catalogLock;
+    Stripe userStripes[LockStripes];
+    Stripe titleStripes[LockStripes];   // shared by every copy of a title
+    
+    vector<Book*> books;    
+    vector<User*> users;   
+    
+    // Per-book columns, parallel to books. Together with each user's
+    // borrowed list they form the loan table: a book on loan knows its
+    // borrower and its position in the borrower's list, so a loan can be
+    // found or ended from either side in O(1). The positions in the title's
+    // copy and free-copy lists make adding and removing copies O(1) too.
+    BitColumn bookAvailable;
+    AtomicColumn<int> bookBorrower;     // user ID holding the book, or -1
+    vector<uint32_t> bookLoanPos;       // position in the borrower's list; guarded by their stripe
+    vector<int> bookReservedFor;        // user whose ready hold keeps the copy, or -1
+    vector<uint32_t> bookFreePos;       // position in the title's freeCopies while available
+    vector<uint32_t> bookCopyPos;       // position in the title's copies
+    
+    // Loan times, parallel to books and guarded by the book's loan shard.
+    // Every loan is also scheduled on its shard's calendar queue at its due
+    // date; when the overdue scan reaches it, it moves to the shard's
+    // overdue list. Returns touch neither: entries whose loan has ended (or
+    // whose sequence number no longer matches) are dropped by the scan.
+    vector<int64_t> bookCheckedOut;
+    vector<int64_t> bookDue;
+    vector<uint32_t> bookLoanSeq;       // bumped by every loan of the book
+    
+    struct alignas(64) LoanShard {
+        mutex lock;
+        TimerWheel dueDates;                    // loans not yet found overdue
+        vector<TimerWheel::Timer> overdue;      // loans found overdue
+        LoanShard() : dueDates(3600) {}
+    };
+    static const size_t LoanShards = 16;
+    LoanShard loanShards[LoanShards];
+    
+    // Per-user column, parallel to users. Guarded by the user's stripe.
+    struct LoanQuota {
+        uint16_t count;
+        uint16_t limit;
+    };
+    vector<LoanQuota> userQuota;
+    
+    // Loans between branches of a sharded library (see LibraryRouter.cpp).
+    // The book's branch lends the copy to a borrower it has no record of,
+    // so it keeps the borrower's category for the loan's fines. The user's
+    // branch keeps the loan with its times and counts it, and every
+    // prepared transfer, against the user's limit. Guarded by remoteLock,
+    // which is taken last.
+    struct LentCopy {
+        UserCategory category;
+        int64_t txn;                    // transfer that lent it
+    };
+    mutex remoteLock;
+    unordered_map<int, LentCopy> lentAway;                  // book ID → borrower
+    unordered_map<int, vector<RemoteLoan>> remoteLoans;     // user ID → loans from other branches
+    unordered_map<int64_t, PendingTransfer> prepared;       // transfer ID → transfer
+    
+    // Rows parallel to books and users for readSnapshot(). Each row holds a
+    // reference on its title record or interned name. A reference dropped
+    // while a snapshot is alive waits in retired, tagged with the epoch of
+    // the drop, until every snapshot taken before that epoch has ended.
+    // epochLock guards the epoch, liveSnapshots and retired.
+    CowColumn<BookRow> bookRows;
+    CowColumn<UserRow> userRows;
+    struct Retired {
+        uint64_t epoch;
+        TitleRecord* record;
+        const string* name;
+    };
+    mutex epochLock;
+    uint64_t epoch;
+    map<uint64_t, size_t> liveSnapshots;    // epoch → snapshots taken in it
+    deque<Retired> retired;
+    
+    // The most-lent titles, kept current by every loan
+    TopTitles mostLent;
+    
+    // Every title with copies and loans by its TopTitles score, one set per
+    // title stripe and guarded by it, so a loan moves its title without a
+    // shared lock. mostLent is refilled from these when a count falls.
+    set<pair<uint64_t, TitleRecord*>> rankedTitles[LockStripes];
+    
+    // Hold queues per title; each TitleRecord also counts its holds
+    mutex holdLock;
+    HoldQueues holds;
+    int64_t holdPickupWindow;           // seconds a ready hold is kept
+    function<int64_t()> clock;          // current time in seconds
+    
+    // ID indexes from bookID/userID to the position in books/users
+    unordered_map<int, size_t> bookIndex;
+    unordered_map<int, size_t> userIndex;
+    
+    // Secondary indexes for searching by title, author and ISBN
+    FieldIndex titleIndex;
+    FieldIndex authorIndex;
+    FieldIndex isbnIndex;
+    
+    // Keyword index over titles and authors
+    TextIndex textIndex;
+    
+    // The title each ISBN in the catalog belongs to. An ISBN names one
+    // title, so addBook and editBook refuse a second title with the same
+    // ISBN (more copies of the same title are fine). Titles with an empty
+    // ISBN are not listed; saved data from before ISBNs were checked may
+    // hold titles that share one, and only the first is listed.
+    unordered_map<uint64_t, TitleRecord*> titlesByISBN;
+    
+    // Write-ahead log of mutations, or null when not logging
+    TransactionLog* txnLog;
+    
+    // Where calls are recorded, or null when not tracing
+    atomic<TraceRecorder*> trace;
+    
+    // Collects one public call's arguments and result and hands them to the
+    // attached recorder at the end of the call. Inert when nothing is
+    // attached, and for calls made inside another recorded call (the
+    // snapshot exportBooks takes, say), so a replay makes each call once.
+    class TraceCall {
+    private:
+        TraceRecorder* recorder;
+        TraceRecorder::Call call;
+        chrono::steady_clock::time_point start;
+        int exceptions;
+        
+        static int& depth() {
+            thread_local int calls = 0;
+            return calls;
+        }
+    public:
+        TraceCall(Library &library, LibraryOp op) : recorder(nullptr), exceptions(0) {
+            TraceRecorder* attached = library.trace.load(memory_order_acquire);
+            if (!attached || depth() > 0)
+                return;
+            depth()++;
+            recorder = attached;
+            call.op = op;
+            call.threw = false;
+            call.thread = 0;
+            call.now = library.clock();
+            call.result = 0;
+            exceptions = uncaught_exceptions();
+            start = chrono::steady_clock::now();
+        }
+        ~TraceCall() {
+            if (!recorder)
+                return;
+            depth()--;
+            call.durationNs = static_cast<uint64_t>(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count());
+            call.threw = uncaught_exceptions() > exceptions;
+            recorder->record(call, start);
+        }
+        TraceCall(const TraceCall&) = delete;
+        TraceCall& operator=(const TraceCall&) = delete;
+        
+        bool active() const { return recorder != nullptr; }
+        
+        TraceCall& arg(int64_t v) {
+            if (recorder)
+                call.ints.push_back(v);
+            return *this;
+        }
+        TraceCall& arg(const string &s) {
+            if (recorder)
+                call.text.push_back(s);
+            return *this;
+        }
+        
+        // Arguments that recreate a book or user: ID and fields
+        TraceCall& arg(Book* book) {
+            if (recorder) {
+                call.ints.push_back(book->getBookID());
+                call.text.push_back(book->getTitle());
+                call.text.push_back(book->getAuthor());
+                call.text.push_back(book->getISBN());
+            }
+            return *this;
+        }
+        TraceCall& arg(User* user) {
+            if (recorder) {
+                call.ints.push_back(user->getUserID());
+                call.ints.push_back(user->getUserTypeCode());
+                call.text.push_back(user->getName());
+            }
+            return *this;
+        }
+        
+        // Record the result and pass it through: a status, an ID or -1 for
+        // a book or user, or a count. Every try* call returns its status
+        // through here, so this is where a failed one is counted.
+        TxnStatus done(TxnStatus status) {
+            recordTxnStatus(status);
+            call.result = static_cast<int64_t>(status);
+            return status;
+        }
+        Book* done(Book* book) {
+            call.result = book ? book->getBookID() : -1;
+            return book;
+        }
+        User* done(User* user) {
+            call.result = user ? user->getUserID() : -1;
+            return user;
+        }
+        nullptr_t done(nullptr_t) {
+            call.result = -1;
+            return nullptr;
+        }
+        int done(int value) {
+            call.result = value;
+            return value;
+        }
+        size_t done(size_t count) {
+            call.result = static_cast<int64_t>(count);
+            return count;
+        }
+        template<class T>
+        vector<T> done(vector<T> &items) {
+            call.result = static_cast<int64_t>(items.size());
+            return move(items);
+        }
+        template<class T>
+        vector<T> done(vector<T> &&items) {
+            call.result = static_cast<int64_t>(items.size());
+            return move(items);
+        }
+    };
+
+    static int64_t systemSeconds() {
+        return chrono::duration_cast<chrono::seconds>(chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    Library() : epoch(0), holdPickupWindow(3 * 24 * 3600), clock(systemSeconds),
+                titleIndex(BookField::Title), authorIndex(BookField::Author), isbnIndex(BookField::ISBN), txnLog(nullptr), trace(nullptr) {
+        // Construct the object pools first so they outlive the singleton
+        StringPool::shared();
+        TitleRegistry::shared();
+        BookFactory::pool();
+        UserFactory::pool();
+    }  
+    
+    void indexTitle(TitleRecord* title) {
+        titleIndex.insert(title);
+        authorIndex.insert(title);
+        isbnIndex.insert(title);
+        textIndex.insert(title);
+    }
+    
+    // Indexes the new titles of a bulk load. The four indexes share
+    // nothing, so a large batch builds them on separate threads.
+    void indexTitles(const vector<TitleRecord*> &titles) {
+        function<void()> builds[] = {
+            [this, &titles] { titleIndex.insert(titles); },
+            [this, &titles] { authorIndex.insert(titles); },
+            [this, &titles] { isbnIndex.insert(titles); },
+            [this, &titles] {
+                for (size_t i = 0; i < titles.size(); i++)
+                    textIndex.insert(titles[i]);
+            }
+        };
+        const size_t MinParallel = 1 << 14;
+        bool parallel = titles.size() >= MinParallel && thread::hardware_concurrency() > 1;
+        vector<thread> workers;
+        for (size_t i = 1; i < 4; i++) {
+            if (parallel)
+                workers.push_back(thread(builds[i]));
+            else
+                builds[i]();
+        }
+        builds[0]();
+        for (size_t i = 0; i < workers.size(); i++)
+            workers[i].join();
+    }
+    
+    void unindexTitle(TitleRecord* title) {
+        titleIndex.erase(title);
+        authorIndex.erase(title);
+        isbnIndex.erase(title);
+        textIndex.erase(title);
+    }
+    
+    static const size_t NoSlot = SIZE_MAX;
+    
+    // Lookups for callers that already hold catalogLock
+    size_t bookSlot(int bookID) const {
+        unordered_map<int, size_t>::const_iterator it = bookIndex.find(bookID);
+        return it == bookIndex.end() ? NoSlot : it->second;
+    }
+    
+    size_t userSlot(int userID) const {
+        unordered_map<int, size_t>::const_iterator it = userIndex.find(userID);
+        return it == userIndex.end() ? NoSlot : it->second;
+    }
+    
+    Book* lookupBook(int bookID) const {
+        size_t slot = bookSlot(bookID);
+        return slot == NoSlot ? nullptr : books[slot];
+    }
+    
+    User* lookupUser(int userID) const {
+        size_t slot = userSlot(userID);
+        return slot == NoSlot ? nullptr : users[slot];
+    }
+    
+    // Marks the copy in bSlot free or not, keeping its title's free-copy
+    // list in step. Caller holds the title's stripe.
+    void setAvailableLocked(size_t bSlot, bool available) {
+        if (bookAvailable.test(bSlot) == available)
+            return;
+        vector<int> &freeCopies = books[bSlot]->getTitleRecord()->freeCopies;
+        if (available) {
+            bookFreePos[bSlot] = static_cast<uint32_t>(freeCopies.size());
+            freeCopies.push_back(books[bSlot]->getBookID());
+        } else {
+            eraseCopyAt(freeCopies, bookFreePos, bookFreePos[bSlot]);
+        }
+        bookAvailable.set(bSlot, available);
+        bookRows.update(bSlot, [available](BookRow &row) { row.available = available; });
+    }
+    
+    // Sets the borrower of the copy in bSlot (-1 for none)
+    void setBorrowerLocked(size_t bSlot, int userID) {
+        bookBorrower.store(bSlot, userID);
+        bookRows.update(bSlot, [userID](BookRow &row) { row.borrower = userID; });
+    }
+    
+    // Drops a row's reference on a title record and/or name, at once if no
+    // snapshot can still see it
+    void retire(TitleRecord* record, const string* name) {
+        {
+            lock_guard<mutex> guard(epochLock);
+            if (!liveSnapshots.empty()) {
+                Retired r = { epoch, record, name };
+                retired.push_back(r);
+                return;
+            }
+        }
+        releaseRow(record, name);
+    }
+    
+    static void releaseRow(TitleRecord* record, const string* name) {
+        if (record)
+            TitleRegistry::shared().release(record);
+        if (name)
+            StringPool::shared().release(name);
+    }
+    
+    // Ends a snapshot taken in epoch e and releases what no live snapshot
+    // can see any more
+    void endSnapshot(uint64_t e) {
+        vector<Retired> done;
+        {
+            lock_guard<mutex> guard(epochLock);
+            map<uint64_t, size_t>::iterator it = liveSnapshots.find(e);
+            if (--it->second == 0)
+                liveSnapshots.erase(it);
+            uint64_t oldest = liveSnapshots.empty() ? UINT64_MAX : liveSnapshots.begin()->first;
+            while (!retired.empty() && retired.front().epoch <= oldest) {
+                done.push_back(retired.front());
+                retired.pop_front();
+            }
+        }
+        for (size_t i = 0; i < done.size(); i++)
+            releaseRow(done[i].record, done[i].name);
+    }
+    
+    // Swap-and-pop removal from a title's copy list, where positions is the
+    // column recording each copy's place in that list
+    void eraseCopyAt(vector<int> &list, vector<uint32_t> &positions, uint32_t pos) {
+        list[pos] = list.back();
+        positions[bookIndex.find(list[pos])->second] = pos;
+        list.pop_back();
+    }
+    
+    LoanShard& loanShard(int bookID) { return loanShards[static_cast<unsigned>(bookID) % LoanShards]; }
+    
+    // Due date of a loan starting at checkedOut to the user in uSlot
+    int64_t loanDue(size_t uSlot, int64_t checkedOut) const {
+        return loanDue(users[uSlot]->getCategory(), checkedOut);
+    }
+    
+    static int64_t loanDue(UserCategory category, int64_t checkedOut) {
+        return checkedOut + static_cast<int64_t>(userCategoryPolicy(category).loanDays) * 86400;
+    }
+    
+    static int64_t fineAt(UserCategory category, int64_t due, int64_t now) {
+        if (now <= due)
+            return 0;
+        int64_t days = (now - due + 86399) / 86400;
+        return days * userCategoryPolicy(category).fineCentsPerDay;
+    }
+    
+    // Moves the shard's loans that have come due onto its overdue list,
+    // drops entries for loans that have ended, and appends the overdue
+    // loans with their fines to out. Caller holds catalogLock shared.
+    void scanOverdueLocked(LoanShard &shard, int64_t now, vector<LoanRecord> &out) {
+        lock_guard<mutex> shardGuard(shard.lock);
+        shard.dueDates.advance(now, shard.overdue);
+        size_t kept = 0;
+        for (size_t i = 0; i < shard.overdue.size(); i++) {
+            const TimerWheel::Timer &entry = shard.overdue[i];
+            size_t slot = bookSlot(static_cast<int>(entry.id));
+            if (slot == NoSlot || bookLoanSeq[slot] != entry.generation)
+                continue;
+            int borrower = bookBorrower.load(slot);
+            UserCategory category;
+            if (borrower < 0 || !borrowerCategory(static_cast<int>(entry.id), borrower, category))
+                continue;
+            shard.overdue[kept++] = entry;
+            LoanRecord loan = { borrower, static_cast<int>(entry.id), bookCheckedOut[slot], bookDue[slot],
+                                fineAt(category, bookDue[slot], now) };
+            out.push_back(loan);
+        }
+        shard.overdue.resize(kept);
+    }
+    
+    // Category of the user borrowing bookID, who may be a user of another
+    // branch; false if a loan to another branch has just ended. Caller
+    // holds catalogLock.
+    bool borrowerCategory(int bookID, int borrower, UserCategory &category) {
+        size_t uSlot = userSlot(borrower);
+        if (uSlot != NoSlot) {
+            category = users[uSlot]->getCategory();
+            return true;
+        }
+        lock_guard<mutex> remoteGuard(remoteLock);
+        unordered_map<int, LentCopy>::iterator it = lentAway.find(bookID);
+        if (it == lentAway.end())
+            return false;
+        category = it->second.category;
+        return true;
+    }
+    
+    static bool dueFirst(const LoanRecord &a, const LoanRecord &b) {
+        return a.due != b.due ? a.due < b.due : a.bookID < b.bookID;
+    }
+    
+    // Transaction bodies, given the records' slots; callers hold catalogLock
+    // plus the user and title stripes (or catalogLock exclusively)
+    TxnStatus borrowLocked(size_t uSlot, size_t bSlot, int64_t checkedOut, int64_t due) {
+        int userID = users[uSlot]->getUserID();
+        if (!bookAvailable.test(bSlot) && bookReservedFor[bSlot] != userID)
+            return TxnStatus::BookUnavailable;
+        LoanQuota &quota = userQuota[uSlot];
+        if (quota.count >= quota.limit)
+            return TxnStatus::LimitReached;
+        if (books[bSlot]->getTitleRecord()->holds > 0)
+            fulfilHoldLocked(userID, bSlot);
+        int bookID = books[bSlot]->getBookID();
+        bookReservedFor[bSlot] = -1;
+        setAvailableLocked(bSlot, false);
+        bookLoanPos[bSlot] = static_cast<uint32_t>(users[uSlot]->borrowBook(bookID));
+        quota.count++;
+        userRows.update(uSlot, [](UserRow &row) { row.loans++; });
+        startLoanLocked(bSlot, userID, checkedOut, due);
+        return TxnStatus::OK;
+    }
+    
+    // Records the copy in bSlot as lent to userID, counts the loan for the
+    // copy and its title, and puts the loan on its shard's calendar
+    void startLoanLocked(size_t bSlot, int userID, int64_t checkedOut, int64_t due) {
+        int bookID = books[bSlot]->getBookID();
+        TitleRecord* t = books[bSlot]->getTitleRecord();
+        t->loans++;
+        raiseRankLocked(t, t->loans - 1);
+        mostLent.raised(t, TopTitles::score(t->loans, t->titleID));
+        LoanShard &shard = loanShard(bookID);
+        lock_guard<mutex> shardGuard(shard.lock);
+        bookBorrower.store(bSlot, userID);
+        bookRows.update(bSlot, [userID](BookRow &row) {
+            row.borrower = userID;
+            row.loans++;
+        });
+        bookCheckedOut[bSlot] = checkedOut;
+        bookDue[bSlot] = due;
+        shard.dueDates.schedule(due, static_cast<uint32_t>(bookID), ++bookLoanSeq[bSlot]);
+    }
+    
+    // Lends the copy in bSlot to userID of another branch under transfer
+    // txn; caller holds catalogLock and the title's stripe. Only a free copy
+    // can go: holds are taken by each branch for its own users.
+    TxnStatus lendRemoteLocked(size_t bSlot, int64_t txn, int userID, UserCategory category,
+                               int64_t checkedOut, int64_t due) {
+        if (!bookAvailable.test(bSlot))
+            return TxnStatus::BookUnavailable;
+        setAvailableLocked(bSlot, false);
+        {
+            lock_guard<mutex> remoteGuard(remoteLock);
+            LentCopy lent = { category, txn };
+            lentAway[books[bSlot]->getBookID()] = lent;
+        }
+        startLoanLocked(bSlot, userID, checkedOut, due);
+        return TxnStatus::OK;
+    }
+    
+    // Takes back a copy lent to userID of another branch; txn, if given,
+    // gets the transfer that lent it
+    TxnStatus returnRemoteLocked(int userID, size_t bSlot, int64_t* txn = nullptr) {
+        if (bookBorrower.load(bSlot) != userID)
+            return TxnStatus::NotBorrowed;
+        {
+            lock_guard<mutex> remoteGuard(remoteLock);
+            unordered_map<int, LentCopy>::iterator it = lentAway.find(books[bSlot]->getBookID());
+            if (it == lentAway.end())
+                return TxnStatus::NotBorrowed;
+            if (txn)
+                *txn = it->second.txn;
+            lentAway.erase(it);
+        }
+        setBorrowerLocked(bSlot, -1);
+        releaseBookLocked(bSlot);
+        return TxnStatus::OK;
+    }
+    
+    // The user's side of a transfer; callers hold catalogLock and the
+    // user's stripe. Preparing reserves a place in the user's limit, which
+    // committing turns into a loan and aborting gives back. Preparing the
+    // same transfer twice has no further effect.
+    TxnStatus prepareTransferLocked(int64_t txn, size_t uSlot, int bookID) {
+        LoanQuota &quota = userQuota[uSlot];
+        lock_guard<mutex> remoteGuard(remoteLock);
+        if (prepared.count(txn))
+            return TxnStatus::OK;
+        if (quota.count >= quota.limit)
+            return TxnStatus::LimitReached;
+        PendingTransfer transfer = { txn, users[uSlot]->getUserID(), bookID };
+        prepared[txn] = transfer;
+        quota.count++;
+        return TxnStatus::OK;
+    }
+    
+    // A transfer whose user has since been removed just ends
+    TxnStatus commitTransferLocked(int64_t txn, int64_t checkedOut, int64_t due) {
+        lock_guard<mutex> remoteGuard(remoteLock);
+        unordered_map<int64_t, PendingTransfer>::iterator it = prepared.find(txn);
+        if (it == prepared.end())
+            return TxnStatus::NoSuchTransfer;
+        PendingTransfer transfer = it->second;
+        prepared.erase(it);
+        size_t uSlot = userSlot(transfer.userID);
+        if (uSlot != NoSlot) {
+            RemoteLoan loan = { txn, { transfer.userID, transfer.bookID, checkedOut, due, 0 } };
+            remoteLoans[transfer.userID].push_back(loan);
+            userRows.update(uSlot, [](UserRow &row) { row.loans++; });
+        }
+        return TxnStatus::OK;
+    }
+    
+    TxnStatus abortTransferLocked(int64_t txn) {
+        lock_guard<mutex> remoteGuard(remoteLock);
+        unordered_map<int64_t, PendingTransfer>::iterator it = prepared.find(txn);
+        if (it == prepared.end())
+            return TxnStatus::NoSuchTransfer;
+        size_t uSlot = userSlot(it->second.userID);
+        if (uSlot != NoSlot)
+            userQuota[uSlot].count--;
+        prepared.erase(it);
+        return TxnStatus::OK;
+    }
+    
+    // User ID of a prepared transfer, or -1
+    int transferUser(int64_t txn) {
+        lock_guard<mutex> remoteGuard(remoteLock);
+        unordered_map<int64_t, PendingTransfer>::iterator it = prepared.find(txn);
+        return it == prepared.end() ? -1 : it->second.userID;
+    }
+    
+    // Ends the user's loan of another branch's book, made by transfer txn
+    // (0: any), once that branch has the book back
+    TxnStatus endRemoteLoanLocked(size_t uSlot, int bookID, int64_t txn) {
+        int userID = users[uSlot]->getUserID();
+        lock_guard<mutex> remoteGuard(remoteLock);
+        unordered_map<int, vector<RemoteLoan>>::iterator it = remoteLoans.find(userID);
+        if (it == remoteLoans.end())
+            return TxnStatus::NotBorrowed;
+        vector<RemoteLoan> &loans = it->second;
+        size_t i = 0;
+        while (i < loans.size() && (loans[i].loan.bookID != bookID || (txn != 0 && loans[i].txn != txn)))
+            i++;
+        if (i == loans.size())
+            return TxnStatus::NotBorrowed;
+        loans[i] = loans.back();
+        loans.pop_back();
+        if (loans.empty())
+            remoteLoans.erase(it);
+        userQuota[uSlot].count--;
+        return TxnStatus::OK;
+    }
+    
+    // userID is borrowing the copy in bSlot: their hold on its title is
+    // done, and a different copy kept for them goes to the next in line
+    void fulfilHoldLocked(int userID, size_t bSlot) {
+        TitleRecord* t = books[bSlot]->getTitleRecord();
+        int readyCopy;
+        {
+            lock_guard<mutex> holdGuard(holdLock);
+            if (!holds.cancel(userID, t, readyCopy))
+                return;
+        }
+        t->holds--;
+        if (readyCopy >= 0 && readyCopy != books[bSlot]->getBookID()) {
+            size_t kept = bookSlot(readyCopy);
+            bookReservedFor[kept] = -1;
+            releaseBookLocked(kept);
+        }
+    }
+    
+    TxnStatus returnLocked(size_t uSlot, size_t bSlot) {
+        if (bookBorrower.load(bSlot) != users[uSlot]->getUserID())
+            return TxnStatus::NotBorrowed;
+        endLoanLocked(uSlot, bSlot);
+        releaseBookLocked(bSlot);
+        return TxnStatus::OK;
+    }
+    
+    // Ends the loan of the book in bSlot to the user in uSlot, with the same
+    // locking as returnLocked, leaving the copy unavailable
+    void endLoanLocked(size_t uSlot, size_t bSlot) {
+        int moved = users[uSlot]->removeLoanAt(bookLoanPos[bSlot]);
+        if (moved >= 0)
+            bookLoanPos[bookIndex.find(moved)->second] = bookLoanPos[bSlot];
+        setBorrowerLocked(bSlot, -1);
+        userQuota[uSlot].count--;
+    }
+    
+    // The copy in bSlot has neither a borrower nor a ready hold: keep it for
+    // the next hold on its title, or make it available
+    void releaseBookLocked(size_t bSlot) {
+        TitleRecord* t = books[bSlot]->getTitleRecord();
+        if (t->holds > 0) {
+            int userID;
+            {
+                lock_guard<mutex> holdGuard(holdLock);
+                userID = holds.promote(t, books[bSlot]->getBookID(), clock() + holdPickupWindow);
+            }
+            if (userID >= 0) {
+                bookReservedFor[bSlot] = userID;
+                setAvailableLocked(bSlot, false);
+                return;
+            }
+        }
+        setAvailableLocked(bSlot, true);
+    }
+    
+    // Hold bodies, with the same locking as borrowLocked. A hold is on the
+    // title, so it is only needed when no copy is free and the user does not
+    // already have one.
+    TxnStatus placeHoldLocked(size_t uSlot, size_t bSlot) {
+        User* user = users[uSlot];
+        TitleRecord* t = books[bSlot]->getTitleRecord();
+        if (!t->freeCopies.empty())
+            return TxnStatus::HoldNotNeeded;
+        const vector<int>& loans = user->getBorrowedBooks();
+        for (size_t i = 0; i < loans.size(); i++)
+            if (lookupBook(loans[i])->getTitleRecord() == t)
+                return TxnStatus::HoldNotNeeded;
+        lock_guard<mutex> holdGuard(holdLock);
+        if (holds.contains(user->getUserID(), t))
+            return TxnStatus::AlreadyHeld;
+        holds.enqueue(user->getUserID(), t, userCategoryPolicy(user->getCategory()).holdPriority);
+        t->holds++;
+        return TxnStatus::OK;
+    }
+    
+    TxnStatus cancelHoldLocked(size_t uSlot, size_t bSlot) {
+        TitleRecord* t = books[bSlot]->getTitleRecord();
+        int readyCopy;
+        {
+            lock_guard<mutex> holdGuard(holdLock);
+            if (!holds.cancel(users[uSlot]->getUserID(), t, readyCopy))
+                return TxnStatus::NoSuchHold;
+        }
+        t->holds--;
+        if (readyCopy >= 0) {
+            size_t kept = bookSlot(readyCopy);
+            bookReservedFor[kept] = -1;
+            releaseBookLocked(kept);
+        }
+        return TxnStatus::OK;
+    }
+    
+    // Drops the ready hold keeping the copy in bSlot if its deadline is at
+    // or before now, passing the copy on; caller holds catalogLock exclusively
+    bool expireHoldLocked(size_t bSlot, int64_t now) {
+        int userID = bookReservedFor[bSlot];
+        if (userID < 0)
+            return false;
+        TitleRecord* t = books[bSlot]->getTitleRecord();
+        {
+            lock_guard<mutex> holdGuard(holdLock);
+            int64_t deadline = holds.readyUntil(userID, t);
+            if (deadline == 0 || deadline > now)
+                return false;
+            int readyCopy;
+            holds.cancel(userID, t, readyCopy);
+        }
+        t->holds--;
+        bookReservedFor[bSlot] = -1;
+        releaseBookLocked(bSlot);
+        return true;
+    }
+    
+    // Adds the book in bSlot to its title's copies. It starts unavailable;
+    // callers release it once they know it is not on loan. A title is in
+    // the search indexes while it has copies; a bulk load passes newTitles
+    // to collect the titles to index and index them together.
+    void attachCopyLocked(size_t bSlot, vector<TitleRecord*>* newTitles = nullptr) {
+        TitleRecord* t = books[bSlot]->getTitleRecord();
+        if (t->copies.empty()) {
+            if (newTitles)
+                newTitles->push_back(t);
+            else
+                indexTitle(t);
+            if (!t->isbnKey.empty())
+                titlesByISBN.emplace(t->isbnKey.value(), t);
+        }
+        uint32_t lent = bookRows[bSlot].loans;
+        if (lent > 0)
+            unrankTitleLocked(t);
+        bookCopyPos[bSlot] = static_cast<uint32_t>(t->copies.size());
+        t->copies.push_back(books[bSlot]->getBookID());
+        if (lent > 0) {
+            t->loans += lent;
+            mostLent.raised(t, TopTitles::score(t->loans, t->titleID));
+        }
+        rankTitleLocked(t);
+    }
+    
+    // Takes the book in bSlot out of its title's copies. A hold the copy was
+    // kept for goes back to the front of the line, and the title's holds
+    // are dropped along with its last copy.
+    void detachCopyLocked(size_t bSlot) {
+        TitleRecord* t = books[bSlot]->getTitleRecord();
+        if (bookReservedFor[bSlot] >= 0) {
+            lock_guard<mutex> holdGuard(holdLock);
+            holds.revert(bookReservedFor[bSlot], t);
+            bookReservedFor[bSlot] = -1;
+        }
+        setAvailableLocked(bSlot, false);
+        unrankTitleLocked(t);
+        eraseCopyAt(t->copies, bookCopyPos, bookCopyPos[bSlot]);
+        if (t->copies.empty()) {
+            unindexTitle(t);
+            unordered_map<uint64_t, TitleRecord*>::iterator it = titlesByISBN.find(t->isbnKey.value());
+            if (!t->isbnKey.empty() && it != titlesByISBN.end() && it->second == t)
+                titlesByISBN.erase(it);
+        }
+        // The copy takes its loans with it
+        uint32_t lent = bookRows[bSlot].loans;
+        t->loans -= lent;
+        rankTitleLocked(t);
+        if ((lent > 0 || t->copies.empty()) && mostLent.contains(t))
+            refillMostLentLocked();
+        if (t->copies.empty() && t->holds > 0) {
+            lock_guard<mutex> holdGuard(holdLock);
+            holds.removeTitle(t);
+            t->holds = 0;
+        }
+    }
+    
+    // The title other than the one with this title and author that isbn
+    // already belongs to, or null. The copy movingBookID, which is about
+    // to leave its title, does not count.
+    TitleRecord* isbnOwnerLocked(const string &title, const string &author, const string &isbn, int movingBookID = -1) {
+        ISBN key;
+        if (!ISBN::parse(isbn, key))
+            return nullptr;
+        unordered_map<uint64_t, TitleRecord*>::iterator it = titlesByISBN.find(key.value());
+        if (it == titlesByISBN.end())
+            return nullptr;
+        TitleRecord* owner = it->second;
+        if (owner->getTitle() == title && owner->getAuthor() == author)
+            return nullptr;
+        if (owner->copies.size() == 1 && owner->copies[0] == movingBookID)
+            return nullptr;
+        return owner;
+    }
+    
+    void checkISBNLocked(const string &title, const string &author, const string &isbn, int movingBookID = -1) {
+        TitleRecord* owner = isbnOwnerLocked(title, author, isbn, movingBookID);
+        if (owner)
+            throw LibraryException("ISBN " + isbn + " already belongs to " + owner->getTitle() + " by " + owner->getAuthor() + ".", LibraryError::ISBNTaken);
+    }
+    
+    set<pair<uint64_t, TitleRecord*>>& rankingOf(const TitleRecord* t) {
+        return rankedTitles[static_cast<unsigned>(t->titleID) % LockStripes];
+    }
+    
+    // Take a title out of its stripe's ranking before its loans or copies
+    // change and put it back after; it is ranked while it has both. The
+    // caller holds the title's stripe or catalogLock exclusively.
+    void unrankTitleLocked(TitleRecord* t) {
+        if (t->loans > 0)
+            rankingOf(t).erase(make_pair(TopTitles::score(t->loans, t->titleID), t));
+    }
+    
+    void rankTitleLocked(TitleRecord* t) {
+        if (t->loans > 0 && !t->copies.empty())
+            rankingOf(t).insert(make_pair(TopTitles::score(t->loans, t->titleID), t));
+    }
+    
+    // Moves t up its ranking after a loan raised its count from before,
+    // reusing the set node so that a loan allocates nothing
+    void raiseRankLocked(TitleRecord* t, uint32_t before) {
+        set<pair<uint64_t, TitleRecord*>> &ranking = rankingOf(t);
+        set<pair<uint64_t, TitleRecord*>>::node_type node;
+        if (before > 0)
+            node = ranking.extract(make_pair(TopTitles::score(before, t->titleID), t));
+        if (node.empty()) {
+            rankTitleLocked(t);
+            return;
+        }
+        node.value() = make_pair(TopTitles::score(t->loans, t->titleID), t);
+        ranking.insert(move(node));
+    }
+    
+    // Refills mostLent from the best few of each stripe's ranking, which
+    // costs the same however large the catalog is
+    void refillMostLentLocked() {
+        vector<pair<uint64_t, TitleRecord*>> ranked;
+        for (size_t s = 0; s < LockStripes; s++) {
+            set<pair<uint64_t, TitleRecord*>>::reverse_iterator it = rankedTitles[s].rbegin();
+            for (size_t n = 0; n < TopTitles::Capacity && it != rankedTitles[s].rend(); n++, ++it)
+                ranked.push_back(*it);
+        }
+        mostLent.reset(ranked);
+    }
+    
+    // Ranks every title with copies from scratch, as after a load that set
+    // the loan counts directly
+    void rankTitlesLocked() {
+        for (size_t s = 0; s < LockStripes; s++)
+            rankedTitles[s].clear();
+        for (size_t i = 0; i < books.size(); i++) {
+            TitleRecord* t = books[i]->getTitleRecord();
+            if (t->copies[0] == books[i]->getBookID())
+                rankTitleLocked(t);
+        }
+        refillMostLentLocked();
+    }
+    
+    // Structural changes shared by the public API and log replay; the
+    // caller holds catalogLock exclusively
+    void addBookLocked(Book* book) {
+        TitleRegistry::shared().retain(book->getTitleRecord());
+        placeBookLocked(book, nullptr);
+    }
+    
+    // addBookLocked() without taking the catalog row's reference to the
+    // title, which the caller has taken already
+    void placeBookLocked(Book* book, vector<TitleRecord*>* newTitles) {
+        size_t slot = books.size();
+        bookIndex[book->getBookID()] = slot;
+        books.push_back(book);
+        bookAvailable.push_back(false);
+        bookBorrower.push_back(-1);
+        bookLoanPos.push_back(0);
+        bookReservedFor.push_back(-1);
+        bookFreePos.push_back(0);
+        bookCopyPos.push_back(0);
+        bookCheckedOut.push_back(0);
+        bookDue.push_back(0);
+        bookLoanSeq.push_back(0);
+        BookRow row = { book->getBookID(), -1, false, 0, book->getTitleRecord() };
+        bookRows.push_back(row);
+        attachCopyLocked(slot, newTitles);
+        releaseBookLocked(slot);
+    }
+    
+    // Moves the book in bSlot to another title; a copy on loan stays with
+    // its borrower
+    void editBookLocked(size_t bSlot, const string &title, const string &author, const string &isbn) {
+        Book* book = books[bSlot];
+        detachCopyLocked(bSlot);
+        book->editBook(title, author, ISBN::canonical(isbn));
+        TitleRecord* record = book->getTitleRecord();
+        TitleRegistry::shared().retain(record);
+        retire(bookRows[bSlot].record, nullptr);
+        bookRows.update(bSlot, [record](BookRow &row) { row.record = record; });
+        attachCopyLocked(bSlot);
+        if (bookBorrower.load(bSlot) < 0)
+            releaseBookLocked(bSlot);
+    }
+    
+    // Removal moves the last book into the freed position, so it is O(1)
+    // but does not preserve listing order. A book on loan is taken off its
+    // borrower's list first.
+    bool removeBookLocked(int bookID) {
+        unordered_map<int, size_t>::iterator it = bookIndex.find(bookID);
+        if (it == bookIndex.end())
+            return false;
+        size_t slot = it->second;
+        // A copy lent to another branch just stops being lent; that
+        // branch's loan record stays until the user returns it
+        int borrower = bookBorrower.load(slot);
+        if (borrower >= 0) {
+            size_t uSlot = userSlot(borrower);
+            if (uSlot != NoSlot)
+                endLoanLocked(uSlot, slot);
+            else
+                lentAway.erase(bookID);
+            setBorrowerLocked(slot, -1);
+        }
+        detachCopyLocked(slot);
+        bookIndex.erase(it);
+        BookFactory::destroyBook(books[slot]);
+        retire(bookRows[slot].record, nullptr);
+        size_t last = books.size() - 1;
+        if (slot != last) {
+            books[slot] = books[last];
+            BookRow moved = bookRows[last];
+            bookRows.update(slot, [&moved](BookRow &row) { row = moved; });
+            bookAvailable.set(slot, bookAvailable.test(last));
+            bookBorrower.store(slot, bookBorrower.load(last));
+            bookLoanPos[slot] = bookLoanPos[last];
+            bookReservedFor[slot] = bookReservedFor[last];
+            bookFreePos[slot] = bookFreePos[last];
+            bookCopyPos[slot] = bookCopyPos[last];
+            bookCheckedOut[slot] = bookCheckedOut[last];
+            bookDue[slot] = bookDue[last];
+            bookLoanSeq[slot] = bookLoanSeq[last];
+            bookIndex[books[slot]->getBookID()] = slot;
+        }
+        books.pop_back();
+        bookAvailable.pop_back();
+        bookBorrower.pop_back();
+        bookLoanPos.pop_back();
+        bookReservedFor.pop_back();
+        bookFreePos.pop_back();
+        bookCopyPos.pop_back();
+        bookCheckedOut.pop_back();
+        bookDue.pop_back();
+        bookLoanSeq.pop_back();
+        bookRows.pop_back();
+        return true;
+    }
+    
+    void registerUserLocked(User* user) {
+        userIndex[user->getUserID()] = users.size();
+        users.push_back(user);
+        LoanQuota quota = { static_cast<uint16_t>(user->getBorrowedBooks().size()),
+                            static_cast<uint16_t>(user->getMaxBooks()) };
+        userQuota.push_back(quota);
+        UserRow row = { user->getUserID(), user->getCategory(), 0, StringPool::shared().intern(user->getName()) };
+        userRows.push_back(row);
+    }
+    
+    void editUserLocked(size_t uSlot, const string &name) {
+        users[uSlot]->editUser(name);
+        const string* interned = StringPool::shared().intern(name);
+        retire(nullptr, userRows[uSlot].name);
+        userRows.update(uSlot, [interned](UserRow &row) { row.name = interned; });
+    }
+    
+    // The user's holds are dropped and books they still have out are
+    // released, going to the next hold in line if there is one
+    bool removeUserLocked(int userID) {
+        unordered_map<int, size_t>::iterator it = userIndex.find(userID);
+        if (it == userIndex.end())
+            return false;
+        size_t slot = it->second;
+        vector<pair<TitleRecord*, int>> dropped;
+        {
+            lock_guard<mutex> holdGuard(holdLock);
+            dropped = holds.removeUser(userID);
+        }
+        for (size_t i = 0; i < dropped.size(); i++) {
+            dropped[i].first->holds--;
+            if (dropped[i].second >= 0) {
+                size_t kept = bookSlot(dropped[i].second);
+                bookReservedFor[kept] = -1;
+                releaseBookLocked(kept);
+            }
+        }
+        const vector<int>& loans = users[slot]->getBorrowedBooks();
+        for (size_t i = 0; i < loans.size(); i++) {
+            size_t bSlot = bookSlot(loans[i]);
+            setBorrowerLocked(bSlot, -1);
+            releaseBookLocked(bSlot);
+        }
+        remoteLoans.erase(userID);
+        userIndex.erase(it);
+        UserFactory::destroyUser(users[slot]);
+        retire(nullptr, userRows[slot].name);
+        if (slot != users.size() - 1) {
+            users[slot] = users.back();
+            userQuota[slot] = userQuota.back();
+            UserRow moved = userRows[users.size() - 1];
+            userRows.update(slot, [&moved](UserRow &row) { row = moved; });
+            userIndex[users[slot]->getUserID()] = slot;
+        }
+        users.pop_back();
+        userQuota.pop_back();
+        userRows.pop_back();
+        return true;
+    }
+    
+    // Log helpers; each returns the record's sequence number, or 0 when not
+    // logging. They must be called while the change is still locked so log
+    // order matches the order changes were applied.
+    uint64_t logBook(LogOp op, Book* book) {
+        if (!txnLog)
+            return 0;
+        BinaryWriter w;
+        w.putU8(static_cast<uint8_t>(op));
+        w.putI32(book->getBookID());
+        w.putString(book->getTitle());
+        w.putString(book->getAuthor());
+        w.putString(book->getISBN());
+        return txnLog->append(w.bytes());
+    }
+    
+    uint64_t logUser(LogOp op, User* user) {
+        if (!txnLog)
+            return 0;
+        BinaryWriter w;
+        w.putU8(static_cast<uint8_t>(op));
+        w.putI32(user->getUserID());
+        w.putU8(static_cast<uint8_t>(user->getUserTypeCode()));
+        w.putString(user->getName());
+        return txnLog->append(w.bytes());
+    }
+    
+    uint64_t logRemove(LogOp op, int id) {
+        if (!txnLog)
+            return 0;
+        BinaryWriter w;
+        w.putU8(static_cast<uint8_t>(op));
+        w.putI32(id);
+        return txnLog->append(w.bytes());
+    }
+    
+    // Borrow, return and hold records
+    uint64_t logLoan(LogOp op, int userID, int bookID) {
+        if (!txnLog)
+            return 0;
+        BinaryWriter w;
+        w.putU8(static_cast<uint8_t>(op));
+        w.putI32(userID);
+        w.putI32(bookID);
+        return txnLog->append(w.bytes());
+    }
+    
+    // Borrow records also carry the loan's times, so replay restores the
+    // original due date
+    uint64_t logBorrow(int userID, int bookID, int64_t checkedOut, int64_t due) {
+        if (!txnLog)
+            return 0;
+        BinaryWriter w;
+        w.putU8(static_cast<uint8_t>(LogOp::Borrow));
+        w.putI32(userID);
+        w.putI32(bookID);
+        w.putI64(checkedOut);
+        w.putI64(due);
+        return txnLog->append(w.bytes());
+    }
+    
+    // Transfer records carry every field; commits use the times and
+    // prepares the user and book
+    uint64_t logTransfer(LogOp op, int64_t txn, int userID, int bookID, int64_t checkedOut, int64_t due) {
+        if (!txnLog)
+            return 0;
+        BinaryWriter w;
+        w.putU8(static_cast<uint8_t>(op));
+        w.putI64(txn);
+        w.putI32(userID);
+        w.putI32(bookID);
+        w.putI64(checkedOut);
+        w.putI64(due);
+        return txnLog->append(w.bytes());
+    }
+    
+    uint64_t logLendRemote(int64_t txn, int userID, UserCategory category, int bookID, int64_t checkedOut, int64_t due) {
+        if (!txnLog)
+            return 0;
+        BinaryWriter w;
+        w.putU8(static_cast<uint8_t>(LogOp::LendRemote));
+        w.putI32(userID);
+        w.putU8(static_cast<uint8_t>(category));
+        w.putI32(bookID);
+        w.putI64(checkedOut);
+        w.putI64(due);
+        w.putI64(txn);
+        return txnLog->append(w.bytes());
+    }
+    
+    uint64_t logEndRemoteLoan(int userID, int bookID, int64_t txn) {
+        if (!txnLog)
+            return 0;
+        BinaryWriter w;
+        w.putU8(static_cast<uint8_t>(LogOp::EndRemoteLoan));
+        w.putI32(userID);
+        w.putI32(bookID);
+        w.putI64(txn);
+        return txnLog->append(w.bytes());
+    }
+    
+    // Waits for a logged change to reach disk; call after releasing locks
+    // so other threads' records can join the same group commit.
+    void waitForLog(uint64_t lsn) {
+        if (lsn != 0)
+            txnLog->waitDurable(lsn);
+    }
+    
+    // Re-applies one logged operation; caller holds catalogLock exclusively
+    void applyLogRecord(BinaryReader &r) {
+        LogOp op = static_cast<LogOp>(r.getU8());
+        if (op == LogOp::AddBook || op == LogOp::EditBook) {
+            int id = r.getI32();
+            string title = r.getString();
+            string author = r.getString();
+            string isbn = r.getString();
+            size_t slot = bookSlot(id);
+            if (op == LogOp::AddBook && slot == NoSlot) {
+                addBookLocked(BookFactory::restoreBook(id, title, author, isbn));
+                if (id >= Book::getNextBookID())
+                    Book::setNextBookID(id + 1);
+            } else if (op == LogOp::EditBook && slot != NoSlot) {
+                editBookLocked(slot, title, author, isbn);
+            }
+        }
+        else if (op == LogOp::RegisterUser || op == LogOp::EditUser) {
+            int id = r.getI32();
+            int type = r.getU8();
+            string name = r.getString();
+            User* user = lookupUser(id);
+            if (op == LogOp::RegisterUser && !user) {
+                registerUserLocked(UserFactory::restoreUser(type, id, name));
+                if (id >= User::getNextUserID())
+                    User::setNextUserID(id + 1);
+            } else if (op == LogOp::EditUser && user) {
+                editUserLocked(userSlot(id), name);
+            }
+        }
+        else if (op == LogOp::RemoveBook) {
+            removeBookLocked(r.getI32());
+        }
+        else if (op == LogOp::RemoveUser) {
+            removeUserLocked(r.getI32());
+        }
+        else if (op == LogOp::Borrow || op == LogOp::Return || op == LogOp::PlaceHold || op == LogOp::CancelHold) {
+            size_t uSlot = userSlot(r.getI32());
+            size_t bSlot = bookSlot(r.getI32());
+            if (uSlot != NoSlot && bSlot != NoSlot) {
+                if (op == LogOp::Borrow) {
+                    // Records written before loans had due dates end here
+                    int64_t checkedOut = r.atEnd() ? clock() : r.getI64();
+                    int64_t due = r.atEnd() ? loanDue(uSlot, checkedOut) : r.getI64();
+                    borrowLocked(uSlot, bSlot, checkedOut, due);
+                }
+                else if (op == LogOp::Return)
+                    returnLocked(uSlot, bSlot);
+                else if (op == LogOp::PlaceHold)
+                    placeHoldLocked(uSlot, bSlot);
+                else
+                    cancelHoldLocked(uSlot, bSlot);
+            }
+        }
+        else if (op == LogOp::ExpireHold) {
+            size_t bSlot = bookSlot(r.getI32());
+            if (bSlot != NoSlot)
+                expireHoldLocked(bSlot, INT64_MAX);
+        }
+        else if (op == LogOp::PrepareTransfer || op == LogOp::CommitTransfer || op == LogOp::AbortTransfer) {
+            int64_t txn = r.getI64();
+            size_t uSlot = userSlot(r.getI32());
+            int bookID = r.getI32();
+            int64_t checkedOut = r.getI64();
+            int64_t due = r.getI64();
+            if (op == LogOp::PrepareTransfer && uSlot != NoSlot)
+                prepareTransferLocked(txn, uSlot, bookID);
+            else if (op == LogOp::CommitTransfer)
+                commitTransferLocked(txn, checkedOut, due);
+            else if (op == LogOp::AbortTransfer)
+                abortTransferLocked(txn);
+        }
+        else if (op == LogOp::LendRemote) {
+            int userID = r.getI32();
+            UserCategory category = static_cast<UserCategory>(r.getU8());
+            size_t bSlot = bookSlot(r.getI32());
+            int64_t checkedOut = r.getI64();
+            int64_t due = r.getI64();
+            // Records written before lends kept their transfer end here
+            int64_t txn = r.atEnd() ? 0 : r.getI64();
+            if (bSlot != NoSlot)
+                lendRemoteLocked(bSlot, txn, userID, category, checkedOut, due);
+        }
+        else if (op == LogOp::ReturnRemote) {
+            int userID = r.getI32();
+            size_t bSlot = bookSlot(r.getI32());
+            if (bSlot != NoSlot)
+                returnRemoteLocked(userID, bSlot);
+        }
+        else if (op == LogOp::EndRemoteLoan) {
+            size_t uSlot = userSlot(r.getI32());
+            int bookID = r.getI32();
+            int64_t txn = r.atEnd() ? 0 : r.getI64();
+            if (uSlot != NoSlot)
+                endRemoteLoanLocked(uSlot, bookID, txn);
+        }
+        else {
+            throw LibraryException("Unknown operation in transaction log.", LibraryError::CorruptData);
+        }
+    }
+    
+    // Snapshot file layout (host byte order):
+    //   "NLIB" magic, u32 version, i32 nextBookID, i32 nextUserID,
+    //   u32 book count, u32 user count,
+    //   per book: i32 ID, u8 available, title, author, ISBN
+    //     (available is informational; loading derives it from the loans)
+    //   per user: i32 ID, u8 type code, name, u32 loan count, per loan:
+    //     i32 book ID, i64 checked out, i64 due
+    //   u32 count of books lent to other branches, per book: i32 book ID,
+    //     i32 user ID, u8 user type code, i64 checked out, i64 due,
+    //     i64 transfer ID
+    //   u32 hold count, per hold in queue order: i32 book ID, i32 user ID,
+    //     i64 pickup deadline (0 while waiting)
+    //     (holds are on titles: the book is the copy kept for a ready hold,
+    //     or any copy of the title)
+    //   u32 count of loans from other branches, per loan: i32 user ID,
+    //     i32 book ID, i64 checked out, i64 due, i64 transfer ID
+    //   u32 prepared transfer count, per transfer: i64 transfer ID,
+    //     i32 user ID, i32 book ID
+    //   per book, in the order above: u32 times lent
+    //   per user, in the order above: u32 loans taken
+    // Strings are a u32 length followed by the bytes. Version 1 files have
+    // no holds section, loans before version 3 are bare book IDs, the
+    // sections for loans between branches start with version 4, the loan
+    // counts with version 5, the transfer IDs of lent books with version 6
+    // and those of loans from other branches with version 7.
+    static const uint32_t SnapshotVersion = 7;
+    
+    // Caller holds catalogLock exclusively
+    void encodeSnapshotLocked(BinaryWriter &w) {
+        w.putU8('N'); w.putU8('L'); w.putU8('I'); w.putU8('B');
+        w.putU32(SnapshotVersion);
+        w.putI32(Book::getNextBookID());
+        w.putI32(User::getNextUserID());
+        w.putU32(static_cast<uint32_t>(books.size()));
+        w.putU32(static_cast<uint32_t>(users.size()));
+        for (size_t i = 0; i < books.size(); i++) {
+            Book* b = books[i];
+            w.putI32(b->getBookID());
+            w.putU8(bookAvailable.test(i) ? 1 : 0);
+            w.putString(b->getTitle());
+            w.putString(b->getAuthor());
+            w.putString(b->getISBN());
+        }
+        for (size_t i = 0; i < users.size(); i++) {
+            User* u = users[i];
+            const vector<int>& borrowed = u->getBorrowedBooks();
+            w.putI32(u->getUserID());
+            w.putU8(static_cast<uint8_t>(u->getUserTypeCode()));
+            w.putString(u->getName());
+            w.putU32(static_cast<uint32_t>(borrowed.size()));
+            for (size_t j = 0; j < borrowed.size(); j++) {
+                size_t slot = bookSlot(borrowed[j]);
+                w.putI32(borrowed[j]);
+                w.putI64(bookCheckedOut[slot]);
+                w.putI64(bookDue[slot]);
+            }
+        }
+        w.putU32(static_cast<uint32_t>(lentAway.size()));
+        for (unordered_map<int, LentCopy>::iterator it = lentAway.begin(); it != lentAway.end(); ++it) {
+            size_t slot = bookSlot(it->first);
+            w.putI32(it->first);
+            w.putI32(bookBorrower.load(slot));
+            w.putU8(static_cast<uint8_t>(it->second.category));
+            w.putI64(bookCheckedOut[slot]);
+            w.putI64(bookDue[slot]);
+            w.putI64(it->second.txn);
+        }
+        w.putU32(static_cast<uint32_t>(holds.size()));
+        holds.forEach([&w](int userID, TitleRecord* title, int readyCopy, int64_t readyUntil) {
+            w.putI32(readyCopy >= 0 ? readyCopy : title->copies[0]);
+            w.putI32(userID);
+            w.putI64(readyUntil);
+        });
+        uint32_t remoteCount = 0;
+        for (unordered_map<int, vector<RemoteLoan>>::iterator it = remoteLoans.begin(); it != remoteLoans.end(); ++it)
+            remoteCount += static_cast<uint32_t>(it->second.size());
+        w.putU32(remoteCount);
+        for (unordered_map<int, vector<RemoteLoan>>::iterator it = remoteLoans.begin(); it != remoteLoans.end(); ++it) {
+            for (size_t i = 0; i < it->second.size(); i++) {
+                const LoanRecord &loan = it->second[i].loan;
+                w.putI32(loan.userID);
+                w.putI32(loan.bookID);
+                w.putI64(loan.checkedOut);
+                w.putI64(loan.due);
+                w.putI64(it->second[i].txn);
+            }
+        }
+        w.putU32(static_cast<uint32_t>(prepared.size()));
+        for (unordered_map<int64_t, PendingTransfer>::iterator it = prepared.begin(); it != prepared.end(); ++it) {
+            w.putI64(it->second.txn);
+            w.putI32(it->second.userID);
+            w.putI32(it->second.bookID);
+        }
+        for (size_t i = 0; i < books.size(); i++)
+            w.putU32(bookRows[i].loans);
+        for (size_t i = 0; i < users.size(); i++)
+            w.putU32(userRows[i].loans);
+    }
+    
+    // Writes bytes to a file next to path, syncs it and renames it over
+    // path, so a crash never leaves a half-written file behind.
+    static void replaceFile(const string &path, const string &bytes) {
+        string tmp = path + ".tmp";
+        FILE* out = fopen(tmp.c_str(), "wb");
+        if (!out)
+            throw LibraryException("Cannot write " + tmp, LibraryError::FileError);
+        bool ok = fwrite(bytes.data(), 1, bytes.size(), out) == bytes.size() && syncStream(out);
+        fclose(out);
+        if (!ok)
+            throw LibraryException("Cannot write " + tmp, LibraryError::FileError);
+        remove(path.c_str());
+        if (rename(tmp.c_str(), path.c_str()) != 0)
+            throw LibraryException("Cannot replace " + path, LibraryError::FileError);
+    }
+    
+    // Destroys every book and user; caller holds catalogLock exclusively
+    void clearLocked() {
+        for (size_t i = 0; i < books.size(); i++) {
+            TitleRecord* t = books[i]->getTitleRecord();
+            t->copies.clear();
+            t->freeCopies.clear();
+            t->holds = 0;
+            t->loans = 0;
+            BookFactory::destroyBook(books[i]);
+        }
+        for (size_t i = 0; i < users.size(); i++)
+            UserFactory::destroyUser(users[i]);
+        for (size_t i = 0; i < bookRows.size(); i++)
+            retire(bookRows[i].record, nullptr);
+        for (size_t i = 0; i < userRows.size(); i++)
+            retire(nullptr, userRows[i].name);
+        bookRows.clear();
+        userRows.clear();
+        mostLent.clear();
+        for (size_t s = 0; s < LockStripes; s++)
+            rankedTitles[s].clear();
+        books.clear();
+        users.clear();
+        bookAvailable.clear();
+        bookBorrower.clear();
+        bookLoanPos.clear();
+        bookReservedFor.clear();
+        bookFreePos.clear();
+        bookCopyPos.clear();
+        bookCheckedOut.clear();
+        bookDue.clear();
+        bookLoanSeq.clear();
+        for (size_t i = 0; i < LoanShards; i++) {
+            loanShards[i].dueDates.clear();
+            loanShards[i].overdue.clear();
+        }
+        holds.clear();
+        lentAway.clear();
+        remoteLoans.clear();
+        prepared.clear();
+        userQuota.clear();
+        bookIndex.clear();
+        userIndex.clear();
+        titleIndex.clear();
+        authorIndex.clear();
+        isbnIndex.clear();
+        textIndex.clear();
+        titlesByISBN.clear();
+    }
+    
+    mutex& userStripe(int userID) { return userStripes[static_cast<unsigned>(userID) % LockStripes].lock; }
+    mutex& titleStripe(const TitleRecord* title) {
+        return titleStripes[static_cast<unsigned>(title->getTitleID()) % LockStripes].lock;
+    }
+    mutex& titleStripe(Book* book) { return titleStripe(book->getTitleRecord()); }
+    
+    // One copy of a title in the catalog for search results, an available
+    // one if there is any; caller holds catalogLock
+    Book* pickCopyLocked(TitleRecord* title) {
+        lock_guard<mutex> titleGuard(titleStripe(title));
+        return lookupBook(title->freeCopies.empty() ? title->copies[0] : title->freeCopies[0]);
+    }
+    
+    vector<Book*> pickCopiesLocked(const vector<TitleRecord*> &titles) {
+        vector<Book*> out;
+        out.reserve(titles.size());
+        for (size_t i = 0; i < titles.size(); i++)
+            out.push_back(pickCopyLocked(titles[i]));
+        return out;
+    }
+
+    Library(const Library&) = delete;
+    Library& operator=(const Library&) = delete;
+public:
+    static Library& getInstance() {
+        static Library instance;
+        return instance;
+    }
+    
+    // Book management
+    // Pre-sizes storage ahead of a bulk load
+    void reserve(size_t bookCount, size_t userCount) {
+        unique_lock<shared_mutex> guard(catalogLock);
+        books.reserve(books.size() + bookCount);
+        bookAvailable.reserve(books.size() + bookCount);
+        bookBorrower.reserve(books.size() + bookCount);
+        bookLoanPos.reserve(books.size() + bookCount);
+        bookReservedFor.reserve(books.size() + bookCount);
+        bookFreePos.reserve(books.size() + bookCount);
+        bookCopyPos.reserve(books.size() + bookCount);
+        bookCheckedOut.reserve(books.size() + bookCount);
+        bookDue.reserve(books.size() + bookCount);
+        bookLoanSeq.reserve(books.size() + bookCount);
+        bookIndex.reserve(books.size() + bookCount);
+        BookFactory::pool().reserve(bookCount);
+        users.reserve(users.size() + userCount);
+        userQuota.reserve(users.size() + userCount);
+        userIndex.reserve(users.size() + userCount);
+        UserFactory::pool().reserve(userCount);
+    }
+    
+    // Throws, leaving the book to the caller, if its ISBN belongs to
+    // another title
+    void addBook(Book* book) {
+        LIBRARY_TIMED(LibraryOp::AddBook);
+        TraceCall traced(*this, LibraryOp::AddBook);
+        traced.arg(book);
+        uint64_t lsn;
+        {
+            unique_lock<shared_mutex> guard(catalogLock);
+            checkISBNLocked(book->getTitle(), book->getAuthor(), book->getISBN());
+            addBookLocked(book);
+            lsn = logBook(LogOp::AddBook, book);
+        }
+        waitForLog(lsn);
+    }
+    
+    Book* getBook(int bookID) {
+        LIBRARY_TIMED(LibraryOp::GetBook);
+        TraceCall traced(*this, LibraryOp::GetBook);
+        traced.arg(bookID);
+        shared_lock<shared_mutex> guard(catalogLock);
+        return traced.done(lookupBook(bookID));
+    }
+    
+    // Throws, changing nothing, if the ISBN is invalid or belongs to
+    // another title
+    void editBook(int bookID, string newTitle, string newAuthor, string newISBN) {
+        LIBRARY_TIMED(LibraryOp::EditBook);
+        TraceCall traced(*this, LibraryOp::EditBook);
+        traced.arg(bookID).arg(newTitle).arg(newAuthor).arg(newISBN);
+        newISBN = ISBN::normalize(newISBN);
+        uint64_t lsn;
+        {
+            unique_lock<shared_mutex> guard(catalogLock);
+            size_t slot = bookSlot(bookID);
+            if (slot == NoSlot)
+                throw LibraryException("Book not found.", LibraryError::NoSuchBook);
+            checkISBNLocked(newTitle, newAuthor, newISBN, bookID);
+            editBookLocked(slot, newTitle, newAuthor, newISBN);
+            lsn = logBook(LogOp::EditBook, books[slot]);
+        }
+        waitForLog(lsn);
+    }
+    
+    // O(1), but the last book takes the removed one's place in listings.
+    // Returns NoSuchBook instead of throwing when there is no such book.
+    TxnStatus tryRemoveBook(int bookID) {
+        LIBRARY_TIMED(LibraryOp::RemoveBook);
+        TraceCall traced(*this, LibraryOp::RemoveBook);
+        traced.arg(bookID);
+        uint64_t lsn;
+        {
+            unique_lock<shared_mutex> guard(catalogLock);
+            if (!removeBookLocked(bookID))
+                return traced.done(TxnStatus::NoSuchBook);
+            lsn = logRemove(LogOp::RemoveBook, bookID);
+        }
+        waitForLog(lsn);
+        return traced.done(TxnStatus::OK);
+    }
+    
+    void removeBook(int bookID) {
+        if (tryRemoveBook(bookID) != TxnStatus::OK)
+            throw LibraryException("Book not found.", LibraryError::NoSuchBook, true);
+    }
+    
+    // Adds many books under one lock and waits for the log once. Each
+    // title's ISBN is checked once, the registry is locked once, and new
+    // titles are indexed together.
+    // Adds all of newBooks or, if an ISBN belongs to another title (in the
+    // library or earlier in newBooks), none of them; the books are then
+    // left to the caller
+    void addBooks(const vector<Book*> &newBooks) {
+        LIBRARY_TIMED(LibraryOp::AddBooks);
+        TraceCall traced(*this, LibraryOp::AddBooks);
+        for (size_t i = 0; i < newBooks.size() && traced.active(); i++)
+            traced.arg(newBooks[i]);
+        uint64_t lsn = 0;
+        {
+            unique_lock<shared_mutex> guard(catalogLock);
+            unordered_map<uint64_t, TitleRecord*> batch;
+            batch.reserve(newBooks.size());
+            for (size_t i = 0; i < newBooks.size(); i++) {
+                Book* b = newBooks[i];
+                ISBN key = b->getTitleRecord()->getISBNKey();
+                if (key.empty())
+                    continue;
+                pair<unordered_map<uint64_t, TitleRecord*>::iterator, bool> first = batch.emplace(key.value(), b->getTitleRecord());
+                if (first.second)
+                    checkISBNLocked(b->getTitle(), b->getAuthor(), b->getISBN());
+                else if (first.first->second != b->getTitleRecord())
+                    throw LibraryException("ISBN " + b->getISBN() + " is given for both " + first.first->second->getTitle() + " and " + b->getTitle() + ".", LibraryError::ISBNTaken);
+            }
+            vector<TitleRecord*> held(newBooks.size());
+            for (size_t i = 0; i < newBooks.size(); i++)
+                held[i] = newBooks[i]->getTitleRecord();
+            TitleRegistry::shared().retain(held);
+            books.reserve(books.size() + newBooks.size());
+            bookIndex.reserve(books.size() + newBooks.size());
+            titlesByISBN.reserve(titlesByISBN.size() + batch.size());
+            vector<TitleRecord*> newTitles;
+            for (size_t i = 0; i < newBooks.size(); i++) {
+                placeBookLocked(newBooks[i], &newTitles);
+                if (txnLog)
+                    lsn = logBook(LogOp::AddBook, newBooks[i]);
+            }
+            indexTitles(newTitles);
+        }
+        waitForLog(lsn);
+    }
+    
+    // Find a book by title, preferring a copy that is available
+    Book* findBookByTitle(const string &title) {
+        LIBRARY_TIMED(LibraryOp::FindBookByTitle);
+        TraceCall traced(*this, LibraryOp::FindBookByTitle);
+        traced.arg(title);
+        shared_lock<shared_mutex> guard(catalogLock);
+        vector<TitleRecord*> matches = titleIndex.find(title, MatchMode::Exact);
+        if (matches.empty())
+            return traced.done(nullptr);
+        for (size_t i = 0; i < matches.size(); i++) {
+            Book* copy = pickCopyLocked(matches[i]);
+            if (bookAvailable.test(bookSlot(copy->getBookID())))
+                return traced.done(copy);
+        }
+        return traced.done(pickCopyLocked(matches[0]));
+    }
+    
+    // Find every title whose title, author or ISBN matches text; each comes
+    // back as one of its copies, an available one if there is any
+    vector<Book*> findBooks(BookField field, const string &text, MatchMode mode) {
+        LIBRARY_TIMED(LibraryOp::FindBooks);
+        TraceCall traced(*this, LibraryOp::FindBooks);
+        traced.arg(static_cast<int64_t>(field)).arg(static_cast<int64_t>(mode)).arg(text);
+        shared_lock<shared_mutex> guard(catalogLock);
+        if (field == BookField::Title)
+            return traced.done(pickCopiesLocked(titleIndex.find(text, mode)));
+        if (field == BookField::Author)
+            return traced.done(pickCopiesLocked(authorIndex.find(text, mode)));
+        // An exact ISBN, however it is written, is one probe for its title
+        ISBN key;
+        if (mode == MatchMode::Exact && ISBN::parse(text, key)) {
+            vector<TitleRecord*> titles;
+            unordered_map<uint64_t, TitleRecord*>::iterator it = titlesByISBN.find(key.value());
+            if (it != titlesByISBN.end())
+                titles.push_back(it->second);
+            return traced.done(pickCopiesLocked(titles));
+        }
+        return traced.done(pickCopiesLocked(isbnIndex.find(text, mode)));
+    }
+    
+    // IDs of every copy of bookID's title; empty if there is no such book
+    vector<int> copiesOf(int bookID) {
+        shared_lock<shared_mutex> guard(catalogLock);
+        Book* book = lookupBook(bookID);
+        return book ? book->getTitleRecord()->copies : vector<int>();
+    }
+    
+    // True if isbn belongs to a title other than the one with this title
+    // and author, so adding such a book would fail
+    bool isbnTaken(const string &title, const string &author, const string &isbn) {
+        shared_lock<shared_mutex> guard(catalogLock);
+        return isbnOwnerLocked(title, author, isbn) != nullptr;
+    }
+    
+    // isbnTaken() for many titles under one lock; taken[i] is titles[i]'s
+    vector<bool> isbnsTaken(const vector<TitleRecord*> &titles) {
+        vector<bool> taken(titles.size());
+        shared_lock<shared_mutex> guard(catalogLock);
+        for (size_t i = 0; i < titles.size(); i++)
+            taken[i] = isbnOwnerLocked(titles[i]->getTitle(), titles[i]->getAuthor(), titles[i]->getISBN()) != nullptr;
+        return taken;
+    }
+    
+    // Keyword search over titles and authors; every word must match. Each
+    // matching title comes back once, as one of its copies.
+    vector<Book*> searchBooks(const string &query) {
+        LIBRARY_TIMED(LibraryOp::SearchBooks);
+        TraceCall traced(*this, LibraryOp::SearchBooks);
+        traced.arg(query);
+        shared_lock<shared_mutex> guard(catalogLock);
+        return traced.done(pickCopiesLocked(textIndex.search(query)));
+    }
+    
+    // User management
+    void registerUser(User* user) {
+        LIBRARY_TIMED(LibraryOp::RegisterUser);
+        TraceCall traced(*this, LibraryOp::RegisterUser);
+        traced.arg(user);
+        uint64_t lsn;
+        {
+            unique_lock<shared_mutex> guard(catalogLock);
+            registerUserLocked(user);
+            lsn = logUser(LogOp::RegisterUser, user);
+        }
+        waitForLog(lsn);
+    }
+    
+    // Registers many users under one lock and waits for the log once
+    void registerUsers(const vector<User*> &newUsers) {
+        LIBRARY_TIMED(LibraryOp::RegisterUsers);
+        TraceCall traced(*this, LibraryOp::RegisterUsers);
+        for (size_t i = 0; i < newUsers.size() && traced.active(); i++)
+            traced.arg(newUsers[i]);
+        uint64_t lsn = 0;
+        {
+            unique_lock<shared_mutex> guard(catalogLock);
+            users.reserve(users.size() + newUsers.size());
+            userIndex.reserve(users.size() + newUsers.size());
+            for (size_t i = 0; i < newUsers.size(); i++) {
+                registerUserLocked(newUsers[i]);
+                if (txnLog)
+                    lsn = logUser(LogOp::RegisterUser, newUsers[i]);
+            }
+        }
+        waitForLog(lsn);
+    }
+    
+    User* getUser(int userID) {
+        LIBRARY_TIMED(LibraryOp::GetUser);
+        TraceCall traced(*this, LibraryOp::GetUser);
+        traced.arg(userID);
+        shared_lock<shared_mutex> guard(catalogLock);
+        return traced.done(lookupUser(userID));
+    }
+    
+    void editUser(int userID, string newName) {
+        LIBRARY_TIMED(LibraryOp::EditUser);
+        TraceCall traced(*this, LibraryOp::EditUser);
+        traced.arg(userID).arg(newName);
+        uint64_t lsn;
+        {
+            unique_lock<shared_mutex> guard(catalogLock);
+            size_t slot = userSlot(userID);
+            if (slot == NoSlot)
+                throw LibraryException("User not found.", LibraryError::NoSuchUser);
+            editUserLocked(slot, newName);
+            lsn = logUser(LogOp::EditUser, users[slot]);
+        }
+        waitForLog(lsn);
+    }
+    
+    // Same swap-with-last removal as tryRemoveBook; books the user still
+    // has out are returned
+    TxnStatus tryRemoveUser(int userID) {
+        LIBRARY_TIMED(LibraryOp::RemoveUser);
+        TraceCall traced(*this, LibraryOp::RemoveUser);
+        traced.arg(userID);
+        uint64_t lsn;
+        {
+            unique_lock<shared_mutex> guard(catalogLock);
+            if (!removeUserLocked(userID))
+                return traced.done(TxnStatus::NoSuchUser);
+            lsn = logRemove(LogOp::RemoveUser, userID);
+        }
+        waitForLog(lsn);
+        return traced.done(TxnStatus::OK);
+    }
+    
+    void removeUser(int userID) {
+        if (tryRemoveUser(userID) != TxnStatus::OK)
+            throw LibraryException("User not found.", LibraryError::NoSuchUser, true);
+    }
+    
+    // Borrow a book (by user and book IDs). Ordinary failures such as an
+    // unavailable book or a user at their limit come back as a status, so
+    // this is the call to use where those outcomes are common.
+    TxnStatus tryBorrowBook(int userID, int bookID) {
+        LIBRARY_TIMED(LibraryOp::BorrowBook);
+        TraceCall traced(*this, LibraryOp::BorrowBook);
+        traced.arg(userID).arg(bookID);
+        uint64_t lsn;
+        {
+            shared_lock<shared_mutex> guard(catalogLock);
+            size_t uSlot = userSlot(userID);
+            if (uSlot == NoSlot)
+                return traced.done(TxnStatus::NoSuchUser);
+            size_t bSlot = bookSlot(bookID);
+            if (bSlot == NoSlot)
+                return traced.done(TxnStatus::NoSuchBook);
+            int64_t now = clock();
+            int64_t due = loanDue(uSlot, now);
+            lock_guard<mutex> userGuard(userStripe(userID));
+            lock_guard<mutex> titleGuard(titleStripe(books[bSlot]));
+            TxnStatus status = borrowLocked(uSlot, bSlot, now, due);
+            if (status != TxnStatus::OK)
+                return traced.done(status);
+            lsn = logBorrow(userID, bookID, now, due);
+        }
+        waitForLog(lsn);
+        return traced.done(TxnStatus::OK);
+    }
+    
+    void borrowBook(int userID, int bookID) {
+        TxnStatus status = tryBorrowBook(userID, bookID);
+        if (status != TxnStatus::OK)
+            throw LibraryException(txnStatusMessage(status), txnStatusError(status), true);
+    }
+    
+    // Return a book (by user and book IDs), reporting failures as a status
+    TxnStatus tryReturnBook(int userID, int bookID) {
+        LIBRARY_TIMED(LibraryOp::ReturnBook);
+        TraceCall traced(*this, LibraryOp::ReturnBook);
+        traced.arg(userID).arg(bookID);
+        uint64_t lsn;
+        {
+            shared_lock<shared_mutex> guard(catalogLock);
+            size_t uSlot = userSlot(userID);
+            if (uSlot == NoSlot)
+                return traced.done(TxnStatus::NoSuchUser);
+            size_t bSlot = bookSlot(bookID);
+            if (bSlot == NoSlot)
+                return traced.done(TxnStatus::NoSuchBook);
+            
+            lock_guard<mutex> userGuard(userStripe(userID));
+            lock_guard<mutex> titleGuard(titleStripe(books[bSlot]));
+            TxnStatus status = returnLocked(uSlot, bSlot);
+            if (status != TxnStatus::OK)
+                return traced.done(status);
+            lsn = logLoan(LogOp::Return, userID, bookID);
+        }
+        waitForLog(lsn);
+        return traced.done(TxnStatus::OK);
+    }
+    
+    void returnBook(int userID, int bookID) {
+        TxnStatus status = tryReturnBook(userID, bookID);
+        if (status != TxnStatus::OK)
+            throw LibraryException(txnStatusMessage(status), txnStatusError(status), true);
+    }
+    
+    // Borrow whichever copy of bookID's title is free: the copy kept for the
+    // user's ready hold if there is one, otherwise the last free copy, so
+    // no copies are scanned. The copy lent is written to copyID.
+    TxnStatus tryBorrowAnyCopy(int userID, int bookID, int* copyID = nullptr) {
+        LIBRARY_TIMED(LibraryOp::BorrowAnyCopy);
+        TraceCall traced(*this, LibraryOp::BorrowAnyCopy);
+        traced.arg(userID).arg(bookID);
+        uint64_t lsn;
+        int copy = -1;
+        {
+            shared_lock<shared_mutex> guard(catalogLock);
+            size_t uSlot = userSlot(userID);
+            if (uSlot == NoSlot)
+                return traced.done(TxnStatus::NoSuchUser);
+            size_t bSlot = bookSlot(bookID);
+            if (bSlot == NoSlot)
+                return traced.done(TxnStatus::NoSuchBook);
+            TitleRecord* t = books[bSlot]->getTitleRecord();
+            lock_guard<mutex> userGuard(userStripe(userID));
+            lock_guard<mutex> titleGuard(titleStripe(books[bSlot]));
+            if (t->holds > 0) {
+                lock_guard<mutex> holdGuard(holdLock);
+                copy = holds.readyCopy(userID, t);
+            }
+            if (copy < 0) {
+                if (t->freeCopies.empty())
+                    return traced.done(TxnStatus::BookUnavailable);
+                copy = t->freeCopies.back();
+            }
+            int64_t now = clock();
+            int64_t due = loanDue(uSlot, now);
+            TxnStatus status = borrowLocked(uSlot, bookSlot(copy), now, due);
+            if (status != TxnStatus::OK)
+                return traced.done(status);
+            lsn = logBorrow(userID, copy, now, due);
+        }
+        waitForLog(lsn);
+        if (copyID)
+            *copyID = copy;
+        return traced.done(TxnStatus::OK);
+    }
+    
+    // Return the user's copy of bookID's title, whichever copy that is;
+    // bookID itself is preferred if the user has it. The copy returned is
+    // written to copyID.
+    TxnStatus tryReturnAnyCopy(int userID, int bookID, int* copyID = nullptr) {
+        LIBRARY_TIMED(LibraryOp::ReturnAnyCopy);
+        TraceCall traced(*this, LibraryOp::ReturnAnyCopy);
+        traced.arg(userID).arg(bookID);
+        uint64_t lsn;
+        int copy = -1;
+        {
+            shared_lock<shared_mutex> guard(catalogLock);
+            size_t uSlot = userSlot(userID);
+            if (uSlot == NoSlot)
+                return traced.done(TxnStatus::NoSuchUser);
+            size_t bSlot = bookSlot(bookID);
+            if (bSlot == NoSlot)
+                return traced.done(TxnStatus::NoSuchBook);
+            TitleRecord* t = books[bSlot]->getTitleRecord();
+            lock_guard<mutex> userGuard(userStripe(userID));
+            lock_guard<mutex> titleGuard(titleStripe(books[bSlot]));
+            const vector<int>& loans = users[uSlot]->getBorrowedBooks();
+            for (size_t i = 0; i < loans.size() && copy != bookID; i++)
+                if (lookupBook(loans[i])->getTitleRecord() == t)
+                    copy = loans[i];
+            if (copy < 0)
+                return traced.done(TxnStatus::NotBorrowed);
+            returnLocked(uSlot, bookSlot(copy));
+            lsn = logLoan(LogOp::Return, userID, copy);
+        }
+        waitForLog(lsn);
+        if (copyID)
+            *copyID = copy;
+        return traced.done(TxnStatus::OK);
+    }
+    
+    // Number of copies of bookID's title in the library, and how many of
+    // them are available; 0 if there is no such book
+    size_t countCopies(int bookID) {
+        shared_lock<shared_mutex> guard(catalogLock);
+        Book* book = lookupBook(bookID);
+        return book ? book->getTitleRecord()->copies.size() : 0;
+    }
+    
+    size_t countAvailableCopies(int bookID) {
+        shared_lock<shared_mutex> guard(catalogLock);
+        Book* book = lookupBook(bookID);
+        if (!book)
+            return 0;
+        lock_guard<mutex> titleGuard(titleStripe(book));
+        return book->getTitleRecord()->freeCopies.size();
+    }
+    
+    // Loans between branches of a sharded library. The router (see
+    // LibraryRouter.cpp) runs a borrow by a user of another branch as a
+    // two-phase transfer under an ID it picks:
+    //   1. prepareTransfer on the user's branch reserves a place in the
+    //      user's limit and reports their category;
+    //   2. lendRemote on the book's branch lends the copy;
+    //   3. commitTransfer on the user's branch records the loan with the
+    //      times lendRemote chose, or abortTransfer frees the place if the
+    //      lend failed.
+    // Prepared transfers survive restarts, and pendingTransfers lists them
+    // so the router can settle them by asking the book's branch (getLoan).
+    // A return is returnRemote on the book's branch, then endRemoteLoan on
+    // the user's with the transfer returnRemote reports. A loan whose
+    // transfer the book's branch no longer shows (listRemoteLoans against
+    // getLoan) was returned there, and the router ends it here.
+    TxnStatus prepareTransfer(int64_t txn, int userID, int bookID, UserCategory* category = nullptr) {
+        LIBRARY_TIMED(LibraryOp::PrepareTransfer);
+        TraceCall traced(*this, LibraryOp::PrepareTransfer);
+        traced.arg(txn).arg(userID).arg(bookID);
+        uint64_t lsn;
+        {
+            shared_lock<shared_mutex> guard(catalogLock);
+            size_t uSlot = userSlot(userID);
+            if (uSlot == NoSlot)
+                return traced.done(TxnStatus::NoSuchUser);
+            lock_guard<mutex> userGuard(userStripe(userID));
+            TxnStatus status = prepareTransferLocked(txn, uSlot, bookID);
+            if (status != TxnStatus::OK)
+                return traced.done(status);
+            lsn = logTransfer(LogOp::PrepareTransfer, txn, userID, bookID, 0, 0);
+            if (category)
+                *category = users[uSlot]->getCategory();
+        }
+        waitForLog(lsn);
+        return traced.done(TxnStatus::OK);
+    }
+    
+    TxnStatus commitTransfer(int64_t txn, int64_t checkedOut, int64_t due) {
+        LIBRARY_TIMED(LibraryOp::CommitTransfer);
+        TraceCall traced(*this, LibraryOp::CommitTransfer);
+        traced.arg(txn).arg(checkedOut).arg(due);
+        uint64_t lsn;
+        {
+            shared_lock<shared_mutex> guard(catalogLock);
+            int userID = transferUser(txn);
+            if (userID < 0)
+                return traced.done(TxnStatus::NoSuchTransfer);
+            lock_guard<mutex> userGuard(userStripe(userID));
+            TxnStatus status = commitTransferLocked(txn, checkedOut, due);
+            if (status != TxnStatus::OK)
+                return traced.done(status);
+            lsn = logTransfer(LogOp::CommitTransfer, txn, userID, -1, checkedOut, due);
+        }
+        waitForLog(lsn);
+        return traced.done(TxnStatus::OK);
+    }
+    
+    TxnStatus abortTransfer(int64_t txn) {
+        LIBRARY_TIMED(LibraryOp::AbortTransfer);
+        TraceCall traced(*this, LibraryOp::AbortTransfer);
+        traced.arg(txn);
+        uint64_t lsn;
+        {
+            shared_lock<shared_mutex> guard(catalogLock);
+            int userID = transferUser(txn);
+            if (userID < 0)
+                return traced.done(TxnStatus::NoSuchTransfer);
+            lock_guard<mutex> userGuard(userStripe(userID));
+            TxnStatus status = abortTransferLocked(txn);
+            if (status != TxnStatus::OK)
+                return traced.done(status);
+            lsn = logTransfer(LogOp::AbortTransfer, txn, userID, -1, 0, 0);
+        }
+        waitForLog(lsn);
+        return traced.done(TxnStatus::OK);
+    }
+    
+    vector<PendingTransfer> pendingTransfers() {
+        shared_lock<shared_mutex> guard(catalogLock);
+        lock_guard<mutex> remoteGuard(remoteLock);
+        vector<PendingTransfer> out;
+        for (unordered_map<int64_t, PendingTransfer>::iterator it = prepared.begin(); it != prepared.end(); ++it)
+            out.push_back(it->second);
+        return out;
+    }
+    
+    // Loans of other branches' books kept here, for userID or (-1) for
+    // every user
+    vector<RemoteLoan> listRemoteLoans(int userID = -1) {
+        shared_lock<shared_mutex> guard(catalogLock);
+        lock_guard<mutex> remoteGuard(remoteLock);
+        vector<RemoteLoan> out;
+        if (userID >= 0) {
+            unordered_map<int, vector<RemoteLoan>>::iterator it = remoteLoans.find(userID);
+            if (it != remoteLoans.end())
+                out = it->second;
+            return out;
+        }
+        for (unordered_map<int, vector<RemoteLoan>>::iterator it = remoteLoans.begin(); it != remoteLoans.end(); ++it)
+            out.insert(out.end(), it->second.begin(), it->second.end());
+        return out;
+    }
+    
+    // Lends bookID, which must be free, to userID of another branch under
+    // transfer txn, due back after the loan period for category. The loan
+    // is written to loan.
+    TxnStatus lendRemote(int64_t txn, int userID, UserCategory category, int bookID, LoanRecord* loan = nullptr) {
+        LIBRARY_TIMED(LibraryOp::LendRemote);
+        TraceCall traced(*this, LibraryOp::LendRemote);
+        traced.arg(txn).arg(userID).arg(static_cast<int64_t>(category)).arg(bookID);
+        uint64_t lsn;
+        int64_t now;
+        int64_t due;
+        {
+            shared_lock<shared_mutex> guard(catalogLock);
+            size_t bSlot = bookSlot(bookID);
+            if (bSlot == NoSlot)
+                return traced.done(TxnStatus::NoSuchBook);
+            now = clock();
+            due = loanDue(category, now);
+            lock_guard<mutex> titleGuard(titleStripe(books[bSlot]));
+            TxnStatus status = lendRemoteLocked(bSlot, txn, userID, category, now, due);
+            if (status != TxnStatus::OK)
+                return traced.done(status);
+            lsn = logLendRemote(txn, userID, category, bookID, now, due);
+        }
+        waitForLog(lsn);
+        if (loan) {
+            LoanRecord lent = { userID, bookID, now, due, 0 };
+            *loan = lent;
+        }
+        return traced.done(TxnStatus::OK);
+    }
+    
+    // Takes back bookID from userID of another branch. txn, if given, gets
+    // the transfer that lent it.
+    TxnStatus returnRemote(int userID, int bookID, int64_t* txn = nullptr) {
+        LIBRARY_TIMED(LibraryOp::ReturnRemote);
+        TraceCall traced(*this, LibraryOp::ReturnRemote);
+        traced.arg(userID).arg(bookID);
+        uint64_t lsn;
+        {
+            shared_lock<shared_mutex> guard(catalogLock);
+            size_t bSlot = bookSlot(bookID);
+            if (bSlot == NoSlot)
+                return traced.done(TxnStatus::NoSuchBook);
+            lock_guard<mutex> titleGuard(titleStripe(books[bSlot]));
+            TxnStatus status = returnRemoteLocked(userID, bSlot, txn);
+            if (status != TxnStatus::OK)
+                return traced.done(status);
+            lsn = logLoan(LogOp::ReturnRemote, userID, bookID);
+        }
+        waitForLog(lsn);
+        return traced.done(TxnStatus::OK);
+    }
+    
+    // Ends userID's loan of bookID from another branch made by transfer
+    // txn, or by any transfer if txn is 0
+    TxnStatus endRemoteLoan(int userID, int bookID, int64_t txn = 0) {
+        LIBRARY_TIMED(LibraryOp::EndRemoteLoan);
+        TraceCall traced(*this, LibraryOp::EndRemoteLoan);
+        traced.arg(userID).arg(bookID).arg(txn);
+        uint64_t lsn;
+        {
+            shared_lock<shared_mutex> guard(catalogLock);
+            size_t uSlot = userSlot(userID);
+            if (uSlot == NoSlot)
+                return traced.done(TxnStatus::NoSuchUser);
+            lock_guard<mutex> userGuard(userStripe(userID));
+            TxnStatus status = endRemoteLoanLocked(uSlot, bookID, txn);
+            if (status != TxnStatus::OK)
+                return traced.done(status);
+            lsn = logEndRemoteLoan(userID, bookID, txn);
+        }
+        waitForLog(lsn);
+        return traced.done(TxnStatus::OK);
+    }
+    
+    // Applies count borrow/return records in order and writes one status per
+    // record to statuses. The whole batch runs under a single exclusive lock,
+    // so other callers see it as one step, and failures don't throw.
+    void applyBatch(const TxnRecord* records, size_t count, TxnStatus* statuses) {
+        LIBRARY_TIMED(LibraryOp::ApplyBatch);
+        TraceCall traced(*this, LibraryOp::ApplyBatch);
+        for (size_t i = 0; i < count && traced.active(); i++)
+            traced.arg(records[i].userID).arg(records[i].bookID).arg(static_cast<int64_t>(records[i].op));
+        uint64_t lsn = 0;
+        {
+            unique_lock<shared_mutex> guard(catalogLock);
+            int64_t now = clock();
+            for (size_t i = 0; i < count; i++) {
+                const TxnRecord &r = records[i];
+                size_t uSlot = userSlot(r.userID);
+                size_t bSlot = uSlot != NoSlot ? bookSlot(r.bookID) : NoSlot;
+                if (uSlot == NoSlot)
+                    statuses[i] = TxnStatus::NoSuchUser;
+                else if (bSlot == NoSlot)
+                    statuses[i] = TxnStatus::NoSuchBook;
+                else if (r.op == TxnOp::Borrow)
+                    statuses[i] = borrowLocked(uSlot, bSlot, now, loanDue(uSlot, now));
+                else
+                    statuses[i] = returnLocked(uSlot, bSlot);
+                recordTxnStatus(statuses[i]);
+                if (statuses[i] == TxnStatus::OK && txnLog) {
+                    if (r.op == TxnOp::Borrow)
+                        lsn = logBorrow(r.userID, r.bookID, now, loanDue(uSlot, now));
+                    else
+                        lsn = logLoan(LogOp::Return, r.userID, r.bookID);
+                }
+            }
+        }
+        waitForLog(lsn);
+        traced.done(static_cast<size_t>(count_if(statuses, statuses + count, [](TxnStatus st) { return st == TxnStatus::OK; })));
+    }
+    
+    vector<TxnStatus> applyBatch(const vector<TxnRecord> &records) {
+        vector<TxnStatus> statuses(records.size());
+        if (!records.empty())
+            applyBatch(records.data(), records.size(), statuses.data());
+        return statuses;
+    }
+    
+    // Puts userID in line for bookID's title, every copy of which must be
+    // out or kept for someone else. When a copy comes back it is kept for
+    // the first hold in line for the pickup window, and only that user can
+    // borrow it.
+    TxnStatus placeHold(int userID, int bookID) {
+        LIBRARY_TIMED(LibraryOp::PlaceHold);
+        TraceCall traced(*this, LibraryOp::PlaceHold);
+        traced.arg(userID).arg(bookID);
+        uint64_t lsn;
+        {
+            shared_lock<shared_mutex> guard(catalogLock);
+            size_t uSlot = userSlot(userID);
+            if (uSlot == NoSlot)
+                return traced.done(TxnStatus::NoSuchUser);
+            size_t bSlot = bookSlot(bookID);
+            if (bSlot == NoSlot)
+                return traced.done(TxnStatus::NoSuchBook);
+            lock_guard<mutex> userGuard(userStripe(userID));
+            lock_guard<mutex> titleGuard(titleStripe(books[bSlot]));
+            TxnStatus status = placeHoldLocked(uSlot, bSlot);
+            if (status != TxnStatus::OK)
+                return traced.done(status);
+            lsn = logLoan(LogOp::PlaceHold, userID, bookID);
+        }
+        waitForLog(lsn);
+        return traced.done(TxnStatus::OK);
+    }
+    
+    // Withdraws a hold; if it was ready its copy passes to the next in line
+    TxnStatus cancelHold(int userID, int bookID) {
+        LIBRARY_TIMED(LibraryOp::CancelHold);
+        TraceCall traced(*this, LibraryOp::CancelHold);
+        traced.arg(userID).arg(bookID);
+        uint64_t lsn;
+        {
+            shared_lock<shared_mutex> guard(catalogLock);
+            size_t uSlot = userSlot(userID);
+            if (uSlot == NoSlot)
+                return traced.done(TxnStatus::NoSuchUser);
+            size_t bSlot = bookSlot(bookID);
+            if (bSlot == NoSlot)
+                return traced.done(TxnStatus::NoSuchBook);
+            lock_guard<mutex> userGuard(userStripe(userID));
+            lock_guard<mutex> titleGuard(titleStripe(books[bSlot]));
+            TxnStatus status = cancelHoldLocked(uSlot, bSlot);
+            if (status != TxnStatus::OK)
+                return traced.done(status);
+            lsn = logLoan(LogOp::CancelHold, userID, bookID);
+        }
+        waitForLog(lsn);
+        return traced.done(TxnStatus::OK);
+    }
+    
+    // Number of holds on bookID's title, including ready ones
+    size_t holdQueueLength(int bookID) {
+        shared_lock<shared_mutex> guard(catalogLock);
+        Book* book = lookupBook(bookID);
+        if (!book)
+            return 0;
+        lock_guard<mutex> holdGuard(holdLock);
+        return holds.queueLength(book->getTitleRecord());
+    }
+    
+    // Drops ready holds whose pickup window has passed, passing each copy to
+    // the next hold in line, and returns how many expired. Call it
+    // periodically; until it runs, an expired hold still keeps its book.
+    size_t expireHolds() {
+        LIBRARY_TIMED(LibraryOp::ExpireHolds);
+        TraceCall traced(*this, LibraryOp::ExpireHolds);
+        int64_t now = clock();
+        vector<int> due;
+        {
+            shared_lock<shared_mutex> guard(catalogLock);
+            lock_guard<mutex> holdGuard(holdLock);
+            holds.expired(now, due);
+        }
+        if (due.empty())
+            return traced.done(static_cast<size_t>(0));
+        size_t expired = 0;
+        uint64_t lsn = 0;
+        {
+            unique_lock<shared_mutex> guard(catalogLock);
+            for (size_t i = 0; i < due.size(); i++) {
+                size_t bSlot = bookSlot(due[i]);
+                if (bSlot != NoSlot && expireHoldLocked(bSlot, now)) {
+                    expired++;
+                    lsn = logRemove(LogOp::ExpireHold, due[i]);
+                }
+            }
+        }
+        waitForLog(lsn);
+        return traced.done(expired);
+    }
+    
+    void setHoldPickupWindow(int64_t seconds) {
+        unique_lock<shared_mutex> guard(catalogLock);
+        holdPickupWindow = seconds;
+    }
+    
+    // Replaces the clock used for hold deadlines (seconds since the epoch
+    // by default); meant for tests and benchmarks
+    void setClock(function<int64_t()> now) {
+        unique_lock<shared_mutex> guard(catalogLock);
+        clock = now;
+    }
+    
+    // Writes the whole library to path as a binary snapshot
+    void saveSnapshot(const string &path) {
+        LIBRARY_TIMED(LibraryOp::SaveSnapshot);
+        TraceCall traced(*this, LibraryOp::SaveSnapshot);
+        traced.arg(path);
+        BinaryWriter w;
+        {
+            unique_lock<shared_mutex> guard(catalogLock);
+            encodeSnapshotLocked(w);
+        }
+        replaceFile(path, w.bytes());
+    }
+    
+    // Replaces the library's contents with the snapshot at path, including
+    // the next-ID counters. Records are decoded straight out of the mapped
+    // file and containers are pre-sized from the header counts.
+    void loadSnapshot(const string &path) {
+        LIBRARY_TIMED(LibraryOp::LoadSnapshot);
+        TraceCall traced(*this, LibraryOp::LoadSnapshot);
+        traced.arg(path);
+        MappedFile file(path);
+        loadSnapshot(file.begin(), file.size(), path);
+    }
+    
+    // The same from size bytes in memory, such as the snapshot that starts
+    // a trace; name is the source given in errors
+    void loadSnapshot(const char* data, size_t size, const string &name) {
+        BinaryReader r(data, size);
+        if (r.getU8() != 'N' || r.getU8() != 'L' || r.getU8() != 'I' || r.getU8() != 'B')
+            throw LibraryException(name + " is not a library snapshot.", LibraryError::CorruptData);
+        uint32_t version = r.getU32();
+        if (version < 1 || version > SnapshotVersion)
+            throw LibraryException(name + " was saved by an unsupported version.", LibraryError::CorruptData);
+        int nextBook = r.getI32();
+        int nextUser = r.getI32();
+        uint32_t bookCount = r.getU32();
+        uint32_t userCount = r.getU32();
+        
+        unique_lock<shared_mutex> guard(catalogLock);
+        clearLocked();
+        try {
+            books.reserve(bookCount);
+            bookAvailable.reserve(bookCount);
+            bookBorrower.reserve(bookCount);
+            bookLoanPos.reserve(bookCount);
+            bookReservedFor.reserve(bookCount);
+            bookFreePos.reserve(bookCount);
+            bookCopyPos.reserve(bookCount);
+            bookCheckedOut.reserve(bookCount);
+            bookDue.reserve(bookCount);
+            bookLoanSeq.reserve(bookCount);
+            bookIndex.reserve(bookCount);
+            BookFactory::pool().reserve(bookCount);
+            for (uint32_t i = 0; i < bookCount; i++) {
+                int id = r.getI32();
+                r.getU8();
+                string title = r.getString();
+                string author = r.getString();
+                string isbn = r.getString();
+                addBookLocked(BookFactory::restoreBook(id, title, author, isbn));
+            }
+            users.reserve(userCount);
+            userQuota.reserve(userCount);
+            userIndex.reserve(userCount);
+            UserFactory::pool().reserve(userCount);
+            int64_t now = clock();
+            for (uint32_t i = 0; i < userCount; i++) {
+                int id = r.getI32();
+                int type = r.getU8();
+                string name = r.getString();
+                registerUserLocked(UserFactory::restoreUser(type, id, name));
+                // Loans of books that no longer exist (older versions kept
+                // them when a borrowed book was removed) are dropped. Loans
+                // saved without times start now.
+                size_t uSlot = users.size() - 1;
+                uint32_t loans = r.getU32();
+                for (uint32_t j = 0; j < loans; j++) {
+                    size_t slot = bookSlot(r.getI32());
+                    int64_t checkedOut = version >= 3 ? r.getI64() : now;
+                    int64_t due = version >= 3 ? r.getI64() : loanDue(uSlot, now);
+                    if (slot != NoSlot && bookAvailable.test(slot))
+                        borrowLocked(uSlot, slot, checkedOut, due);
+                }
+            }
+            uint32_t lentCount = version >= 4 ? r.getU32() : 0;
+            for (uint32_t i = 0; i < lentCount; i++) {
+                size_t bSlot = bookSlot(r.getI32());
+                int userID = r.getI32();
+                UserCategory category = static_cast<UserCategory>(r.getU8());
+                int64_t checkedOut = r.getI64();
+                int64_t due = r.getI64();
+                int64_t txn = version >= 6 ? r.getI64() : 0;
+                if (bSlot != NoSlot)
+                    lendRemoteLocked(bSlot, txn, userID, category, checkedOut, due);
+            }
+            uint32_t holdCount = version >= 2 ? r.getU32() : 0;
+            for (uint32_t i = 0; i < holdCount; i++) {
+                size_t bSlot = bookSlot(r.getI32());
+                size_t uSlot = userSlot(r.getI32());
+                int64_t readyUntil = r.getI64();
+                if (bSlot == NoSlot || uSlot == NoSlot)
+                    continue;
+                User* u = users[uSlot];
+                TitleRecord* t = books[bSlot]->getTitleRecord();
+                if (holds.contains(u->getUserID(), t))
+                    continue;
+                holds.enqueue(u->getUserID(), t, userCategoryPolicy(u->getCategory()).holdPriority);
+                t->holds++;
+                if (readyUntil != 0 && bookAvailable.test(bSlot)) {
+                    bookReservedFor[bSlot] = holds.promote(t, books[bSlot]->getBookID(), readyUntil);
+                    setAvailableLocked(bSlot, false);
+                }
+            }
+            // A copy that is neither out nor kept for anyone goes to the
+            // first hold on its title
+            for (size_t i = 0; i < books.size(); i++)
+                if (bookAvailable.test(i) && books[i]->getTitleRecord()->holds > 0)
+                    releaseBookLocked(i);
+            uint32_t remoteCount = version >= 4 ? r.getU32() : 0;
+            for (uint32_t i = 0; i < remoteCount; i++) {
+                RemoteLoan remote;
+                LoanRecord &loan = remote.loan;
+                loan.userID = r.getI32();
+                loan.bookID = r.getI32();
+                loan.checkedOut = r.getI64();
+                loan.due = r.getI64();
+                loan.fineCents = 0;
+                remote.txn = version >= 7 ? r.getI64() : 0;
+                size_t uSlot = userSlot(loan.userID);
+                if (uSlot == NoSlot)
+                    continue;
+                remoteLoans[loan.userID].push_back(remote);
+                userQuota[uSlot].count++;
+            }
+            uint32_t preparedCount = version >= 4 ? r.getU32() : 0;
+            for (uint32_t i = 0; i < preparedCount; i++) {
+                PendingTransfer transfer;
+                transfer.txn = r.getI64();
+                transfer.userID = r.getI32();
+                transfer.bookID = r.getI32();
+                size_t uSlot = userSlot(transfer.userID);
+                if (uSlot == NoSlot || prepared.count(transfer.txn))
+                    continue;
+                prepared[transfer.txn] = transfer;
+                userQuota[uSlot].count++;
+            }
+            // The counts replace those of the loans restored above
+            if (version >= 5) {
+                for (size_t i = 0; i < books.size(); i++) {
+                    uint32_t lent = r.getU32();
+                    TitleRecord* t = books[i]->getTitleRecord();
+                    t->loans += lent - bookRows[i].loans;
+                    bookRows.update(i, [lent](BookRow &row) { row.loans = lent; });
+                }
+                for (size_t i = 0; i < users.size(); i++) {
+                    uint32_t loans = r.getU32();
+                    userRows.update(i, [loans](UserRow &row) { row.loans = loans; });
+                }
+            }
+            rankTitlesLocked();
+            if (!r.atEnd())
+                throw LibraryException("Saved data is truncated or corrupt.", LibraryError::CorruptData);
+        }
+        catch (...) {
+            clearLocked();
+            throw;
+        }
+        Book::setNextBookID(nextBook);
+        User::setNextUserID(nextUser);
+    }
+    
+    // Removes every book and user and restarts ID numbering. Not logged.
+    void clear() {
+        unique_lock<shared_mutex> guard(catalogLock);
+        clearLocked();
+        Book::setNextBookID(0);
+        User::setNextUserID(0);
+    }
+    
+    // Sends every later mutation to log. The log must outlive the library
+    // or be detached with attachLog(nullptr) first.
+    void attachLog(TransactionLog* log) {
+        unique_lock<shared_mutex> guard(catalogLock);
+        txnLog = log;
+    }
+    
+    // Records every later call to recorder, which first gets a snapshot of
+    // the library as it is now so that a replay starts from the same state.
+    // Detach with attachTrace(nullptr) once the calls to record have
+    // finished, then destroy the recorder to write out the rest.
+    void attachTrace(TraceRecorder* recorder) {
+        unique_lock<shared_mutex> guard(catalogLock);
+        if (recorder) {
+            BinaryWriter w;
+            encodeSnapshotLocked(w);
+            recorder->begin(w.bytes(), clock());
+        }
+        trace.store(recorder, memory_order_release);
+    }
+    
+    // Rebuilds state after a restart or crash: replaces the library's
+    // contents with the snapshot at snapshotPath (or nothing if there is no
+    // snapshot), then re-applies every intact record in the log at logPath.
+    // Returns the number of records replayed.
+    size_t recover(const string &snapshotPath, const string &logPath) {
+        LIBRARY_TIMED(LibraryOp::Recover);
+        TraceCall traced(*this, LibraryOp::Recover);
+        traced.arg(snapshotPath).arg(logPath);
+        bool haveSnapshot = static_cast<bool>(ifstream(snapshotPath.c_str()));
+        if (haveSnapshot)
+            loadSnapshot(snapshotPath);
+        unique_lock<shared_mutex> guard(catalogLock);
+        if (!haveSnapshot) {
+            clearLocked();
+            Book::setNextBookID(0);
+            User::setNextUserID(0);
+        }
+        return traced.done(TransactionLog::replay(logPath, [this](BinaryReader &r) { applyLogRecord(r); }));
+    }
+    
+    // Compacts the log: writes a snapshot of the current state to
+    // snapshotPath and truncates the attached log, so recovery only has to
+    // replay what happens after this point.
+    void checkpoint(const string &snapshotPath) {
+        LIBRARY_TIMED(LibraryOp::Checkpoint);
+        TraceCall traced(*this, LibraryOp::Checkpoint);
+        traced.arg(snapshotPath);
+        unique_lock<shared_mutex> guard(catalogLock);
+        BinaryWriter w;
+        encodeSnapshotLocked(w);
+        replaceFile(snapshotPath, w.bytes());
+        if (txnLog)
+            txnLog->truncate();
+    }
+    
+    // Number of books not currently on loan; a popcount over the
+    // availability bitset
+    size_t countAvailableBooks() {
+        LIBRARY_TIMED(LibraryOp::CountAvailableBooks);
+        TraceCall traced(*this, LibraryOp::CountAvailableBooks);
+        shared_lock<shared_mutex> guard(catalogLock);
+        return traced.done(bookAvailable.count());
+    }
+    
+    // ID of the user who has bookID out, or -1 if the book is not on loan
+    // or does not exist
+    int getBorrower(int bookID) {
+        LIBRARY_TIMED(LibraryOp::GetBorrower);
+        TraceCall traced(*this, LibraryOp::GetBorrower);
+        traced.arg(bookID);
+        shared_lock<shared_mutex> guard(catalogLock);
+        size_t slot = bookSlot(bookID);
+        return traced.done(slot == NoSlot ? -1 : bookBorrower.load(slot));
+    }
+    
+    // The user's loans with their times and the fines run up so far, in no
+    // particular order; empty if there is no such user
+    vector<LoanRecord> getLoans(int userID) {
+        LIBRARY_TIMED(LibraryOp::GetLoans);
+        TraceCall traced(*this, LibraryOp::GetLoans);
+        traced.arg(userID);
+        shared_lock<shared_mutex> guard(catalogLock);
+        vector<LoanRecord> out;
+        size_t uSlot = userSlot(userID);
+        if (uSlot == NoSlot)
+            return traced.done(out);
+        int64_t now = clock();
+        UserCategory category = users[uSlot]->getCategory();
+        vector<int> borrowed;
+        {
+            lock_guard<mutex> userGuard(userStripe(userID));
+            borrowed = users[uSlot]->getBorrowedBooks();
+        }
+        for (size_t i = 0; i < borrowed.size(); i++) {
+            size_t slot = bookSlot(borrowed[i]);
+            lock_guard<mutex> shardGuard(loanShard(borrowed[i]).lock);
+            if (bookBorrower.load(slot) != userID)
+                continue;
+            LoanRecord loan = { userID, borrowed[i], bookCheckedOut[slot], bookDue[slot],
+                                fineAt(category, bookDue[slot], now) };
+            out.push_back(loan);
+        }
+        lock_guard<mutex> remoteGuard(remoteLock);
+        unordered_map<int, vector<RemoteLoan>>::iterator it = remoteLoans.find(userID);
+        if (it != remoteLoans.end()) {
+            for (size_t i = 0; i < it->second.size(); i++) {
+                LoanRecord loan = it->second[i].loan;
+                loan.fineCents = fineAt(category, loan.due, now);
+                out.push_back(loan);
+            }
+        }
+        return traced.done(out);
+    }
+    
+    // The loan of bookID, whoever has it; false if it is not on loan. txn,
+    // if given, gets the transfer that lent the book to another branch's
+    // user, or 0 for a loan to a user of this library.
+    bool getLoan(int bookID, LoanRecord &loan, int64_t* txn = nullptr) {
+        shared_lock<shared_mutex> guard(catalogLock);
+        size_t slot = bookSlot(bookID);
+        if (slot == NoSlot)
+            return false;
+        lock_guard<mutex> shardGuard(loanShard(bookID).lock);
+        int borrower = bookBorrower.load(slot);
+        UserCategory category;
+        if (borrower < 0 || !borrowerCategory(bookID, borrower, category))
+            return false;
+        LoanRecord found = { borrower, bookID, bookCheckedOut[slot], bookDue[slot],
+                             fineAt(category, bookDue[slot], clock()) };
+        loan = found;
+        if (txn) {
+            lock_guard<mutex> remoteGuard(remoteLock);
+            unordered_map<int, LentCopy>::iterator it = lentAway.find(bookID);
+            *txn = it == lentAway.end() ? 0 : it->second.txn;
+        }
+        return true;
+    }
+    
+    // Every loan past its due date with the fine it has run up, earliest
+    // due date first. Loans reach the scan through the loan shards' calendar
+    // queues, so its cost follows the number of overdue and newly due loans,
+    // not the size of the catalog. Shards are scanned on up to threads
+    // threads (0: one per core) while borrows and returns carry on.
+    vector<LoanRecord> overdueLoans(size_t threads = 0) {
+        LIBRARY_TIMED(LibraryOp::OverdueLoans);
+        TraceCall traced(*this, LibraryOp::OverdueLoans);
+        traced.arg(static_cast<int64_t>(threads));
+        shared_lock<shared_mutex> guard(catalogLock);
+        int64_t now = clock();
+        if (threads == 0)
+            threads = thread::hardware_concurrency();
+        if (threads == 0)
+            threads = 1;
+        if (threads > LoanShards)
+            threads = LoanShards;
+        vector<vector<LoanRecord>> found(LoanShards);
+        function<void(size_t)> scan = [this, now, threads, &found](size_t first) {
+            for (size_t i = first; i < LoanShards; i += threads) {
+                scanOverdueLocked(loanShards[i], now, found[i]);
+                sort(found[i].begin(), found[i].end(), dueFirst);
+            }
+        };
+        vector<thread> workers;
+        for (size_t t = 1; t < threads; t++)
+            workers.push_back(thread(scan, t));
+        scan(0);
+        for (size_t t = 0; t < workers.size(); t++)
+            workers[t].join();
+        
+        size_t total = 0;
+        for (size_t i = 0; i < LoanShards; i++)
+            total += found[i].size();
+        vector<LoanRecord> out;
+        out.reserve(total);
+        vector<size_t> runs(1, 0);
+        for (size_t i = 0; i < LoanShards; i++) {
+            out.insert(out.end(), found[i].begin(), found[i].end());
+            runs.push_back(out.size());
+        }
+        // Merge the sorted shard lists pairwise
+        while (runs.size() > 2) {
+            vector<size_t> merged(1, 0);
+            for (size_t i = 2; i < runs.size(); i += 2) {
+                inplace_merge(out.begin() + runs[i - 2], out.begin() + runs[i - 1], out.begin() + runs[i], dueFirst);
+                merged.push_back(runs[i]);
+            }
+            if (runs.size() % 2 == 0)
+                merged.push_back(runs.back());
+            runs.swap(merged);
+        }
+        return traced.done(out);
+    }
+    
+    // IDs of the books currently on loan, in listing order. Books being kept
+    // for a ready hold are not included.
+    vector<int> booksOnLoan() {
+        LIBRARY_TIMED(LibraryOp::BooksOnLoan);
+        TraceCall traced(*this, LibraryOp::BooksOnLoan);
+        shared_lock<shared_mutex> guard(catalogLock);
+        vector<int> out;
+        out.reserve(books.size() - bookAvailable.count());
+        bookAvailable.forEachClear([this, &out](size_t slot) {
+            if (bookBorrower.load(slot) >= 0)
+                out.push_back(books[slot]->getBookID());
+        });
+        return traced.done(out);
+    }
+    
+    // Freezes the catalog as it is now. The snapshot takes no locks to read
+    // and keeps what it shows alive however the catalog changes meanwhile;
+    // it must be released before the library is destroyed.
+    shared_ptr<const CatalogSnapshot> readSnapshot() {
+        LIBRARY_TIMED(LibraryOp::ReadSnapshot);
+        TraceCall traced(*this, LibraryOp::ReadSnapshot);
+        unique_ptr<CatalogSnapshot> snapshot(new CatalogSnapshot());
+        {
+            unique_lock<shared_mutex> guard(catalogLock);
+            snapshot->books = bookRows.freeze();
+            snapshot->users = userRows.freeze();
+            lock_guard<mutex> epochGuard(epochLock);
+            snapshot->epoch = epoch++;
+            liveSnapshots[snapshot->epoch]++;
+        }
+        return shared_ptr<const CatalogSnapshot>(snapshot.release(), [this](const CatalogSnapshot* s) {
+            uint64_t e = s->epoch;
+            delete s;
+            endSnapshot(e);
+        });
+    }
+    
+    // The k titles in the library lent most often (at most
+    // TopTitles::Capacity; CirculationAnalytics ranks any number), most
+    // lent first. Titles never lent are left out.
+    vector<TitleLoans> topTitles(size_t k = 10) {
+        LIBRARY_TIMED(LibraryOp::TopTitles);
+        TraceCall traced(*this, LibraryOp::TopTitles);
+        traced.arg(static_cast<int64_t>(k));
+        shared_lock<shared_mutex> guard(catalogLock);
+        vector<TitleRecord*> top = mostLent.top(k);
+        vector<TitleLoans> out;
+        for (size_t i = 0; i < top.size(); i++) {
+            TitleRecord* t = top[i];
+            lock_guard<mutex> titleGuard(titleStripes[static_cast<unsigned>(t->titleID) % LockStripes].lock);
+            TitleLoans entry = { t->titleID, t->getTitle(), t->getAuthor(), t->getISBN(), t->loans };
+            out.push_back(entry);
+        }
+        return traced.done(out);
+    }
+    
+    // Export a snapshot, so a long report never holds up transactions; the
+    // paging is as for CatalogSnapshot::exportBooks
+    size_t exportBooks(ReportSink &out, ReportFormat format, size_t offset = 0, size_t limit = SIZE_MAX) {
+        LIBRARY_TIMED(LibraryOp::ExportBooks);
+        TraceCall traced(*this, LibraryOp::ExportBooks);
+        traced.arg(static_cast<int64_t>(format)).arg(static_cast<int64_t>(offset)).arg(static_cast<int64_t>(limit));
+        return traced.done(readSnapshot()->exportBooks(out, format, offset, limit));
+    }
+    
+    size_t exportUsers(ReportSink &out, ReportFormat format, size_t offset = 0, size_t limit = SIZE_MAX) {
+        LIBRARY_TIMED(LibraryOp::ExportUsers);
+        TraceCall traced(*this, LibraryOp::ExportUsers);
+        traced.arg(static_cast<int64_t>(format)).arg(static_cast<int64_t>(offset)).arg(static_cast<int64_t>(limit));
+        return traced.done(readSnapshot()->exportUsers(out, format, offset, limit));
+    }
+    
+    // List all books with details 
+    void listAllBooks() {
+        ReportSink out(stdout);
+        out << "List All Books\n";
+        exportBooks(out, ReportFormat::Text);
+    }
+    
+    // List all users with their borrowed books.
+    void listAllUsers() {
+        ReportSink out(stdout);
+        out << "List All Users\n";
+        exportUsers(out, ReportFormat::Text);
+    }
+    
+    ~Library() {
+        clearLocked();
+    }
+};
+
+// Outcome of a bulk import: how many rows were added and which were rejected
+struct ImportReport {
+    size_t imported;
+    vector<pair<size_t, string>> errors;   // (line number, problem)
+    
+    ImportReport() : imported(0) {}
+};
+
+// Bulk import of books and users from CSV or TSV files.
+//
+// Book files have the columns title, author, ISBN; user files have type
+// (a type code or category name such as Student) and name. An optional header row is skipped.
+// Fields may be quoted with "..." and use "" for a literal quote, but may
+// not contain line breaks. The file is memory-mapped and split into
+// line-aligned chunks that are parsed on separate threads; fields are
+// views into the mapping, and only quoted fields with escapes are copied.
+// Bad rows are reported by line number and skipped.
+class CatalogImporter {
+private:
+    // Rows parsed from one chunk, stored flat: row r's fields are
+    // fields[r * width .. r * width + width)
+    struct ParsedChunk {
+        const char* begin;
+        const char* end;
+        vector<string_view> fields;
+        vector<size_t> lines;                   // line number of each row, within the chunk
+        vector<pair<size_t, string>> errors;    // (line within the chunk, problem)
+        deque<string> unescaped;                // backing store for fields with "" escapes
+        size_t lineCount;
+    };
+    
+    // Splits one line (without its line break) into fields
+    static bool splitLine(const char* p, const char* end, char delim, vector<string_view> &out,
+                          deque<string> &unescaped, string &error) {
+        while (true) {
+            if (p < end && *p == '"') {
+                const char* start = ++p;
+                bool escaped = false;
+                while (true) {
+                    if (p == end) {
+                        error = "Unterminated quoted field";
+                        return false;
+                    }
+                    if (*p == '"') {
+                        if (p + 1 < end && p[1] == '"') {
+                            escaped = true;
+                            p += 2;
+                            continue;
+                        }
+                        break;
+                    }
+                    p++;
+                }
+                string_view field(start, static_cast<size_t>(p - start));
+                p++;
+                if (escaped) {
+                    unescaped.push_back(string());
+                    string &u = unescaped.back();
+                    for (size_t i = 0; i < field.size(); i++) {
+                        u += field[i];
+                        if (field[i] == '"')
+                            i++;
+                    }
+                    field = u;
+                }
+                out.push_back(field);
+                if (p == end)
+                    return true;
+                if (*p != delim) {
+                    error = "Unexpected text after quoted field";
+                    return false;
+                }
+                p++;
+            } else {
+                const char* start = p;
+                while (p < end && *p != delim)
+                    p++;
+                out.push_back(string_view(start, static_cast<size_t>(p - start)));
+                if (p == end)
+                    return true;
+                p++;
+            }
+        }
+    }
+    
+    static void parseChunk(ParsedChunk &chunk, char delim, size_t width) {
+        vector<string_view> row;
+        string error;
+        size_t line = 0;
+        const char* p = chunk.begin;
+        // A rough guess at the row count keeps reallocations down
+        size_t guess = static_cast<size_t>(chunk.end - chunk.begin) / 48 + 1;
+        chunk.fields.reserve(guess * width);
+        chunk.lines.reserve(guess);
+        while (p < chunk.end) {
+            const char* eol = static_cast<const char*>(memchr(p, '\n', static_cast<size_t>(chunk.end - p)));
+            if (!eol)
+                eol = chunk.end;
+            const char* last = eol;
+            if (last > p && last[-1] == '\r')
+                last--;
+            line++;
+            if (last > p) {
+                row.clear();
+                if (!splitLine(p, last, delim, row, chunk.unescaped, error)) {
+                    chunk.errors.push_back(make_pair(line, error));
+                } else if (row.size() != width) {
+                    chunk.errors.push_back(make_pair(line, "Expected " + to_string(width) + " fields, found " + to_string(row.size())));
+                } else {
+                    chunk.fields.insert(chunk.fields.end(), row.begin(), row.end());
+                    chunk.lines.push_back(line);
+                }
+            }
+            p = eol + 1;
+        }
+        chunk.lineCount = line;
+    }
+    
+    // A book row's title, author and ISBN; the text is viewed in the file
+    struct RowTitle {
+        string_view title;
+        string_view author;
+        ISBN isbn;
+        bool operator==(const RowTitle &o) const {
+            return title == o.title && author == o.author && isbn.value() == o.isbn.value();
+        }
+    };
+    struct RowTitleHash {
+        size_t operator()(const RowTitle &t) const {
+            hash<string_view> h;
+            return h(t.title) ^ (h(t.author) * 31) ^ (t.isbn.value() * 1009);
+        }
+    };
+    
+    static bool equalsIgnoreCase(string_view a, const char* b) {
+        size_t n = strlen(b);
+        if (a.size() != n)
+            return false;
+        for (size_t i = 0; i < n; i++) {
+            if (tolower(static_cast<unsigned char>(a[i])) != tolower(static_cast<unsigned char>(b[i])))
+                return false;
+        }
+        return true;
+    }
+    
+    // Maps and parses path, then calls addRow(fields, line) for every
+    // well-formed row in file order. addRow returns an empty string to
+    // accept the row or a description of what is wrong with it. finish,
+    // if given, runs after the last row while the fields are still valid.
+    static ImportReport parseFile(const string &path, size_t width, const char* headerName,
+                                  const function<string(const string_view*, size_t)> &addRow,
+                                  const function<void(ImportReport&)> &finish = nullptr) {
+        char delim = (path.size() >= 4 && equalsIgnoreCase(string_view(path).substr(path.size() - 4), ".tsv")) ? '\t' : ',';
+        MappedFile file(path);
+        const char* begin = file.begin();
+        const char* end = begin + file.size();
+        
+        // Split into line-aligned chunks of at least 1 MB, one per thread
+        size_t threads = thread::hardware_concurrency();
+        if (threads == 0)
+            threads = 1;
+        const size_t MinChunk = 1 << 20;
+        if (file.size() / threads < MinChunk)
+            threads = file.size() / MinChunk + 1;
+        vector<ParsedChunk> chunks(threads);
+        const char* p = begin;
+        for (size_t i = 0; i < threads; i++) {
+            chunks[i].begin = p;
+            const char* cut = (i + 1 == threads) ? end : begin + file.size() / threads * (i + 1);
+            if (cut < p)
+                cut = p;
+            if (cut < end) {
+                const char* eol = static_cast<const char*>(memchr(cut, '\n', static_cast<size_t>(end - cut)));
+                cut = eol ? eol + 1 : end;
+            }
+            chunks[i].end = cut;
+            p = cut;
+        }
+        
+        vector<thread> workers;
+        for (size_t i = 1; i < chunks.size(); i++)
+            workers.push_back(thread(parseChunk, ref(chunks[i]), delim, width));
+        parseChunk(chunks[0], delim, width);
+        for (size_t i = 0; i < workers.size(); i++)
+            workers[i].join();
+        
+        ImportReport report;
+        size_t firstLine = 0;
+        for (size_t c = 0; c < chunks.size(); c++) {
+            ParsedChunk &chunk = chunks[c];
+            for (size_t e = 0; e < chunk.errors.size(); e++)
+                report.errors.push_back(make_pair(firstLine + chunk.errors[e].first, chunk.errors[e].second));
+            for (size_t r = 0; r < chunk.lines.size(); r++) {
+                const string_view* fields = &chunk.fields[r * width];
+                size_t line = firstLine + chunk.lines[r];
+                if (line == 1 && equalsIgnoreCase(fields[0], headerName))
+                    continue;
+                string problem = addRow(fields, line);
+                if (problem.empty())
+                    report.imported++;
+                else
+                    report.errors.push_back(make_pair(line, problem));
+            }
+            firstLine += chunk.lineCount;
+        }
+        if (finish)
+            finish(report);
+        sort(report.errors.begin(), report.errors.end());
+        return report;
+    }
+public:
+    // Rows are grouped by title as they are read, and each title is then
+    // acquired from the registry and checked against the library once,
+    // with one lock for all of them
+    static ImportReport importBooks(Library &library, const string &path) {
+        vector<RowTitle> titles;
+        vector<size_t> copies;                      // rows of each title
+        unordered_map<RowTitle, size_t, RowTitleHash> titleOf;
+        vector<pair<size_t, size_t>> rows;          // (title, line) of each row
+        vector<Book*> newBooks;
+        function<string(const string_view*, size_t)> addRow = [&](const string_view* f, size_t line) -> string {
+            if (f[0].empty())
+                return "Missing title";
+            RowTitle row = { f[0], f[1], ISBN() };
+            if (!ISBN::parse(f[2], row.isbn) && f[2].find_first_not_of(' ') != string_view::npos)
+                return "Invalid ISBN";
+            pair<unordered_map<RowTitle, size_t, RowTitleHash>::iterator, bool> found = titleOf.emplace(row, titles.size());
+            if (found.second) {
+                titles.push_back(row);
+                copies.push_back(0);
+            }
+            copies[found.first->second]++;
+            rows.push_back(make_pair(found.first->second, line));
+            return string();
+        };
+        function<void(ImportReport&)> finish = [&](ImportReport &report) {
+            vector<string> isbns(titles.size());
+            vector<TitleRegistry::Wanted> wanted(titles.size());
+            for (size_t t = 0; t < titles.size(); t++) {
+                isbns[t] = titles[t].isbn.str();
+                TitleRegistry::Wanted w = { titles[t].title, titles[t].author, isbns[t], copies[t], nullptr };
+                wanted[t] = w;
+            }
+            TitleRegistry::shared().acquire(wanted);
+            vector<TitleRecord*> records(titles.size());
+            for (size_t t = 0; t < titles.size(); t++)
+                records[t] = wanted[t].record;
+            vector<bool> taken = library.isbnsTaken(records);
+            
+            // Titles are checked in file order, so a title loses its ISBN to
+            // the first one in the file that the library accepts
+            vector<const char*> problems(titles.size(), nullptr);
+            unordered_map<uint64_t, size_t> firstWithISBN;
+            for (size_t t = 0; t < titles.size(); t++) {
+                ISBN key = titles[t].isbn;
+                if (taken[t])
+                    problems[t] = "ISBN belongs to another book in the library";
+                else if (!key.empty() && firstWithISBN.emplace(key.value(), t).first->second != t)
+                    problems[t] = "ISBN belongs to another book earlier in the file";
+                for (size_t c = 0; problems[t] && c < copies[t]; c++)
+                    TitleRegistry::shared().release(records[t]);
+            }
+            library.reserve(rows.size(), 0);
+            newBooks.reserve(rows.size());
+            for (size_t r = 0; r < rows.size(); r++) {
+                size_t t = rows[r].first;
+                if (problems[t]) {
+                    report.errors.push_back(make_pair(rows[r].second, string(problems[t])));
+                    report.imported--;
+                } else {
+                    newBooks.push_back(BookFactory::createBook(records[t]));
+                }
+            }
+        };
+        ImportReport report = parseFile(path, 3, "title", addRow, finish);
+        try {
+            library.addBooks(newBooks);
+        }
+        catch (...) {
+            for (size_t i = 0; i < newBooks.size(); i++)
+                BookFactory::destroyBook(newBooks[i]);
+            throw;
+        }
+        return report;
+    }
+    
+    static ImportReport importUsers(Library &library, const string &path) {
+        vector<User*> newUsers;
+        ImportReport report = parseFile(path, 2, "type", [&newUsers](const string_view* f, size_t) -> string {
+            int type = parseUserCategory(f[0]);
+            if (type == 0)
+                return "Unknown user type";
+            if (f[1].empty())
+                return "Missing name";
+            newUsers.push_back(UserFactory::createUser(type, string(f[1])));
+            return string();
+        });
+        library.registerUsers(newUsers);
+        return report;
+    }
+};
+
+
+// Loans taken by the users of one type
+struct CategoryLoans {
+    UserCategory category;
+    size_t users;
+    uint64_t loans;
+};
+
+// Circulation reports over a CatalogSnapshot: the titles lent most, loans
+// per user type, the copies never lent and how often copies go out. Each
+// query splits the rows into contiguous chunks, one per thread, works on
+// them in parallel and merges the partial results in chunk order, so the
+// answers do not depend on the thread count. Nothing here takes a library
+// lock. Counts cover the records in the snapshot: a removed book or user
+// takes its loans with it.
+class CirculationAnalytics {
+private:
+    shared_ptr<const CatalogSnapshot> snapshot;
+    size_t threads;
+    static const size_t MinChunk = 1 << 14;     // rows per thread at least
+    
+    size_t chunksFor(size_t rows) const {
+        size_t n = rows / MinChunk + 1;
+        return n < threads ? n : threads;
+    }
+    
+    // Calls work(c, begin, end) for each of chunks slices of [0, rows)
+    static void forEachChunk(size_t rows, size_t chunks, const function<void(size_t, size_t, size_t)> &work) {
+        vector<thread> workers;
+        for (size_t c = 1; c < chunks; c++)
+            workers.push_back(thread(work, c, rows / chunks * c, c + 1 == chunks ? rows : rows / chunks * (c + 1)));
+        work(0, 0, chunks == 1 ? rows : rows / chunks);
+        for (size_t i = 0; i < workers.size(); i++)
+            workers[i].join();
+    }
+public:
+    // threads of 0 uses every hardware thread
+    explicit CirculationAnalytics(shared_ptr<const CatalogSnapshot> s, size_t threads = 0)
+        : snapshot(s), threads(threads) {
+        if (this->threads == 0)
+            this->threads = thread::hardware_concurrency();
+        if (this->threads == 0)
+            this->threads = 1;
+    }
+    
+    // The k titles lent most, most first (ties to the older title); titles
+    // never lent are left out. Each chunk totals its copies by title, the
+    // totals are merged, and only the best k are sorted.
+    vector<TitleLoans> topTitles(size_t k) const {
+        const CatalogSnapshot &s = *snapshot;
+        size_t chunks = chunksFor(s.bookCount());
+        vector<unordered_map<TitleRecord*, uint64_t>> partial(chunks);
+        forEachChunk(s.bookCount(), chunks, [&s, &partial](size_t c, size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++)
+                if (s.book(i).loans > 0)
+                    partial[c][s.book(i).record] += s.book(i).loans;
+        });
+        for (size_t c = 1; c < chunks; c++)
+            for (unordered_map<TitleRecord*, uint64_t>::iterator it = partial[c].begin(); it != partial[c].end(); ++it)
+                partial[0][it->first] += it->second;
+        vector<pair<TitleRecord*, uint64_t>> ranked(partial[0].begin(), partial[0].end());
+        size_t n = k < ranked.size() ? k : ranked.size();
+        partial_sort(ranked.begin(), ranked.begin() + n, ranked.end(),
+                     [](const pair<TitleRecord*, uint64_t> &a, const pair<TitleRecord*, uint64_t> &b) {
+            if (a.second != b.second)
+                return a.second > b.second;
+            return a.first->getTitleID() < b.first->getTitleID();
+        });
+        vector<TitleLoans> out;
+        for (size_t i = 0; i < n; i++) {
+            TitleRecord* t = ranked[i].first;
+            TitleLoans entry = { t->getTitleID(), t->getTitle(), t->getAuthor(), t->getISBN(), ranked[i].second };
+            out.push_back(entry);
+        }
+        return out;
+    }
+    
+    // Users and loans for every user type, in type code order
+    vector<CategoryLoans> loansByUserType() const {
+        const CatalogSnapshot &s = *snapshot;
+        size_t chunks = chunksFor(s.userCount());
+        vector<CategoryLoans> totals(chunks * UserCategoryCount);
+        forEachChunk(s.userCount(), chunks, [&s, &totals](size_t c, size_t begin, size_t end) {
+            CategoryLoans* mine = &totals[c * UserCategoryCount];
+            for (size_t i = begin; i < end; i++) {
+                CategoryLoans &row = mine[static_cast<int>(s.user(i).category) - 1];
+                row.users++;
+                row.loans += s.user(i).loans;
+            }
+        });
+        vector<CategoryLoans> out(UserCategoryCount);
+        for (int t = 0; t < UserCategoryCount; t++) {
+            out[t].category = userCategoryPolicies[t].category;
+            for (size_t c = 0; c < chunks; c++) {
+                out[t].users += totals[c * UserCategoryCount + t].users;
+                out[t].loans += totals[c * UserCategoryCount + t].loans;
+            }
+        }
+        return out;
+    }
+    
+    // IDs of the copies never lent, in listing order
+    vector<int> neverBorrowed() const {
+        const CatalogSnapshot &s = *snapshot;
+        size_t chunks = chunksFor(s.bookCount());
+        vector<vector<int>> partial(chunks);
+        forEachChunk(s.bookCount(), chunks, [&s, &partial](size_t c, size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++)
+                if (s.book(i).loans == 0)
+                    partial[c].push_back(s.book(i).bookID);
+        });
+        for (size_t c = 1; c < chunks; c++)
+            partial[0].insert(partial[0].end(), partial[c].begin(), partial[c].end());
+        return partial[0];
+    }
+    
+    // How many copies have been lent how often: entry 0 counts the copies
+    // never lent and entry b > 0 those lent from 2^(b-1) to 2^b - 1 times.
+    // Trailing empty entries are left off.
+    vector<size_t> loanHistogram() const {
+        const CatalogSnapshot &s = *snapshot;
+        const size_t Buckets = 33;
+        size_t chunks = chunksFor(s.bookCount());
+        vector<size_t> counts(chunks * Buckets);
+        forEachChunk(s.bookCount(), chunks, [&s, &counts, Buckets](size_t c, size_t begin, size_t end) {
+            size_t* mine = &counts[c * Buckets];
+            for (size_t i = begin; i < end; i++) {
+                uint32_t n = s.book(i).loans;
+                size_t b = 0;
+                while (n) {
+                    b++;
+                    n >>= 1;
+                }
+                mine[b]++;
+            }
+        });
+        vector<size_t> out(Buckets);
+        for (size_t c = 0; c < chunks; c++)
+            for (size_t b = 0; b < Buckets; b++)
+                out[b] += counts[c * Buckets + b];
+        while (!out.empty() && out.back() == 0)
+            out.pop_back();
+        return out;
+    }
+};
+
+#endif
@@ -0,0 +1,577 @@
+// Benchmarks for the hot paths of the library core.
+//
+// Each benchmark runs against a synthetic catalog whose book count is the
+// benchmark argument (users are a tenth of that). Use the usual Google
+// Benchmark flags to pick or repeat benchmarks, e.g.
+//   library_bench --benchmark_filter=GetBook
+// and LIBRARY_BENCH_MAX_BOOKS to change the largest catalog size.
+
+#include <benchmark/benchmark.h>
+#include <cstdlib>
+#include <fstream>
+#include <random>
+#include "Library.h"
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+namespace {
+
+// Builds reproducible catalogs and user populations of any size
+class SyntheticWorkload {
+private:
+    mt19937 rng;
+
+    const string& pick(const vector<string> &words) {
+        return words[uniform_int_distribution<size_t>(0, words.size() - 1)(rng)];
+    }
+public:
+    explicit SyntheticWorkload(unsigned seed = 42) : rng(seed) {}
+
+    // A few common words plus a serial number, so titles are unique but
+    // keyword searches still hit many books
+    string title(size_t serial) {
+        static const vector<string> words = {
+            "The", "Secret", "History", "of", "River", "Winter", "Garden", "Night",
+            "Lost", "City", "Song", "Stone", "Empire", "Last", "House", "Light"
+        };
+        int count = uniform_int_distribution<int>(2, 4)(rng);
+        string t;
+        for (int i = 0; i < count; i++)
+            t += pick(words) + " ";
+        return t + to_string(serial);
+    }
+
+    string author() {
+        static const vector<string> first = { "Ann", "Ben", "Cara", "Dev", "Eli", "Fay", "Gus", "Hana" };
+        static const vector<string> last = { "Ito", "Jones", "Khan", "Lee", "Moss", "Nash", "Ortiz", "Park" };
+        return pick(first) + " " + pick(last);
+    }
+
+    // A valid ISBN, different for every serial number like the titles
+    string isbn(size_t serial) {
+        return ISBN::withCheckDigit(978000000000ULL + serial).str();
+    }
+
+    // count IDs drawn uniformly from [0, limit)
+    vector<int> ids(size_t count, int limit) {
+        vector<int> out(count);
+        uniform_int_distribution<int> dist(0, limit - 1);
+        for (size_t i = 0; i < count; i++)
+            out[i] = dist(rng);
+        return out;
+    }
+
+    // Replaces the library's contents with bookCount books and userCount users
+    void populate(Library &library, size_t bookCount, size_t userCount) {
+        library.clear();
+        library.reserve(bookCount, userCount);
+        vector<Book*> newBooks;
+        newBooks.reserve(bookCount);
+        for (size_t i = 0; i < bookCount; i++)
+            newBooks.push_back(BookFactory::createBook(title(i), author(), isbn(i)));
+        library.addBooks(newBooks);
+        vector<User*> newUsers;
+        newUsers.reserve(userCount);
+        for (size_t i = 0; i < userCount; i++)
+            newUsers.push_back(UserFactory::createUser(i % 4 == 0 ? 2 : 1, "User " + to_string(i)));
+        library.registerUsers(newUsers);
+    }
+};
+
+size_t populatedBooks = 0;
+
+size_t userCountFor(size_t n) { return n / 10 < 100 ? 100 : n / 10; }
+
+// Makes sure the singleton holds a freshly generated catalog of n books.
+// Benchmarks that change the catalog's shape reset populatedBooks.
+Library& catalogOf(size_t n) {
+    Library &library = Library::getInstance();
+    if (populatedBooks != n) {
+        SyntheticWorkload().populate(library, n, userCountFor(n));
+        populatedBooks = n;
+    }
+    return library;
+}
+
+const size_t Probes = 4096;   // random IDs cycled through by lookup benchmarks
+
+void BM_GetBook(benchmark::State &state) {
+    size_t n = static_cast<size_t>(state.range(0));
+    Library &library = catalogOf(n);
+    vector<int> ids = SyntheticWorkload(7).ids(Probes, static_cast<int>(n));
+    size_t i = 0;
+    for (auto _ : state)
+        benchmark::DoNotOptimize(library.getBook(ids[i++ % Probes]));
+    state.SetItemsProcessed(state.iterations());
+}
+
+void BM_GetUser(benchmark::State &state) {
+    size_t n = static_cast<size_t>(state.range(0));
+    Library &library = catalogOf(n);
+    vector<int> ids = SyntheticWorkload(7).ids(Probes, static_cast<int>(userCountFor(n)));
+    size_t i = 0;
+    for (auto _ : state)
+        benchmark::DoNotOptimize(library.getUser(ids[i++ % Probes]));
+    state.SetItemsProcessed(state.iterations());
+}
+
+void BM_FindBookByTitle(benchmark::State &state) {
+    size_t n = static_cast<size_t>(state.range(0));
+    Library &library = catalogOf(n);
+    vector<int> ids = SyntheticWorkload(7).ids(Probes, static_cast<int>(n));
+    vector<string> titles;
+    for (size_t k = 0; k < Probes; k++)
+        titles.push_back(library.getBook(ids[k])->getTitle());
+    size_t i = 0;
+    for (auto _ : state)
+        benchmark::DoNotOptimize(library.findBookByTitle(titles[i++ % Probes]));
+    state.SetItemsProcessed(state.iterations());
+}
+
+// One borrow plus one return per iteration. Each thread works on its own
+// users and books so the loans always succeed.
+void BM_BorrowReturn(benchmark::State &state) {
+    size_t n = static_cast<size_t>(state.range(0));
+    if (state.thread_index() == 0)
+        catalogOf(n);
+    Library &library = Library::getInstance();
+    int threads = state.threads();
+    int users = static_cast<int>(userCountFor(n)) / threads;
+    int books = static_cast<int>(n) / threads;
+    vector<int> u = SyntheticWorkload(state.thread_index() + 1).ids(Probes, users);
+    vector<int> b = SyntheticWorkload(state.thread_index() + 101).ids(Probes, books);
+    size_t i = 0;
+    for (auto _ : state) {
+        int userID = u[i % Probes] * threads + state.thread_index();
+        int bookID = b[i % Probes] * threads + state.thread_index();
+        library.borrowBook(userID, bookID);
+        library.returnBook(userID, bookID);
+        i++;
+    }
+    state.SetItemsProcessed(state.iterations() * 2);
+}
+
+// Borrow and return while another thread keeps exporting the user list,
+// as a long audit would. Exports read a snapshot, so the desk traffic
+// should run close to BM_BorrowReturn's single-thread rate.
+void BM_BorrowReturnDuringExport(benchmark::State &state) {
+    size_t n = static_cast<size_t>(state.range(0));
+    Library &library = catalogOf(n);
+    vector<int> u = SyntheticWorkload(1).ids(Probes, static_cast<int>(userCountFor(n)));
+    vector<int> b = SyntheticWorkload(101).ids(Probes, static_cast<int>(n));
+    atomic<bool> done(false);
+    thread exporter([&library, &done]() {
+        FILE* devNull = fopen("/dev/null", "wb");
+        while (!done) {
+            ReportSink out(devNull);
+            library.exportUsers(out, ReportFormat::Text);
+        }
+        fclose(devNull);
+    });
+    size_t i = 0;
+    for (auto _ : state) {
+        library.borrowBook(u[i % Probes], b[i % Probes]);
+        library.returnBook(u[i % Probes], b[i % Probes]);
+        i++;
+    }
+    done = true;
+    exporter.join();
+    state.SetItemsProcessed(state.iterations() * 2);
+}
+
+// Failure-path cost: borrowing a book that is already out, through the
+// throwing API and through the status-returning one
+void BM_BorrowUnavailableThrowing(benchmark::State &state) {
+    Library &library = catalogOf(static_cast<size_t>(state.range(0)));
+    library.tryBorrowBook(0, 0);
+    for (auto _ : state) {
+        try {
+            library.borrowBook(1, 0);
+        }
+        catch (LibraryException &e) {
+            benchmark::DoNotOptimize(e.what());
+        }
+    }
+    library.tryReturnBook(0, 0);
+}
+
+void BM_BorrowUnavailableStatus(benchmark::State &state) {
+    Library &library = catalogOf(static_cast<size_t>(state.range(0)));
+    library.tryBorrowBook(0, 0);
+    for (auto _ : state)
+        benchmark::DoNotOptimize(library.tryBorrowBook(1, 0));
+    library.tryReturnBook(0, 0);
+}
+
+// Borrowing and returning whichever copy of a title is free, for a title
+// with range(0) copies; the free-copy list keeps this independent of the
+// number of copies
+void BM_BorrowAnyCopy(benchmark::State &state) {
+    Library &library = catalogOf(1 << 10);
+    vector<Book*> copies;
+    for (int64_t i = 0; i < state.range(0); i++)
+        copies.push_back(BookFactory::createBook("Many Copies", "Ann Ito", "9780000000000"));
+    library.addBooks(copies);
+    int bookID = copies[0]->getBookID();
+    for (auto _ : state) {
+        library.tryBorrowAnyCopy(0, bookID);
+        library.tryReturnAnyCopy(0, bookID);
+    }
+    state.SetItemsProcessed(state.iterations() * 2);
+    populatedBooks = 0;
+}
+
+// Lends the first three books per user to that user (book b to user b / 3)
+// and gives each lent book a queue of depth holds from the following users
+void lendWithHolds(Library &library, size_t users, int depth) {
+    for (size_t b = 0; b < users * 3; b++) {
+        int borrower = static_cast<int>(b / 3);
+        library.tryBorrowBook(borrower, static_cast<int>(b));
+        for (int k = 1; k <= depth; k++)
+            library.placeHold(static_cast<int>((b / 3 + k) % users), static_cast<int>(b));
+    }
+}
+
+// Placing and withdrawing a hold on a book that is out
+void BM_PlaceCancelHold(benchmark::State &state) {
+    size_t n = static_cast<size_t>(state.range(0));
+    Library &library = catalogOf(n);
+    size_t users = userCountFor(n);
+    lendWithHolds(library, users, 0);
+    vector<int> b = SyntheticWorkload(5).ids(Probes, static_cast<int>(users * 3));
+    size_t i = 0;
+    for (auto _ : state) {
+        int bookID = b[i % Probes];
+        int userID = static_cast<int>((bookID / 3 + 1) % users);
+        library.placeHold(userID, bookID);
+        library.cancelHold(userID, bookID);
+        i++;
+    }
+    state.SetItemsProcessed(state.iterations() * 2);
+    populatedBooks = 0;
+}
+
+void useSystemClock(Library &library) {
+    library.setClock([] {
+        return static_cast<int64_t>(chrono::duration_cast<chrono::seconds>(chrono::system_clock::now().time_since_epoch()).count());
+    });
+}
+
+// Every lent book has a queue of holds, all with a ready head. Each
+// iteration moves the clock past the pickup window, so expireHolds() drops
+// one ready hold per book and promotes the next in line. Refilling the
+// queues is slow and untimed, so the iteration count is fixed.
+void BM_ExpireHolds(benchmark::State &state) {
+    const int Depth = 8;
+    size_t n = static_cast<size_t>(state.range(0));
+    Library &library = catalogOf(n);
+    size_t users = userCountFor(n);
+    int64_t now = 0;
+    library.setClock([&now] { return now; });
+    library.setHoldPickupWindow(60);
+    int left = 0;
+    size_t expired = 0;
+    for (auto _ : state) {
+        if (left == 0) {
+            state.PauseTiming();
+            lendWithHolds(library, users, Depth);
+            for (size_t b = 0; b < users * 3; b++)
+                library.tryReturnBook(static_cast<int>(b / 3), static_cast<int>(b));
+            left = Depth;
+            state.ResumeTiming();
+        }
+        now += 61;
+        expired += library.expireHolds();
+        left--;
+    }
+    state.SetItemsProcessed(static_cast<int64_t>(expired));
+    useSystemClock(library);
+    populatedBooks = 0;
+}
+
+// The nightly overdue run: every user borrows up to their limit, the clock
+// moves past every due date, and each iteration lists all overdue loans
+// with their fines on range(1) threads
+void BM_OverdueLoans(benchmark::State &state) {
+    size_t n = static_cast<size_t>(state.range(0));
+    Library &library = catalogOf(n);
+    int users = static_cast<int>(userCountFor(n));
+    int64_t now = 0;
+    library.setClock([&now] { return now; });
+    for (int b = 0; b < static_cast<int>(n); b++)
+        library.tryBorrowBook(b % users, b);
+    now = 365 * 86400;
+    size_t overdue = 0;
+    for (auto _ : state)
+        overdue += library.overdueLoans(static_cast<size_t>(state.range(1))).size();
+    state.SetItemsProcessed(static_cast<int64_t>(overdue));
+    useSystemClock(library);
+    populatedBooks = 0;
+}
+
+void BM_RemoveBook(benchmark::State &state) {
+    size_t n = static_cast<size_t>(state.range(0));
+    Library &library = catalogOf(n);
+    SyntheticWorkload workload(9);
+    vector<int> ids = workload.ids(Probes, static_cast<int>(n));
+    size_t i = 0;
+    for (auto _ : state) {
+        state.PauseTiming();
+        Book* spare = BookFactory::createBook(workload.title(n + i), workload.author(), workload.isbn(n + i));
+        library.addBook(spare);
+        int victim = library.getBook(ids[i % Probes]) ? ids[i % Probes] : spare->getBookID();
+        state.ResumeTiming();
+        library.removeBook(victim);
+        i++;
+    }
+    populatedBooks = 0;
+}
+
+// Removal when every title shares its author and most of its words, so
+// the author's index range and the words' postings lists hold the whole
+// catalog
+void BM_RemoveBookSharedWords(benchmark::State &state) {
+    size_t n = static_cast<size_t>(state.range(0));
+    Library &library = Library::getInstance();
+    SyntheticWorkload workload(13);
+    library.clear();
+    vector<Book*> newBooks;
+    for (size_t i = 0; i < n; i++)
+        newBooks.push_back(BookFactory::createBook("Collected Stories " + to_string(i), "Ann Lee", workload.isbn(i)));
+    library.addBooks(newBooks);
+    vector<int> ids = workload.ids(Probes, static_cast<int>(n));
+    size_t i = 0;
+    for (auto _ : state) {
+        state.PauseTiming();
+        Book* spare = BookFactory::createBook("Collected Stories " + to_string(n + i), "Ann Lee", workload.isbn(n + i));
+        library.addBook(spare);
+        int victim = library.getBook(ids[i % Probes]) ? ids[i % Probes] : spare->getBookID();
+        state.ResumeTiming();
+        library.removeBook(victim);
+        i++;
+    }
+    populatedBooks = 0;
+}
+
+// Heap bytes in use, or 0 where malloc cannot report it
+size_t heapInUse() {
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+    struct mallinfo2 info = mallinfo2();
+    return info.uordblks + info.hblkhd;
+#else
+    return 0;
+#endif
+}
+
+// Book storage as it was before the slab pools, each copy its own new'd
+// object, against copies placed in a SlabPool. Both walk the copies in
+// catalog order; bytes_per_book is the heap the copies take, not counting
+// the pointer vector or their shared title.
+void walkBooks(benchmark::State &state, vector<Book*> &books, size_t bytes) {
+    for (auto _ : state) {
+        int64_t sum = 0;
+        for (size_t i = 0; i < books.size(); i++)
+            sum += books[i]->getBookID() + static_cast<int64_t>(books[i]->getTitle().size());
+        benchmark::DoNotOptimize(sum);
+    }
+    state.SetItemsProcessed(state.iterations() * static_cast<int64_t>(books.size()));
+    if (bytes)
+        state.counters["bytes_per_book"] = static_cast<double>(bytes) / static_cast<double>(books.size());
+}
+
+void BM_WalkBooksNew(benchmark::State &state) {
+    size_t n = static_cast<size_t>(state.range(0));
+    Book anchor("Walk", "Author", "");   // keeps the shared title alive
+    vector<Book*> books;
+    books.reserve(n);
+    size_t before = heapInUse();
+    for (size_t i = 0; i < n; i++)
+        books.push_back(new Book("Walk", "Author", ""));
+    walkBooks(state, books, heapInUse() - before);
+    for (size_t i = 0; i < n; i++)
+        delete books[i];
+}
+
+void BM_WalkBooksSlab(benchmark::State &state) {
+    size_t n = static_cast<size_t>(state.range(0));
+    Book anchor("Walk", "Author", "");
+    vector<Book*> books;
+    books.reserve(n);
+    size_t before = heapInUse();
+    {
+        BookFactory::Pool pool;   // its own pool, so the bytes are only these copies
+        for (size_t i = 0; i < n; i++)
+            books.push_back(new (pool.allocate()) Book("Walk", "Author", ""));
+        walkBooks(state, books, heapInUse() - before);
+        for (size_t i = 0; i < n; i++)
+            books[i]->~Book();
+    }
+}
+
+void BM_CountAvailableBooks(benchmark::State &state) {
+    size_t n = static_cast<size_t>(state.range(0));
+    Library &library = catalogOf(n);
+    for (auto _ : state)
+        benchmark::DoNotOptimize(library.countAvailableBooks());
+    state.SetItemsProcessed(state.iterations() * static_cast<int64_t>(n));
+}
+
+void BM_ListBooks(benchmark::State &state) {
+    size_t n = static_cast<size_t>(state.range(0));
+    Library &library = catalogOf(n);
+    FILE* devNull = fopen("/dev/null", "wb");
+    for (auto _ : state) {
+        ReportSink out(devNull);
+        library.exportBooks(out, ReportFormat::Text);
+    }
+    fclose(devNull);
+    state.SetItemsProcessed(state.iterations() * static_cast<int64_t>(n));
+}
+
+void BM_ListUsers(benchmark::State &state) {
+    size_t n = static_cast<size_t>(state.range(0));
+    Library &library = catalogOf(n);
+    FILE* devNull = fopen("/dev/null", "wb");
+    for (auto _ : state) {
+        ReportSink out(devNull);
+        library.exportUsers(out, ReportFormat::Text);
+    }
+    fclose(devNull);
+    state.SetItemsProcessed(state.iterations() * static_cast<int64_t>(userCountFor(n)));
+}
+
+// Validating and packing ISBNs as a bulk load does, half of them written
+// with hyphens
+void BM_ParseISBN(benchmark::State &state) {
+    vector<string> texts;
+    for (size_t i = 0; i < Probes; i++) {
+        string digits = ISBN::withCheckDigit(978000000000ULL + i * 7919).str();
+        texts.push_back(i % 2 ? digits : digits.substr(0, 3) + "-" + digits.substr(3, 1) + "-" + digits.substr(4, 4) + "-"
+                                         + digits.substr(8, 4) + "-" + digits.substr(12));
+    }
+    size_t i = 0;
+    for (auto _ : state) {
+        ISBN key;
+        benchmark::DoNotOptimize(ISBN::parse(texts[i++ % Probes], key));
+        benchmark::DoNotOptimize(key);
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+
+// Importing a CSV of n rows, two copies of each title, into an empty
+// library; the file is written once per size and the library emptied
+// between runs
+void BM_ImportBooks(benchmark::State &state) {
+    size_t n = static_cast<size_t>(state.range(0));
+    const char* path = "library_bench_import.csv";
+    {
+        SyntheticWorkload workload(13);
+        ofstream out(path);
+        out << "title,author,isbn\n";
+        for (size_t i = 0; i < n / 2; i++) {
+            string row = workload.title(i) + "," + workload.author() + "," + workload.isbn(i) + "\n";
+            out << row << row;
+        }
+    }
+    Library &library = Library::getInstance();
+    for (auto _ : state) {
+        state.PauseTiming();
+        library.clear();
+        state.ResumeTiming();
+        ImportReport report = CatalogImporter::importBooks(library, path);
+        if (report.imported != n / 2 * 2)
+            state.SkipWithError("rows were rejected");
+    }
+    state.SetItemsProcessed(state.iterations() * static_cast<int64_t>(n));
+    remove(path);
+    populatedBooks = 0;
+}
+
+// The ten most-lent titles, read from the list kept current by every loan
+// and computed afresh by CirculationAnalytics from a snapshot
+void lendSome(Library &library, size_t n) {
+    vector<int> b = SyntheticWorkload(11).ids(Probes, static_cast<int>(n));
+    vector<int> u = SyntheticWorkload(12).ids(Probes, static_cast<int>(userCountFor(n)));
+    for (size_t i = 0; i < Probes; i++)
+        if (library.tryBorrowBook(u[i], b[i]) == TxnStatus::OK)
+            library.tryReturnBook(u[i], b[i]);
+}
+
+void BM_TopTitles(benchmark::State &state) {
+    size_t n = static_cast<size_t>(state.range(0));
+    Library &library = catalogOf(n);
+    lendSome(library, n);
+    for (auto _ : state)
+        benchmark::DoNotOptimize(library.topTitles(10));
+}
+
+void BM_TopTitlesScan(benchmark::State &state) {
+    size_t n = static_cast<size_t>(state.range(0));
+    Library &library = catalogOf(n);
+    lendSome(library, n);
+    for (auto _ : state)
+        benchmark::DoNotOptimize(CirculationAnalytics(library.readSnapshot()).topTitles(10));
+    state.SetItemsProcessed(state.iterations() * static_cast<int64_t>(n));
+}
+
+// Moving the only copy of the most-lent title to another title and back.
+// Each move takes a listed title's loans away, so the top list has to be
+// refilled from the rest of the catalog.
+void BM_MoveTopTitleCopy(benchmark::State &state) {
+    size_t n = static_cast<size_t>(state.range(0));
+    Library &library = catalogOf(n);
+    lendSome(library, n);
+    TitleLoans top = library.topTitles(1)[0];
+    int bookID = library.findBookByTitle(top.title)->getBookID();
+    for (auto _ : state) {
+        library.editBook(bookID, top.title + " (moved)", top.author, "");
+        library.editBook(bookID, top.title, top.author, top.isbn);
+    }
+    populatedBooks = 0;
+}
+
+int64_t maxBooks() {
+    const char* env = getenv("LIBRARY_BENCH_MAX_BOOKS");
+    long long n = env ? atoll(env) : 0;
+    return n >= 1024 ? n : (1 << 20);
+}
+
+void catalogSizes(benchmark::internal::Benchmark* b) {
+    b->RangeMultiplier(16)->Range(1 << 10, maxBooks());
+}
+
+// Catalog sizes crossed with 1, 2, 4 and 8 threads
+void catalogSizesAndThreads(benchmark::internal::Benchmark* b) {
+    for (long long n = 1 << 10; n <= maxBooks(); n *= 16)
+        for (int threads = 1; threads <= 8; threads *= 2)
+            b->Args({ n, threads });
+}
+
+}  // namespace
+
+BENCHMARK(BM_GetBook)->Apply(catalogSizes);
+BENCHMARK(BM_GetUser)->Apply(catalogSizes);
+BENCHMARK(BM_FindBookByTitle)->Apply(catalogSizes);
+BENCHMARK(BM_BorrowReturn)->Apply(catalogSizes)->ThreadRange(1, 8)->UseRealTime();
+BENCHMARK(BM_BorrowReturnDuringExport)->Apply(catalogSizes)->UseRealTime();
+BENCHMARK(BM_BorrowUnavailableThrowing)->Arg(1 << 16);
+BENCHMARK(BM_BorrowUnavailableStatus)->Arg(1 << 16);
+BENCHMARK(BM_BorrowAnyCopy)->RangeMultiplier(64)->Range(1, 1 << 12);
+BENCHMARK(BM_PlaceCancelHold)->Apply(catalogSizes);
+BENCHMARK(BM_ExpireHolds)->Apply(catalogSizes)->Iterations(16);
+BENCHMARK(BM_OverdueLoans)->Apply(catalogSizesAndThreads)->UseRealTime();
+BENCHMARK(BM_RemoveBook)->Apply(catalogSizes);
+BENCHMARK(BM_RemoveBookSharedWords)->Apply(catalogSizes);
+BENCHMARK(BM_WalkBooksNew)->Apply(catalogSizes);
+BENCHMARK(BM_WalkBooksSlab)->Apply(catalogSizes);
+BENCHMARK(BM_CountAvailableBooks)->Apply(catalogSizes);
+BENCHMARK(BM_ListBooks)->Apply(catalogSizes);
+BENCHMARK(BM_ListUsers)->Apply(catalogSizes);
+BENCHMARK(BM_ParseISBN);
+BENCHMARK(BM_ImportBooks)->Apply(catalogSizes)->UseRealTime();
+BENCHMARK(BM_TopTitles)->Apply(catalogSizes);
+BENCHMARK(BM_TopTitlesScan)->Apply(catalogSizes);
+BENCHMARK(BM_MoveTopTitleCopy)->Apply(catalogSizes);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,460 @@
+// Replays a trace recorded with LIBRARY_TRACE_FILE (see TraceRecorder)
+// against the Library API and reports throughput, latency percentiles and
+// the calls whose results differ from the recording.
+//
+//   library_replay TRACE [--speed original|max|FACTOR] [--threads N]
+//
+// The library starts from the snapshot at the head of the trace and lives
+// in memory only: library.dat and library.log are not touched. With
+// --speed max (the default) calls are made back to back; with original
+// each call waits for its recorded start time, and a factor such as 2
+// replays twice as fast as that. --threads N replays on N threads, and
+// each recorded thread's calls stay in order on one of them (thread T on
+// T mod N). With one thread calls run in order of their recorded start, so
+// a trace of the menu program replays exactly; calls that raced each other
+// when recorded may come out differently, and such differences are what
+// the divergence count shows. The library clock reads the time recorded
+// for each call, so due dates and fines match. Calls that read or write
+// files (saveSnapshot, loadSnapshot, recover, checkpoint) are skipped.
+
+#include "Library.h"
+
+namespace {
+
+struct Options {
+    string tracePath;
+    double speed = 0;           // 0: as fast as possible
+    int threads = 1;
+};
+
+// Clock the library reads during a replay: the recorded time of the call
+// the thread is making
+thread_local int64_t replayClock = 0;
+
+bool touchesFiles(LibraryOp op) {
+    return op == LibraryOp::SaveSnapshot || op == LibraryOp::LoadSnapshot ||
+           op == LibraryOp::Recover || op == LibraryOp::Checkpoint;
+}
+
+int64_t intArg(const TraceRecorder::Call &call, size_t i) {
+    if (i >= call.ints.size())
+        throw LibraryException("Trace call is missing an argument.", LibraryError::CorruptData);
+    return call.ints[i];
+}
+
+const string& textArg(const TraceRecorder::Call &call, size_t i) {
+    if (i >= call.text.size())
+        throw LibraryException("Trace call is missing an argument.", LibraryError::CorruptData);
+    return call.text[i];
+}
+
+int idArg(const TraceRecorder::Call &call, size_t i) {
+    return static_cast<int>(intArg(call, i));
+}
+
+// Makes a recorded call again and returns its result the way Library
+// records it: a status, an ID or -1, or a count. The arguments are the
+// call's parameters in order; a book is its ID then title, author and ISBN,
+// a user their ID and type code then name, and a batch record user, book
+// and TxnOp.
+int64_t replayCall(Library &library, const TraceRecorder::Call &call, ReportSink &discard) {
+    switch (call.op) {
+    case LibraryOp::AddBook: {
+        Book* book = BookFactory::restoreBook(idArg(call, 0), textArg(call, 0), textArg(call, 1), textArg(call, 2));
+        try {
+            library.addBook(book);
+        }
+        catch (LibraryException &) {
+            BookFactory::destroyBook(book);
+            throw;
+        }
+        return 0;
+    }
+    case LibraryOp::AddBooks: {
+        vector<Book*> books;
+        for (size_t i = 0; i < call.ints.size(); i++)
+            books.push_back(BookFactory::restoreBook(idArg(call, i), textArg(call, 3 * i), textArg(call, 3 * i + 1), textArg(call, 3 * i + 2)));
+        try {
+            library.addBooks(books);
+        }
+        catch (LibraryException &) {
+            for (size_t i = 0; i < books.size(); i++)
+                BookFactory::destroyBook(books[i]);
+            throw;
+        }
+        return 0;
+    }
+    case LibraryOp::GetBook: {
+        Book* book = library.getBook(idArg(call, 0));
+        return book ? book->getBookID() : -1;
+    }
+    case LibraryOp::EditBook:
+        library.editBook(idArg(call, 0), textArg(call, 0), textArg(call, 1), textArg(call, 2));
+        return 0;
+    case LibraryOp::RemoveBook:
+        return static_cast<int64_t>(library.tryRemoveBook(idArg(call, 0)));
+    case LibraryOp::FindBookByTitle: {
+        Book* book = library.findBookByTitle(textArg(call, 0));
+        return book ? book->getBookID() : -1;
+    }
+    case LibraryOp::FindBooks:
+        return static_cast<int64_t>(library.findBooks(static_cast<BookField>(intArg(call, 0)), textArg(call, 0),
+                                                      static_cast<MatchMode>(intArg(call, 1))).size());
+    case LibraryOp::SearchBooks:
+        return static_cast<int64_t>(library.searchBooks(textArg(call, 0)).size());
+    case LibraryOp::RegisterUser: {
+        User* user = UserFactory::restoreUser(idArg(call, 1), idArg(call, 0), textArg(call, 0));
+        try {
+            library.registerUser(user);
+        }
+        catch (LibraryException &) {
+            UserFactory::destroyUser(user);
+            throw;
+        }
+        return 0;
+    }
+    case LibraryOp::RegisterUsers: {
+        vector<User*> users;
+        try {
+            for (size_t i = 0; i < call.text.size(); i++)
+                users.push_back(UserFactory::restoreUser(idArg(call, 2 * i + 1), idArg(call, 2 * i), textArg(call, i)));
+            library.registerUsers(users);
+        }
+        catch (LibraryException &) {
+            for (size_t i = 0; i < users.size(); i++)
+                UserFactory::destroyUser(users[i]);
+            throw;
+        }
+        return 0;
+    }
+    case LibraryOp::GetUser: {
+        User* user = library.getUser(idArg(call, 0));
+        return user ? user->getUserID() : -1;
+    }
+    case LibraryOp::EditUser:
+        library.editUser(idArg(call, 0), textArg(call, 0));
+        return 0;
+    case LibraryOp::RemoveUser:
+        return static_cast<int64_t>(library.tryRemoveUser(idArg(call, 0)));
+    case LibraryOp::BorrowBook:
+        return static_cast<int64_t>(library.tryBorrowBook(idArg(call, 0), idArg(call, 1)));
+    case LibraryOp::ReturnBook:
+        return static_cast<int64_t>(library.tryReturnBook(idArg(call, 0), idArg(call, 1)));
+    case LibraryOp::ApplyBatch: {
+        vector<TxnRecord> records;
+        for (size_t i = 0; i + 2 < call.ints.size(); i += 3) {
+            TxnRecord r = { idArg(call, i), idArg(call, i + 1), static_cast<TxnOp>(intArg(call, i + 2)) };
+            records.push_back(r);
+        }
+        vector<TxnStatus> statuses = library.applyBatch(records);
+        return static_cast<int64_t>(count(statuses.begin(), statuses.end(), TxnStatus::OK));
+    }
+    case LibraryOp::ExportBooks:
+        return static_cast<int64_t>(library.exportBooks(discard, static_cast<ReportFormat>(intArg(call, 0)),
+                                                        static_cast<size_t>(intArg(call, 1)), static_cast<size_t>(intArg(call, 2))));
+    case LibraryOp::ExportUsers:
+        return static_cast<int64_t>(library.exportUsers(discard, static_cast<ReportFormat>(intArg(call, 0)),
+                                                        static_cast<size_t>(intArg(call, 1)), static_cast<size_t>(intArg(call, 2))));
+    case LibraryOp::ReadSnapshot:
+        library.readSnapshot();
+        return 0;
+    case LibraryOp::CountAvailableBooks:
+        return static_cast<int64_t>(library.countAvailableBooks());
+    case LibraryOp::BooksOnLoan:
+        return static_cast<int64_t>(library.booksOnLoan().size());
+    case LibraryOp::GetBorrower:
+        return library.getBorrower(idArg(call, 0));
+    case LibraryOp::PlaceHold:
+        return static_cast<int64_t>(library.placeHold(idArg(call, 0), idArg(call, 1)));
+    case LibraryOp::CancelHold:
+        return static_cast<int64_t>(library.cancelHold(idArg(call, 0), idArg(call, 1)));
+    case LibraryOp::ExpireHolds:
+        return static_cast<int64_t>(library.expireHolds());
+    case LibraryOp::BorrowAnyCopy:
+        return static_cast<int64_t>(library.tryBorrowAnyCopy(idArg(call, 0), idArg(call, 1)));
+    case LibraryOp::ReturnAnyCopy:
+        return static_cast<int64_t>(library.tryReturnAnyCopy(idArg(call, 0), idArg(call, 1)));
+    case LibraryOp::GetLoans:
+        return static_cast<int64_t>(library.getLoans(idArg(call, 0)).size());
+    case LibraryOp::OverdueLoans:
+        return static_cast<int64_t>(library.overdueLoans(static_cast<size_t>(intArg(call, 0))).size());
+    case LibraryOp::TopTitles:
+        return static_cast<int64_t>(library.topTitles(static_cast<size_t>(intArg(call, 0))).size());
+    case LibraryOp::PrepareTransfer:
+        return static_cast<int64_t>(library.prepareTransfer(intArg(call, 0), idArg(call, 1), idArg(call, 2)));
+    case LibraryOp::CommitTransfer:
+        return static_cast<int64_t>(library.commitTransfer(intArg(call, 0), intArg(call, 1), intArg(call, 2)));
+    case LibraryOp::AbortTransfer:
+        return static_cast<int64_t>(library.abortTransfer(intArg(call, 0)));
+    case LibraryOp::LendRemote:
+        return static_cast<int64_t>(library.lendRemote(intArg(call, 0), idArg(call, 1), static_cast<UserCategory>(intArg(call, 2)),
+                                                       idArg(call, 3)));
+    case LibraryOp::ReturnRemote:
+        return static_cast<int64_t>(library.returnRemote(idArg(call, 0), idArg(call, 1)));
+    case LibraryOp::EndRemoteLoan:
+        return static_cast<int64_t>(library.endRemoteLoan(idArg(call, 0), idArg(call, 1), intArg(call, 2)));
+    default:
+        throw LibraryException(string("Cannot replay ") + libraryOpName(call.op) + ".", LibraryError::CorruptData);
+    }
+}
+
+// Latencies in the same log-linear buckets the library's metrics use
+struct Latencies {
+    uint64_t count = 0;
+    uint64_t maxNs = 0;
+    vector<uint64_t> histogram = vector<uint64_t>(Metrics::Buckets, 0);
+
+    void add(uint64_t ns) {
+        histogram[Metrics::bucketOf(ns)]++;
+        count++;
+        maxNs = max(maxNs, ns);
+    }
+
+    void add(const Latencies &other) {
+        count += other.count;
+        maxNs = max(maxNs, other.maxNs);
+        for (int b = 0; b < Metrics::Buckets; b++)
+            histogram[b] += other.histogram[b];
+    }
+
+    // Latency at fraction p of the calls, in microseconds
+    double percentile(double p) const {
+        if (count == 0)
+            return 0;
+        uint64_t rank = static_cast<uint64_t>(p * static_cast<double>(count - 1)) + 1;
+        uint64_t seen = 0;
+        for (int b = 0; b < Metrics::Buckets; b++) {
+            seen += histogram[b];
+            if (seen >= rank)
+                return min(static_cast<double>(maxNs), static_cast<double>(Metrics::bucketFloor(b) + Metrics::bucketFloor(b + 1)) / 2.0) / 1000.0;
+        }
+        return static_cast<double>(maxNs) / 1000.0;
+    }
+};
+
+// One operation's calls, as recorded and as replayed
+struct OpTally {
+    uint64_t diverged = 0;
+    Latencies recorded;
+    Latencies replayed;
+
+    void add(const OpTally &other) {
+        diverged += other.diverged;
+        recorded.add(other.recorded);
+        replayed.add(other.replayed);
+    }
+};
+
+// A replayed call whose result differs from the recording
+struct Divergence {
+    size_t call;
+    bool threw;
+    int64_t result;
+};
+
+// What one replay thread measured
+struct Tally {
+    vector<OpTally> ops = vector<OpTally>(Metrics::Ops);
+    vector<Divergence> divergences;     // the first few
+    uint64_t skipped = 0;
+};
+
+const size_t ShownDivergences = 10;
+
+int64_t nowNs() {
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Replays the calls at the given positions of the trace in order
+void replayCalls(const Options &opt, const TraceRecorder::Trace &trace, const vector<size_t> &calls,
+                 int64_t start, Tally &tally) {
+    Library &library = Library::getInstance();
+#ifdef _WIN32
+    FILE* nullFile = fopen("NUL", "wb");
+#else
+    FILE* nullFile = fopen("/dev/null", "wb");
+#endif
+    {
+        ReportSink discard(nullFile);
+        for (size_t i = 0; i < calls.size(); i++) {
+            const TraceRecorder::Call &call = trace.calls[calls[i]];
+            if (touchesFiles(call.op)) {
+                tally.skipped++;
+                continue;
+            }
+            if (opt.speed > 0) {
+                int64_t due = start + static_cast<int64_t>(static_cast<double>(call.startNs) / opt.speed);
+                this_thread::sleep_for(chrono::nanoseconds(due - nowNs()));
+            }
+            replayClock = call.now;
+            bool threw = false;
+            int64_t result = 0;
+            int64_t began = nowNs();
+            try {
+                result = replayCall(library, call, discard);
+            }
+            catch (LibraryException &) {
+                threw = true;
+            }
+            uint64_t ns = static_cast<uint64_t>(nowNs() - began);
+            OpTally &op = tally.ops[static_cast<int>(call.op)];
+            op.recorded.add(call.durationNs);
+            op.replayed.add(ns);
+            // A call that threw records no result
+            if (threw != call.threw || (!threw && result != call.result)) {
+                op.diverged++;
+                if (tally.divergences.size() < ShownDivergences) {
+                    Divergence d = { calls[i], threw, result };
+                    tally.divergences.push_back(d);
+                }
+            }
+        }
+    }
+    if (nullFile)
+        fclose(nullFile);
+}
+
+string describeCall(const TraceRecorder::Call &call) {
+    string out = string(libraryOpName(call.op)) + "(";
+    for (size_t i = 0; i < call.ints.size() && i < 4; i++)
+        out += (i ? ", " : "") + to_string(call.ints[i]);
+    for (size_t i = 0; i < call.text.size() && i < 2; i++)
+        out += (i || !call.ints.empty() ? ", \"" : "\"") + call.text[i] + "\"";
+    if (call.ints.size() > 4 || call.text.size() > 2)
+        out += ", ...";
+    return out + ")";
+}
+
+string describeResult(bool threw, int64_t result) {
+    return threw ? string("an exception") : to_string(result);
+}
+
+}
+
+int main(int argc, char** argv) {
+    Options opt;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg.compare(0, 2, "--") != 0) {
+            opt.tracePath = arg;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            cout << "Missing value for " << arg << endl;
+            return 1;
+        }
+        string value = argv[++i];
+        if (arg == "--speed") {
+            if (value == "max")
+                opt.speed = 0;
+            else if (value == "original")
+                opt.speed = 1;
+            else if ((opt.speed = atof(value.c_str())) <= 0) {
+                cout << "The speed must be original, max or a factor above 0" << endl;
+                return 1;
+            }
+        }
+        else if (arg == "--threads")
+            opt.threads = atoi(value.c_str());
+        else {
+            cout << "Unknown option " << arg << endl;
+            return 1;
+        }
+    }
+    if (opt.tracePath.empty()) {
+        cout << "Usage: library_replay TRACE [--speed original|max|FACTOR] [--threads N]" << endl;
+        return 1;
+    }
+    if (opt.threads < 1) {
+        cout << "Counts must be at least 1" << endl;
+        return 1;
+    }
+
+    Library &library = Library::getInstance();
+    TraceRecorder::Trace trace;
+    try {
+        trace = TraceRecorder::load(opt.tracePath);
+        library.loadSnapshot(trace.snapshot.data(), trace.snapshot.size(), opt.tracePath);
+    }
+    catch (LibraryException &e) {
+        cout << "ERROR: " << e.what() << endl;
+        return 1;
+    }
+    library.setClock([]() { return replayClock; });
+
+    // Each recorded thread's calls go to one replay thread, in order
+    vector<vector<size_t>> assigned(static_cast<size_t>(opt.threads));
+    for (size_t i = 0; i < trace.calls.size(); i++)
+        assigned[trace.calls[i].thread % static_cast<uint32_t>(opt.threads)].push_back(i);
+    vector<Tally> tallies(assigned.size());
+    int64_t start = nowNs();
+    vector<thread> running;
+    for (size_t t = 1; t < assigned.size(); t++)
+        running.push_back(thread(replayCalls, cref(opt), cref(trace), cref(assigned[t]), start, ref(tallies[t])));
+    replayCalls(opt, trace, assigned[0], start, tallies[0]);
+    for (size_t t = 0; t < running.size(); t++)
+        running[t].join();
+    double elapsed = static_cast<double>(nowNs() - start) / 1e9;
+
+    Tally total;
+    for (size_t t = 0; t < tallies.size(); t++) {
+        for (int op = 0; op < Metrics::Ops; op++)
+            total.ops[op].add(tallies[t].ops[op]);
+        total.divergences.insert(total.divergences.end(), tallies[t].divergences.begin(), tallies[t].divergences.end());
+        total.skipped += tallies[t].skipped;
+    }
+    OpTally all;
+    for (int op = 0; op < Metrics::Ops; op++)
+        all.add(total.ops[op]);
+    uint64_t replayed = all.replayed.count;
+    double recordedSpan = trace.calls.empty() ? 0 : static_cast<double>(trace.calls.back().startNs + trace.calls.back().durationNs) / 1e9;
+
+    char line[200];
+    cout << "calls        " << replayed << " replayed on " << opt.threads << (opt.threads == 1 ? " thread" : " threads") << " in " << elapsed << " s";
+    if (total.skipped)
+        cout << ", " << total.skipped << " that use files skipped";
+    cout << endl;
+    if (replayed == 0)
+        return 1;
+    snprintf(line, sizeof(line), "throughput   %.0f calls/s (recorded %.0f calls/s over %.3f s)\n",
+             static_cast<double>(replayed) / elapsed,
+             recordedSpan > 0 ? static_cast<double>(trace.calls.size()) / recordedSpan : 0.0, recordedSpan);
+    cout << line;
+    snprintf(line, sizeof(line), "latency_us   p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n",
+             all.replayed.percentile(0.50), all.replayed.percentile(0.90), all.replayed.percentile(0.99),
+             all.replayed.percentile(0.999), static_cast<double>(all.replayed.maxNs) / 1000.0);
+    cout << line;
+    snprintf(line, sizeof(line), "recorded_us  p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n",
+             all.recorded.percentile(0.50), all.recorded.percentile(0.90), all.recorded.percentile(0.99),
+             all.recorded.percentile(0.999), static_cast<double>(all.recorded.maxNs) / 1000.0);
+    cout << line;
+    cout << "diverged     " << all.diverged << " calls" << endl << endl;
+
+    snprintf(line, sizeof(line), "%-20s %10s %10s %10s %10s %10s %10s %10s\n",
+             "operation", "calls", "diverged", "rec_p50", "rec_p99", "p50_us", "p90_us", "p99_us");
+    cout << line;
+    for (int op = 0; op < Metrics::Ops; op++) {
+        const OpTally &t = total.ops[op];
+        if (t.replayed.count == 0)
+            continue;
+        snprintf(line, sizeof(line), "%-20s %10llu %10llu %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+                 libraryOpName(static_cast<LibraryOp>(op)), static_cast<unsigned long long>(t.replayed.count),
+                 static_cast<unsigned long long>(t.diverged), t.recorded.percentile(0.50), t.recorded.percentile(0.99),
+                 t.replayed.percentile(0.50), t.replayed.percentile(0.90), t.replayed.percentile(0.99));
+        cout << line;
+    }
+
+    if (!total.divergences.empty()) {
+        sort(total.divergences.begin(), total.divergences.end(),
+             [](const Divergence &a, const Divergence &b) { return a.call < b.call; });
+        cout << endl << "First divergent calls:" << endl;
+        for (size_t i = 0; i < total.divergences.size() && i < ShownDivergences; i++) {
+            const Divergence &d = total.divergences[i];
+            const TraceRecorder::Call &call = trace.calls[d.call];
+            snprintf(line, sizeof(line), "%10.6f s  ", static_cast<double>(call.startNs) / 1e9);
+            cout << line << describeCall(call) << ": recorded " << describeResult(call.threw, call.result)
+                 << ", replayed " << describeResult(d.threw, d.result) << endl;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,897 @@
+// Router for a sharded library. The catalog and users are split across
+// branches, each a library_server started with --shard S/N, and clients
+// talk to the router with the same line protocol as to a single server.
+// A branch owns the books and users whose IDs leave remainder S when
+// divided by N, so the router sends each request to the branch owning the
+// IDs in it:
+//
+//   BOOK, and BORROW/RETURN/HOLD/... when user and book share a branch
+//                                  the book's (= the user's) branch
+//   USER, LOANS                    the user's branch
+//   ADDBOOK                        the branch the ISBN's key picks, so that
+//                                  every copy of a title is on one branch;
+//                                  each branch in turn if there is no ISBN
+//   ADDUSER                        each branch in turn
+//   FIND, SEARCH, ISBN, OVERDUE    every branch; FIND takes the first
+//                                  branch that has the title, SEARCH and
+//                                  ISBN list each branch's matches in
+//                                  turn, and OVERDUE adds the counts up
+//   PING, QUIT                     answered by the router
+//
+// BORROW and RETURN also work when the user and the book belong to
+// different branches. A borrow is then a two-phase transfer, with the
+// router as coordinator: PREPARE on the user's branch reserves a place in
+// the user's limit, LENDREMOTE on the book's branch lends the copy, and
+// COMMIT (or ABORT, if the lend failed) on the user's branch settles the
+// reservation. The lend is the commit point, and the book's branch keeps
+// the transfer's ID with the loan. A lend that cannot be sent at all is
+// aborted at once; if the connection to the book's branch drops before the
+// lend's reply, the router asks that branch (LOAN) whether the book went
+// out by this transfer and commits or aborts accordingly, and if it cannot
+// tell it leaves the transfer prepared. If the router stops part way, the
+// next router to start finds the prepared transfer (PENDING) and settles
+// it the same way. A return is RETURNREMOTE on the book's branch, which
+// reports the transfer that lent the book, then ENDREMOTE of that transfer
+// on the user's. If the second step fails, the user's branch still counts
+// a loan whose book is back; a RETURN the book's branch refuses therefore
+// looks for such a loan (REMOTELOANS), and ends it if LOAN on the book's
+// branch no longer shows its transfer. A starting router does the same
+// for every loan between branches. BORROWANY, RETURNANY and holds work
+// only within a branch.
+//
+// Responses come back in request order, as from the server. Requests from
+// one client are sent on as they arrive, except that nothing after a
+// transfer is sent until the transfer is done, so a client never sees its
+// own requests overtake each other. Run one router per set of branches.
+//
+// Each worker thread keeps one connection to every branch and pipelines
+// the requests of all its clients over it.
+
+#include <csignal>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <pthread.h>
+#include <unordered_set>
+#include "LineProtocol.h"
+
+namespace {
+
+const size_t MaxRequestLine = 1 << 16;
+const size_t MaxBufferedInput = 1 << 20;   // stop reading a client with this much unread
+const size_t MaxPendingOutput = 1 << 22;
+const size_t MaxInFlight = 1024;           // requests per client waiting for branches
+
+// Where a branch listens: a Unix socket path, or a port on 127.0.0.1
+struct BranchAddress {
+    string unixPath;
+    int port;
+};
+
+// Transfer IDs only need to differ from those of earlier routers, so they
+// count up from the start time in nanoseconds
+atomic<int64_t> nextTransfer(chrono::duration_cast<chrono::nanoseconds>(
+    chrono::system_clock::now().time_since_epoch()).count());
+
+// What the router is waiting for from a branch on behalf of a request
+enum class Step : unsigned char {
+    Forward,        // the response goes to the client as it is
+    Gather,         // one of several branches' responses to merge
+    Prepare,        // transfer: reserve the user's place
+    Lend,           // transfer: lend the book
+    CheckLend,      // transfer: ask whether a lend whose reply was lost happened
+    Commit,         // transfer: record the loan
+    Abort,          // transfer: give the place back
+    ReturnRemote,   // return across branches: take the book back
+    FindRemoteLoan, // return across branches: find a loan whose return was cut short
+    CheckReturn,    // return across branches: ask whether that loan's book is back
+    EndRemote       // return across branches: end the user's loan
+};
+
+enum class Merge : unsigned char { Find, Search, Overdue };
+
+// How a reply reached advance(). A request that never reached the branch
+// had no effect there; one whose connection dropped before the reply may
+// or may not have.
+enum class Delivery : unsigned char { Answered, NotSent, Lost };
+
+struct Client;
+
+// One client request, from when it is read until its response is queued
+struct Request {
+    Client* client;         // null once the client has gone
+    string response;
+    bool done;
+    int userID;
+    int bookID;
+    int64_t txn;
+    Merge merge;
+    size_t waiting;         // Gather: branches yet to answer
+    vector<string> replies; // Gather: per branch
+};
+
+// epoll data for both kinds of connection starts with isLink
+struct Endpoint {
+    bool isLink;
+    int fd;
+    string in;
+    string out;
+    size_t sent;
+    uint32_t interest;
+};
+
+struct Client : Endpoint {
+    deque<Request*> queue;      // in request order
+    Request* blockedOn;         // transfer that later requests wait for
+    bool eof;                   // the client has stopped sending
+    bool quitting;              // QUIT was read
+    bool dirty;                 // queued for settle()
+};
+
+// A connection to one branch and the requests waiting on it, in order
+struct Link : Endpoint {
+    struct Waiting {
+        Request* request;
+        Step step;
+    };
+    size_t branch;
+    deque<Waiting> waiting;
+};
+
+// Text after "OK" in a reply, or false if the reply is an error
+bool okReply(string_view reply, string_view &results) {
+    if (reply.substr(0, 2) != "OK")
+        return false;
+    results = reply.substr(2);
+    return true;
+}
+
+// Whether a reply to LOAN shows the book lent to userID by transfer txn.
+// If so, times gets the loan's " <checked out> <due>" for COMMIT.
+bool lentBy(string_view reply, int userID, int64_t txn, string &times) {
+    string_view results;
+    int borrower;
+    int64_t checkedOut, due, lentTxn;
+    if (!okReply(reply, results) || !takeInt(results, borrower) || !takeInt64(results, checkedOut)
+        || !takeInt64(results, due) || !takeInt64(results, lentTxn))
+        return false;
+    times = " " + to_string(checkedOut) + " " + to_string(due);
+    return borrower == userID && lentTxn == txn;
+}
+
+// Branch for a new book: books with an ISBN go to the branch its key picks,
+// so all copies of a title, which share the ISBN, land on one branch and
+// the branch can keep to one title per ISBN. Other books go round robin.
+size_t homeOfBook(string_view args, size_t branchCount, size_t &nextHome) {
+    size_t tab = args.rfind('\t');
+    ISBN isbn;
+    if (tab != string_view::npos && ISBN::parse(args.substr(tab + 1), isbn))
+        return static_cast<size_t>(isbn.value() % branchCount);
+    return nextHome++ % branchCount;
+}
+
+// One worker: an epoll loop over its clients and its links to the branches
+class Worker {
+private:
+    const vector<BranchAddress> &branches;
+    int listenFd;
+    int stopFd;
+    int epollFd;
+    bool tcp;
+    vector<Link*> links;
+    unordered_map<int, Client*> clients;
+    vector<Client*> dirty;      // clients with responses or input to look at
+    vector<Client*> closed;     // deleted after the current batch of events
+    size_t nextHome;            // branch for the next ADDBOOK or ADDUSER
+    char listenToken;
+    char stopToken;
+
+    void watch(int op, int fd, uint32_t events, void* ptr) {
+        epoll_event ev;
+        ev.events = events;
+        ev.data.ptr = ptr;
+        epoll_ctl(epollFd, op, fd, &ev);
+    }
+
+    void setInterest(Endpoint* e, uint32_t interest) {
+        if (interest != e->interest) {
+            e->interest = interest;
+            watch(EPOLL_CTL_MOD, e->fd, interest, e);
+        }
+    }
+
+    // Writes as much pending output as the socket takes; false if the
+    // connection failed
+    static bool writeOut(Endpoint* e) {
+        while (e->sent < e->out.size()) {
+            ssize_t n = ::send(e->fd, e->out.data() + e->sent, e->out.size() - e->sent, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0)
+                return errno == EAGAIN || errno == EWOULDBLOCK;
+            e->sent += static_cast<size_t>(n);
+        }
+        e->out.clear();
+        e->sent = 0;
+        return true;
+    }
+
+    // Appends what the socket has to e->in; false at end of stream or on
+    // an error
+    static bool readIn(Endpoint* e) {
+        char buffer[1 << 16];
+        while (true) {
+            ssize_t n = recv(e->fd, buffer, sizeof(buffer), 0);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0)
+                return errno == EAGAIN || errno == EWOULDBLOCK;
+            if (n == 0)
+                return false;
+            e->in.append(buffer, static_cast<size_t>(n));
+            if (static_cast<size_t>(n) < sizeof(buffer))
+                return true;
+        }
+    }
+
+    size_t owner(int id) const { return id < 0 ? 0 : static_cast<size_t>(id) % branches.size(); }
+
+    bool connectLink(Link* l) {
+        const BranchAddress &address = branches[l->branch];
+        l->fd = connectSocket(address.unixPath, address.port);
+        if (l->fd < 0)
+            return false;
+        fcntl(l->fd, F_SETFL, fcntl(l->fd, F_GETFL) | O_NONBLOCK);
+        l->interest = EPOLLIN;
+        watch(EPOLL_CTL_ADD, l->fd, l->interest, l);
+        return true;
+    }
+
+    // Answers everything waiting on a failed link with an error, and
+    // reconnects on its next use
+    void failLink(Link* l) {
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, l->fd, nullptr);
+        ::close(l->fd);
+        l->fd = -1;
+        l->in.clear();
+        l->out.clear();
+        l->sent = 0;
+        deque<Link::Waiting> waiting;
+        waiting.swap(l->waiting);
+        string error = "ERR Branch " + to_string(l->branch) + " is unavailable";
+        for (size_t i = 0; i < waiting.size(); i++)
+            advance(waiting[i].request, waiting[i].step, l->branch, error, Delivery::Lost);
+    }
+
+    // Sends one request line to a branch; the reply goes to advance()
+    void sendTo(size_t branch, string_view line, Request* r, Step step) {
+        Link* l = links[branch];
+        if (l->fd < 0 && !connectLink(l)) {
+            advance(r, step, branch, "ERR Branch " + to_string(branch) + " is unavailable", Delivery::NotSent);
+            return;
+        }
+        l->out.append(line.data(), line.size()).append("\n");
+        Link::Waiting w = { r, step };
+        l->waiting.push_back(w);
+        if (!writeOut(l))
+            failLink(l);
+        else
+            setInterest(l, l->out.empty() ? EPOLLIN : EPOLLIN | EPOLLOUT);
+    }
+
+    void serveLink(Link* l, uint32_t events) {
+        if (events & EPOLLOUT) {
+            if (!writeOut(l)) {
+                failLink(l);
+                return;
+            }
+            setInterest(l, l->out.empty() ? EPOLLIN : EPOLLIN | EPOLLOUT);
+        }
+        if (!(events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+            return;
+        bool open = readIn(l);
+        // A reply can lead to a send that fails this very link (and may
+        // reconnect it), so stop as soon as the connection read is gone
+        int fd = l->fd;
+        size_t start = 0;
+        size_t newline;
+        while (l->fd == fd && (newline = l->in.find('\n', start)) != string::npos && !l->waiting.empty()) {
+            string reply = l->in.substr(start, newline - start);
+            start = newline + 1;
+            Link::Waiting w = l->waiting.front();
+            l->waiting.pop_front();
+            advance(w.request, w.step, l->branch, reply);
+        }
+        if (l->fd != fd)
+            return;
+        l->in.erase(0, start);
+        if (!open)
+            failLink(l);
+    }
+
+    // Moves a request on with a branch's reply, or with the error that
+    // stands in for a reply when the request was not sent or was lost
+    void advance(Request* r, Step step, size_t branch, const string &reply,
+                 Delivery delivery = Delivery::Answered) {
+        string_view results;
+        bool ok = okReply(reply, results);
+        string line;
+        string times;
+        switch (step) {
+        case Step::Forward:
+            finish(r, reply);
+            break;
+        case Step::Gather:
+            r->replies[branch] = reply;
+            if (--r->waiting == 0)
+                finish(r, merged(r));
+            break;
+        case Step::Prepare:
+            if (!ok) {
+                finish(r, reply);
+                break;
+            }
+            line = "LENDREMOTE " + to_string(r->txn) + " " + to_string(r->userID) + string(results) + " "
+                   + to_string(r->bookID);
+            sendTo(owner(r->bookID), line, r, Step::Lend);
+            break;
+        case Step::Lend:
+            if (ok) {
+                r->response = "OK";
+                sendTo(owner(r->userID), "COMMIT " + to_string(r->txn) + string(results), r, Step::Commit);
+            } else if (delivery != Delivery::Lost) {
+                r->response = reply;
+                sendTo(owner(r->userID), "ABORT " + to_string(r->txn), r, Step::Abort);
+            } else {
+                r->response = reply;
+                sendTo(owner(r->bookID), "LOAN " + to_string(r->bookID), r, Step::CheckLend);
+            }
+            break;
+        case Step::CheckLend:
+            if (lentBy(reply, r->userID, r->txn, times)) {
+                r->response = "OK";
+                sendTo(owner(r->userID), "COMMIT " + to_string(r->txn) + times, r, Step::Commit);
+            } else if (delivery == Delivery::Answered) {
+                sendTo(owner(r->userID), "ABORT " + to_string(r->txn), r, Step::Abort);
+            } else {
+                // Still unknown: the transfer stays prepared for the next
+                // router to settle
+                finish(r, r->response);
+            }
+            break;
+        case Step::Commit:
+        case Step::Abort:
+            // A failed commit or abort leaves the transfer prepared for the
+            // next router to settle; the lend decided the outcome either way
+            finish(r, r->response);
+            break;
+        case Step::ReturnRemote:
+            if (ok && takeInt64(results, r->txn)) {
+                endRemote(r);
+            } else if (!ok && delivery == Delivery::Answered) {
+                r->response = reply;
+                sendTo(owner(r->userID), "REMOTELOANS " + to_string(r->userID), r, Step::FindRemoteLoan);
+            } else {
+                finish(r, reply);
+            }
+            break;
+        case Step::FindRemoteLoan: {
+            bool found = false;
+            int64_t txn;
+            int userID, bookID;
+            while (ok && takeInt64(results, txn) && takeInt(results, userID) && takeInt(results, bookID)) {
+                if (bookID == r->bookID) {
+                    r->txn = txn;
+                    found = true;
+                }
+            }
+            if (found)
+                sendTo(owner(r->bookID), "LOAN " + to_string(r->bookID), r, Step::CheckReturn);
+            else
+                finish(r, r->response);
+            break;
+        }
+        case Step::CheckReturn:
+            if (delivery == Delivery::Answered && !lentBy(reply, r->userID, r->txn, times))
+                endRemote(r);
+            else
+                finish(r, r->response);
+            break;
+        case Step::EndRemote:
+            finish(r, reply);
+            break;
+        }
+    }
+
+    // Ends the user's loan of r's book by transfer r->txn, whose book is
+    // back on its branch
+    void endRemote(Request* r) {
+        string line = "ENDREMOTE " + to_string(r->userID) + " " + to_string(r->bookID) + " " + to_string(r->txn);
+        sendTo(owner(r->userID), line, r, Step::EndRemote);
+    }
+
+    // Combines the branches' replies to FIND, SEARCH, ISBN or OVERDUE
+    static string merged(Request* r) {
+        if (r->merge == Merge::Find) {
+            for (size_t i = 0; i < r->replies.size(); i++)
+                if (r->replies[i].compare(0, 2, "OK") == 0)
+                    return r->replies[i];
+            return r->replies[0];
+        }
+        string out = "OK";
+        int64_t loans = 0;
+        int64_t fines = 0;
+        for (size_t i = 0; i < r->replies.size(); i++) {
+            string_view results;
+            if (!okReply(r->replies[i], results))
+                return r->replies[i];
+            if (r->merge == Merge::Search) {
+                out.append(results.data(), results.size());
+                continue;
+            }
+            int64_t n, cents;
+            if (takeInt64(results, n) && takeInt64(results, cents)) {
+                loans += n;
+                fines += cents;
+            }
+        }
+        if (r->merge == Merge::Overdue)
+            out += " " + to_string(loans) + " " + to_string(fines);
+        return out;
+    }
+
+    void finish(Request* r, const string &response) {
+        Client* c = r->client;
+        if (!c) {
+            delete r;
+            return;
+        }
+        r->response = response;
+        r->done = true;
+        if (c->blockedOn == r)
+            c->blockedOn = nullptr;
+        markDirty(c);
+    }
+
+    void markDirty(Client* c) {
+        if (!c->dirty) {
+            c->dirty = true;
+            dirty.push_back(c);
+        }
+    }
+
+    // Routes one request line from a client
+    void dispatch(Client* c, string_view line) {
+        Request* r = new Request();
+        r->client = c;
+        r->done = false;
+        c->queue.push_back(r);
+        size_t space = line.find(' ');
+        string_view verb = line.substr(0, space);
+        string_view args = space == string_view::npos ? string_view() : line.substr(space + 1);
+        int a, b;
+
+        if (verb == "BORROW" || verb == "RETURN" || verb == "HOLD" || verb == "CANCELHOLD"
+            || verb == "BORROWANY" || verb == "RETURNANY") {
+            if (!takeInt(args, a) || !takeInt(args, b) || !rest(args).empty()) {
+                finish(r, "ERR Expected a user ID and a book ID");
+                return;
+            }
+            r->userID = a;
+            r->bookID = b;
+            if (owner(a) == owner(b)) {
+                sendTo(owner(b), line, r, Step::Forward);
+            } else if (verb == "BORROW") {
+                r->txn = nextTransfer++;
+                c->blockedOn = r;
+                sendTo(owner(a), "PREPARE " + to_string(r->txn) + " " + to_string(a) + " " + to_string(b), r, Step::Prepare);
+            } else if (verb == "RETURN") {
+                c->blockedOn = r;
+                sendTo(owner(b), "RETURNREMOTE " + to_string(a) + " " + to_string(b), r, Step::ReturnRemote);
+            } else {
+                finish(r, "ERR Only BORROW and RETURN work across branches");
+            }
+        }
+        else if (verb == "BOOK" || verb == "USER" || verb == "LOANS") {
+            // Malformed IDs go to branch 0, which reports them
+            sendTo(takeInt(args, a) ? owner(a) : 0, line, r, Step::Forward);
+        }
+        else if (verb == "ADDBOOK") {
+            sendTo(homeOfBook(args, branches.size(), nextHome), line, r, Step::Forward);
+        }
+        else if (verb == "ADDUSER") {
+            sendTo(nextHome++ % branches.size(), line, r, Step::Forward);
+        }
+        else if (verb == "FIND" || verb == "SEARCH" || verb == "ISBN" || verb == "OVERDUE") {
+            r->merge = verb == "FIND" ? Merge::Find : verb == "OVERDUE" ? Merge::Overdue : Merge::Search;
+            r->waiting = branches.size();
+            r->replies.resize(branches.size());
+            for (size_t i = 0; i < branches.size(); i++)
+                sendTo(i, line, r, Step::Gather);
+        }
+        else if (verb == "PING") {
+            finish(r, "OK");
+        }
+        else if (verb == "QUIT") {
+            c->quitting = true;
+            finish(r, "OK");
+        }
+        else {
+            finish(r, "ERR Unknown request");
+        }
+    }
+
+    // Routes the client's complete lines until a transfer has to finish
+    // first or too many requests are outstanding
+    void processInput(Client* c) {
+        size_t start = 0;
+        size_t newline;
+        while (!c->blockedOn && !c->quitting && c->queue.size() < MaxInFlight
+               && (newline = c->in.find('\n', start)) != string::npos) {
+            string_view line(c->in.data() + start, newline - start);
+            if (!line.empty() && line.back() == '\r')
+                line.remove_suffix(1);
+            start = newline + 1;
+            dispatch(c, line);
+        }
+        c->in.erase(0, start);
+        if (c->quitting)
+            c->in.clear();
+        if (c->in.size() > MaxRequestLine && c->in.find('\n') == string::npos) {
+            Request* r = new Request();
+            r->client = c;
+            c->queue.push_back(r);
+            finish(r, "ERR Request too long");
+            c->in.clear();
+            c->quitting = true;
+        }
+    }
+
+    // Queues the responses that are ready, in order
+    void collectResponses(Client* c) {
+        while (!c->queue.empty() && c->queue.front()->done) {
+            c->out.append(c->queue.front()->response).append("\n");
+            delete c->queue.front();
+            c->queue.pop_front();
+        }
+    }
+
+    void acceptAll() {
+        while (true) {
+            int fd = accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0)
+                return;
+            if (tcp) {
+                int one = 1;
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            }
+            Client* c = new Client();
+            c->isLink = false;
+            c->fd = fd;
+            c->sent = 0;
+            c->interest = EPOLLIN;
+            c->blockedOn = nullptr;
+            c->eof = false;
+            c->quitting = false;
+            c->dirty = false;
+            clients[fd] = c;
+            watch(EPOLL_CTL_ADD, fd, c->interest, c);
+        }
+    }
+
+    // Requests still waiting on branches carry on without the client: a
+    // transfer must still settle
+    void closeClient(Client* c) {
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, c->fd, nullptr);
+        clients.erase(c->fd);
+        ::close(c->fd);
+        c->fd = -1;
+        for (size_t i = 0; i < c->queue.size(); i++) {
+            if (c->queue[i]->done)
+                delete c->queue[i];
+            else
+                c->queue[i]->client = nullptr;
+        }
+        c->queue.clear();
+        closed.push_back(c);
+    }
+
+    void serveClient(Client* c, uint32_t events) {
+        if (c->fd < 0)
+            return;
+        // Nobody is left to read the responses
+        if (events & (EPOLLHUP | EPOLLERR)) {
+            closeClient(c);
+            return;
+        }
+        if ((events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && !c->eof && !readIn(c))
+            c->eof = true;
+        markDirty(c);
+    }
+
+    // Brings every dirty client up to date: routes what it has sent,
+    // writes what is ready, and closes it once it is done
+    void settle() {
+        while (!dirty.empty()) {
+            Client* c = dirty.back();
+            dirty.pop_back();
+            c->dirty = false;
+            if (c->fd < 0)
+                continue;
+            processInput(c);
+            collectResponses(c);
+            if (!writeOut(c)) {
+                closeClient(c);
+                continue;
+            }
+            bool finished = c->queue.empty() && c->out.empty()
+                            && (c->quitting || (c->eof && c->in.find('\n') == string::npos));
+            if (finished) {
+                closeClient(c);
+                continue;
+            }
+            uint32_t interest = 0;
+            if (!c->eof && !c->quitting && c->in.size() < MaxBufferedInput && c->out.size() < MaxPendingOutput)
+                interest |= EPOLLIN;
+            if (!c->out.empty())
+                interest |= EPOLLOUT;
+            setInterest(c, interest);
+        }
+    }
+public:
+    Worker(const vector<BranchAddress> &branchAddresses, int listenSocket, int stopEvent, bool isTcp)
+        : branches(branchAddresses), listenFd(listenSocket), stopFd(stopEvent), epollFd(-1), tcp(isTcp),
+          nextHome(0) {}
+
+    // Serves until stopFd becomes readable. Clients are then closed, and
+    // transfers still in flight are left for the next router to settle.
+    void run() {
+        epollFd = epoll_create1(EPOLL_CLOEXEC);
+        if (epollFd < 0)
+            return;
+        for (size_t i = 0; i < branches.size(); i++) {
+            Link* l = new Link();
+            l->isLink = true;
+            l->fd = -1;
+            l->sent = 0;
+            l->branch = i;
+            connectLink(l);
+            links.push_back(l);
+        }
+        uint32_t listenEvents = EPOLLIN;
+#ifdef EPOLLEXCLUSIVE
+        listenEvents |= EPOLLEXCLUSIVE;
+#endif
+        watch(EPOLL_CTL_ADD, listenFd, listenEvents, &listenToken);
+        watch(EPOLL_CTL_ADD, stopFd, EPOLLIN, &stopToken);
+        epoll_event events[128];
+        bool stopping = false;
+        while (!stopping) {
+            int n = epoll_wait(epollFd, events, 128, -1);
+            if (n < 0 && errno != EINTR)
+                break;
+            for (int i = 0; i < n; i++) {
+                void* ptr = events[i].data.ptr;
+                if (ptr == &stopToken)
+                    stopping = true;
+                else if (ptr == &listenToken)
+                    acceptAll();
+                else if (static_cast<Endpoint*>(ptr)->isLink)
+                    serveLink(static_cast<Link*>(ptr), events[i].events);
+                else
+                    serveClient(static_cast<Client*>(ptr), events[i].events);
+                settle();
+            }
+            for (size_t i = 0; i < closed.size(); i++)
+                delete closed[i];
+            closed.clear();
+        }
+        while (!clients.empty())
+            closeClient(clients.begin()->second);
+        // A request gathering from several branches waits on several links
+        unordered_set<Request*> abandoned;
+        for (size_t i = 0; i < links.size(); i++) {
+            if (links[i]->fd >= 0)
+                ::close(links[i]->fd);
+            for (size_t j = 0; j < links[i]->waiting.size(); j++)
+                abandoned.insert(links[i]->waiting[j].request);
+            delete links[i];
+        }
+        for (unordered_set<Request*>::iterator it = abandoned.begin(); it != abandoned.end(); ++it)
+            delete *it;
+        for (size_t i = 0; i < closed.size(); i++)
+            delete closed[i];
+        ::close(epollFd);
+    }
+};
+
+// Sends one request over a blocking connection and returns the reply line
+string ask(int fd, const string &request) {
+    string reply;
+    if (!sendAll(fd, request + "\n"))
+        return reply;
+    char buffer[1 << 16];
+    while (reply.empty() || reply.back() != '\n') {
+        ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return string();
+        reply.append(buffer, static_cast<size_t>(n));
+    }
+    reply.pop_back();
+    return reply;
+}
+
+// Settles the transfers an earlier router left prepared: a transfer is
+// committed if the book's branch has the book out to its user by that
+// transfer, and aborted otherwise. Then ends the loans between branches
+// whose book is back, as a return cut short leaves them. Returns false if
+// a branch cannot be reached.
+bool settleTransfers(const vector<BranchAddress> &branches) {
+    vector<int> fds;
+    bool reached = true;
+    for (size_t i = 0; i < branches.size() && reached; i++) {
+        fds.push_back(connectSocket(branches[i].unixPath, branches[i].port));
+        if (fds.back() < 0) {
+            cout << "ERROR: Cannot reach branch " << i << endl;
+            reached = false;
+        }
+    }
+    size_t committed = 0;
+    size_t aborted = 0;
+    for (size_t i = 0; i < branches.size() && reached; i++) {
+        string_view pending;
+        string reply = ask(fds[i], "PENDING");
+        if (!okReply(reply, pending)) {
+            reached = false;
+            break;
+        }
+        int64_t txn;
+        int userID, bookID;
+        while (takeInt64(pending, txn) && takeInt(pending, userID) && takeInt(pending, bookID)) {
+            size_t bookBranch = static_cast<size_t>(bookID < 0 ? 0 : bookID) % branches.size();
+            string loan = ask(fds[bookBranch], "LOAN " + to_string(bookID));
+            string times;
+            if (lentBy(loan, userID, txn, times)) {
+                ask(fds[i], "COMMIT " + to_string(txn) + times);
+                committed++;
+            } else {
+                ask(fds[i], "ABORT " + to_string(txn));
+                aborted++;
+            }
+        }
+    }
+    size_t ended = 0;
+    for (size_t i = 0; i < branches.size() && reached; i++) {
+        string_view loans;
+        string reply = ask(fds[i], "REMOTELOANS");
+        if (!okReply(reply, loans)) {
+            reached = false;
+            break;
+        }
+        int64_t txn;
+        int userID, bookID;
+        while (takeInt64(loans, txn) && takeInt(loans, userID) && takeInt(loans, bookID)) {
+            size_t bookBranch = static_cast<size_t>(bookID < 0 ? 0 : bookID) % branches.size();
+            string loan = ask(fds[bookBranch], "LOAN " + to_string(bookID));
+            string times;
+            if (loan.empty()) {
+                reached = false;
+                break;
+            }
+            if (!lentBy(loan, userID, txn, times)) {
+                ask(fds[i], "ENDREMOTE " + to_string(userID) + " " + to_string(bookID) + " " + to_string(txn));
+                ended++;
+            }
+        }
+    }
+    for (size_t i = 0; i < fds.size(); i++)
+        if (fds[i] >= 0)
+            ::close(fds[i]);
+    if (reached && committed + aborted > 0)
+        cout << "Settled unfinished transfers: " << committed << " committed, " << aborted << " aborted" << endl;
+    if (reached && ended > 0)
+        cout << "Ended loans whose books were already returned: " << ended << endl;
+    return reached;
+}
+
+// "7001,7002,/tmp/branch2.sock": ports on 127.0.0.1 or Unix socket paths,
+// in branch order
+bool parseBranches(const string &list, vector<BranchAddress> &out) {
+    size_t start = 0;
+    while (start <= list.size()) {
+        size_t comma = list.find(',', start);
+        string item = list.substr(start, comma == string::npos ? string::npos : comma - start);
+        if (item.empty())
+            return false;
+        BranchAddress address;
+        address.port = 0;
+        if (item.find_first_not_of("0123456789") == string::npos)
+            address.port = atoi(item.c_str());
+        else
+            address.unixPath = item;
+        out.push_back(address);
+        if (comma == string::npos)
+            break;
+        start = comma + 1;
+    }
+    return !out.empty();
+}
+
+void usage() {
+    cout << "Usage: library_router --branches PORT|PATH,... [--port N | --unix PATH] [--threads N]" << endl;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    int port = 7878;
+    string unixPath;
+    unsigned threads = thread::hardware_concurrency();
+    vector<BranchAddress> branches;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (i + 1 < argc && arg == "--port")
+            port = atoi(argv[++i]);
+        else if (i + 1 < argc && arg == "--unix")
+            unixPath = argv[++i];
+        else if (i + 1 < argc && arg == "--threads")
+            threads = static_cast<unsigned>(atoi(argv[++i]));
+        else if (i + 1 < argc && arg == "--branches" && branches.empty() && parseBranches(argv[i + 1], branches))
+            i++;
+        else {
+            usage();
+            return 1;
+        }
+    }
+    if (branches.empty()) {
+        usage();
+        return 1;
+    }
+    if (threads < 1)
+        threads = 1;
+    if (!settleTransfers(branches))
+        return 1;
+    int listenFd;
+    try {
+        listenFd = openListener(unixPath, port);
+    }
+    catch (LibraryException &e) {
+        cout << "ERROR: " << e.what() << endl;
+        return 1;
+    }
+
+    sigset_t stopSignals;
+    sigemptyset(&stopSignals);
+    sigaddset(&stopSignals, SIGINT);
+    sigaddset(&stopSignals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stopSignals, nullptr);
+
+    int stopFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    vector<Worker*> workers;
+    vector<thread> running;
+    for (unsigned i = 0; i < threads; i++) {
+        workers.push_back(new Worker(branches, listenFd, stopFd, unixPath.empty()));
+        running.push_back(thread(&Worker::run, workers.back()));
+    }
+    if (unixPath.empty())
+        cout << "Routing 127.0.0.1:" << port;
+    else
+        cout << "Routing " << unixPath;
+    cout << " to " << branches.size() << " branches with " << threads << " workers" << endl;
+
+    int signal;
+    sigwait(&stopSignals, &signal);
+    uint64_t one = 1;
+    if (write(stopFd, &one, sizeof(one)) != sizeof(one))
+        cout << "ERROR: Could not stop the workers" << endl;
+    for (size_t i = 0; i < running.size(); i++) {
+        running[i].join();
+        delete workers[i];
+    }
+    ::close(listenFd);
+    ::close(stopFd);
+    if (!unixPath.empty())
+        unlink(unixPath.c_str());
+    return 0;
+}
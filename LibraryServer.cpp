@@ -0,0 +1,613 @@
+// Request server for the library: a line protocol over TCP on localhost or
+// a Unix socket, so any number of clients can use one Library at once
+// instead of one operator at the menu.
+//
+// Every request is one line and gets exactly one response line: "OK",
+// possibly followed by results, or "ERR " and a message. Responses come
+// back in request order, so a client may pipeline, sending many requests
+// without waiting and matching responses by position. Words are separated
+// by spaces; a title, name or query runs to the end of the line, and
+// ADDBOOK separates its three fields with tabs.
+//
+//   PING                           OK
+//   BOOK <book>                    OK <id>\t<title>\t<author>\t<isbn>\t<available copies>
+//   USER <user>                    OK <id>\t<type>\t<name>\t<loans>
+//   FIND <title>                   OK <book>           (exact title)
+//   SEARCH <keywords>              OK <book> <book> ... (one copy per title)
+//   ISBN <isbn>                    OK <book> <book> ...  (copies of the title
+//                                  with that ISBN, written any valid way)
+//   ADDBOOK <title>\t<author>\t<isbn>
+//                                  OK <book>
+//   ADDUSER <type> <name>          OK <user>           (type code or name)
+//   BORROW <user> <book>           OK
+//   RETURN <user> <book>           OK
+//   BORROWANY <user> <book>        OK <copy lent>
+//   RETURNANY <user> <book>        OK <copy returned>
+//   HOLD <user> <book>             OK
+//   CANCELHOLD <user> <book>       OK
+//   LOANS <user>                   OK <book>:<due> ... (due in seconds since the epoch)
+//   OVERDUE                        OK <loans> <fines in cents>
+//   QUIT                           OK, then the server closes the connection
+//
+// With --shard S/N the server is branch S of a sharded library of N
+// branches: it hands out only IDs whose remainder mod N is S and keeps its
+// data in library-S.dat and library-S.log. Clients talk to library_router,
+// which sends each request to the branch owning its IDs and uses these
+// requests between branches (see Library::prepareTransfer):
+//
+//   PREPARE <txn> <user> <book>    OK <user type code>
+//   COMMIT <txn> <checked out> <due>
+//                                  OK
+//   ABORT <txn>                    OK
+//   PENDING                        OK <txn> <user> <book> ...
+//   LENDREMOTE <txn> <user> <type> <book>
+//                                  OK <checked out> <due>
+//   RETURNREMOTE <user> <book>     OK <txn>
+//   ENDREMOTE <user> <book> <txn>  OK
+//   REMOTELOANS [<user>]           OK <txn> <user> <book> ... (loans of other
+//                                  branches' books, for one user or all)
+//   LOAN <book>                    OK <user> <checked out> <due> <txn>
+//                                  (txn 0 for a user of this branch)
+//
+// Worker threads each run an epoll loop over their own connections, and
+// all of them watch the listening socket; whichever wakes first accepts.
+// A request runs on the worker that read it. While one worker waits for
+// the log to reach disk, only its own connections wait, and the log's
+// group commit merges the waits of all workers into one sync.
+
+#include <csignal>
+#include <ctime>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <pthread.h>
+#include "LineProtocol.h"
+
+namespace {
+
+// Same files as the interactive program unless running as a branch; only
+// one of them should run in a directory at a time
+string snapshotFile = "library.dat";
+string logFile = "library.log";
+
+const size_t MaxRequestLine = 1 << 16;
+const size_t MaxPendingOutput = 1 << 22;    // stop reading a client this far behind
+
+struct Connection {
+    int fd;
+    string in;              // bytes read that do not yet form a full line
+    string out;             // responses not yet written
+    size_t sent;            // bytes of out already written
+    uint32_t interest;      // events registered with epoll
+    bool closing;           // close once out has been written
+};
+
+void respond(string &out, TxnStatus status) {
+    if (status == TxnStatus::OK)
+        out += "OK\n";
+    else
+        out.append("ERR ").append(txnStatusMessage(status)).append("\n");
+}
+
+// Runs one request line and appends its response line to out
+void handleRequest(Library &library, string_view line, string &out, bool &quit) {
+    size_t space = line.find(' ');
+    string_view verb = line.substr(0, space);
+    string_view args = space == string_view::npos ? string_view() : line.substr(space + 1);
+    int a, b;
+
+    if (verb == "BORROW" || verb == "RETURN" || verb == "HOLD" || verb == "CANCELHOLD"
+        || verb == "BORROWANY" || verb == "RETURNANY") {
+        if (!takeInt(args, a) || !takeInt(args, b) || !rest(args).empty()) {
+            out += "ERR Expected a user ID and a book ID\n";
+            return;
+        }
+        if (verb == "BORROW")
+            respond(out, library.tryBorrowBook(a, b));
+        else if (verb == "RETURN")
+            respond(out, library.tryReturnBook(a, b));
+        else if (verb == "HOLD")
+            respond(out, library.placeHold(a, b));
+        else if (verb == "CANCELHOLD")
+            respond(out, library.cancelHold(a, b));
+        else {
+            int copy;
+            TxnStatus status = verb == "BORROWANY" ? library.tryBorrowAnyCopy(a, b, &copy)
+                                                   : library.tryReturnAnyCopy(a, b, &copy);
+            if (status == TxnStatus::OK)
+                out.append("OK ").append(to_string(copy)).append("\n");
+            else
+                respond(out, status);
+        }
+    }
+    else if (verb == "BOOK") {
+        Book* book;
+        if (!takeInt(args, a) || !(book = library.getBook(a))) {
+            out += "ERR No Book with that ID Exists\n";
+            return;
+        }
+        out.append("OK ").append(to_string(a)).append("\t").append(book->getTitle());
+        out.append("\t").append(book->getAuthor()).append("\t").append(book->getISBN());
+        out.append("\t").append(to_string(library.countAvailableCopies(a))).append("\n");
+    }
+    else if (verb == "USER") {
+        User* user;
+        if (!takeInt(args, a) || !(user = library.getUser(a))) {
+            out += "ERR No User with that ID Exists\n";
+            return;
+        }
+        out.append("OK ").append(to_string(a)).append("\t").append(user->getUserType());
+        out.append("\t").append(user->getName()).append("\t");
+        out.append(to_string(library.getLoans(a).size())).append("\n");
+    }
+    else if (verb == "FIND") {
+        Book* book = library.findBookByTitle(string(rest(args)));
+        if (book)
+            out.append("OK ").append(to_string(book->getBookID())).append("\n");
+        else
+            out += "ERR No book with that title exists\n";
+    }
+    else if (verb == "SEARCH") {
+        vector<Book*> found = library.searchBooks(string(rest(args)));
+        out += "OK";
+        for (size_t i = 0; i < found.size(); i++)
+            out.append(" ").append(to_string(found[i]->getBookID()));
+        out += "\n";
+    }
+    else if (verb == "ISBN") {
+        vector<Book*> found = library.findBooks(BookField::ISBN, ISBN::normalize(string(rest(args))), MatchMode::Exact);
+        out += "OK";
+        for (size_t i = 0; i < found.size(); i++) {
+            vector<int> copies = library.copiesOf(found[i]->getBookID());
+            for (size_t j = 0; j < copies.size(); j++)
+                out.append(" ").append(to_string(copies[j]));
+        }
+        out += "\n";
+    }
+    else if (verb == "ADDBOOK") {
+        size_t tab1 = args.find('\t');
+        size_t tab2 = tab1 == string_view::npos ? tab1 : args.find('\t', tab1 + 1);
+        if (tab2 == string_view::npos) {
+            out += "ERR Expected title, author and ISBN separated by tabs\n";
+            return;
+        }
+        Book* book = BookFactory::createBook(string(args.substr(0, tab1)), string(args.substr(tab1 + 1, tab2 - tab1 - 1)),
+                                             string(args.substr(tab2 + 1)));
+        try {
+            library.addBook(book);
+        }
+        catch (LibraryException&) {
+            BookFactory::destroyBook(book);
+            throw;
+        }
+        out.append("OK ").append(to_string(book->getBookID())).append("\n");
+    }
+    else if (verb == "ADDUSER") {
+        args = rest(args);
+        size_t end = args.find(' ');
+        int type = parseUserCategory(args.substr(0, end));
+        if (type == 0 || end == string_view::npos || rest(args.substr(end)).empty()) {
+            out += "ERR Expected a user type and a name\n";
+            return;
+        }
+        User* user = UserFactory::createUser(type, string(rest(args.substr(end))));
+        library.registerUser(user);
+        out.append("OK ").append(to_string(user->getUserID())).append("\n");
+    }
+    else if (verb == "LOANS") {
+        if (!takeInt(args, a)) {
+            out += "ERR Expected a user ID\n";
+            return;
+        }
+        vector<LoanRecord> loans = library.getLoans(a);
+        out += "OK";
+        for (size_t i = 0; i < loans.size(); i++)
+            out.append(" ").append(to_string(loans[i].bookID)).append(":").append(to_string(loans[i].due));
+        out += "\n";
+    }
+    else if (verb == "OVERDUE") {
+        vector<LoanRecord> overdue = library.overdueLoans();
+        int64_t fines = 0;
+        for (size_t i = 0; i < overdue.size(); i++)
+            fines += overdue[i].fineCents;
+        out.append("OK ").append(to_string(overdue.size())).append(" ").append(to_string(fines)).append("\n");
+    }
+    else if (verb == "PREPARE" || verb == "COMMIT" || verb == "ABORT") {
+        int64_t txn, checkedOut = 0, due = 0;
+        bool valid = takeInt64(args, txn);
+        if (verb == "PREPARE")
+            valid = valid && takeInt(args, a) && takeInt(args, b);
+        else if (verb == "COMMIT")
+            valid = valid && takeInt64(args, checkedOut) && takeInt64(args, due);
+        if (!valid || !rest(args).empty()) {
+            out += "ERR Malformed transfer request\n";
+            return;
+        }
+        if (verb == "PREPARE") {
+            UserCategory category;
+            TxnStatus status = library.prepareTransfer(txn, a, b, &category);
+            if (status == TxnStatus::OK)
+                out.append("OK ").append(to_string(static_cast<int>(category))).append("\n");
+            else
+                respond(out, status);
+        }
+        else if (verb == "COMMIT")
+            respond(out, library.commitTransfer(txn, checkedOut, due));
+        else
+            respond(out, library.abortTransfer(txn));
+    }
+    else if (verb == "PENDING") {
+        vector<PendingTransfer> pending = library.pendingTransfers();
+        out += "OK";
+        for (size_t i = 0; i < pending.size(); i++) {
+            out.append(" ").append(to_string(pending[i].txn)).append(" ").append(to_string(pending[i].userID));
+            out.append(" ").append(to_string(pending[i].bookID));
+        }
+        out += "\n";
+    }
+    else if (verb == "LENDREMOTE") {
+        int64_t txn;
+        int type;
+        if (!takeInt64(args, txn) || !takeInt(args, a) || !takeInt(args, type) || !takeInt(args, b)
+            || !isUserCategoryCode(type)) {
+            out += "ERR Expected a transfer ID, a user ID, a user type code and a book ID\n";
+            return;
+        }
+        LoanRecord loan;
+        TxnStatus status = library.lendRemote(txn, a, static_cast<UserCategory>(type), b, &loan);
+        if (status == TxnStatus::OK)
+            out.append("OK ").append(to_string(loan.checkedOut)).append(" ").append(to_string(loan.due)).append("\n");
+        else
+            respond(out, status);
+    }
+    else if (verb == "RETURNREMOTE") {
+        if (!takeInt(args, a) || !takeInt(args, b) || !rest(args).empty()) {
+            out += "ERR Expected a user ID and a book ID\n";
+            return;
+        }
+        int64_t txn;
+        TxnStatus status = library.returnRemote(a, b, &txn);
+        if (status == TxnStatus::OK)
+            out.append("OK ").append(to_string(txn)).append("\n");
+        else
+            respond(out, status);
+    }
+    else if (verb == "ENDREMOTE") {
+        int64_t txn;
+        if (!takeInt(args, a) || !takeInt(args, b) || !takeInt64(args, txn) || !rest(args).empty()) {
+            out += "ERR Expected a user ID, a book ID and a transfer ID\n";
+            return;
+        }
+        respond(out, library.endRemoteLoan(a, b, txn));
+    }
+    else if (verb == "REMOTELOANS") {
+        int userID = -1;
+        args = rest(args);
+        if (!args.empty() && (!takeInt(args, userID) || !rest(args).empty())) {
+            out += "ERR Expected a user ID or nothing\n";
+            return;
+        }
+        vector<RemoteLoan> loans = library.listRemoteLoans(userID);
+        out += "OK";
+        for (size_t i = 0; i < loans.size(); i++) {
+            out.append(" ").append(to_string(loans[i].txn)).append(" ").append(to_string(loans[i].loan.userID));
+            out.append(" ").append(to_string(loans[i].loan.bookID));
+        }
+        out += "\n";
+    }
+    else if (verb == "LOAN") {
+        LoanRecord loan;
+        int64_t txn;
+        if (!takeInt(args, a) || !library.getLoan(a, loan, &txn)) {
+            out += "ERR Book is not on loan\n";
+            return;
+        }
+        out.append("OK ").append(to_string(loan.userID)).append(" ").append(to_string(loan.checkedOut));
+        out.append(" ").append(to_string(loan.due)).append(" ").append(to_string(txn)).append("\n");
+    }
+    else if (verb == "PING") {
+        out += "OK\n";
+    }
+    else if (verb == "QUIT") {
+        out += "OK\n";
+        quit = true;
+    }
+    else {
+        out += "ERR Unknown request\n";
+    }
+}
+
+// One worker: an epoll loop over the connections it has accepted
+class Worker {
+private:
+    Library &library;
+    int listenFd;
+    int stopFd;
+    int epollFd;
+    bool tcp;
+    unordered_map<int, Connection*> connections;
+    // Markers stored in epoll_event.data for the two shared descriptors
+    char listenToken;
+    char stopToken;
+
+    void watch(int op, int fd, uint32_t events, void* ptr) {
+        epoll_event ev;
+        ev.events = events;
+        ev.data.ptr = ptr;
+        epoll_ctl(epollFd, op, fd, &ev);
+    }
+
+    void acceptAll() {
+        while (true) {
+            int fd = accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0)
+                return;
+            if (tcp) {
+                int one = 1;
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            }
+            Connection* c = new Connection();
+            c->fd = fd;
+            c->sent = 0;
+            c->interest = EPOLLIN;
+            c->closing = false;
+            connections[fd] = c;
+            watch(EPOLL_CTL_ADD, fd, c->interest, c);
+        }
+    }
+
+    void close(Connection* c) {
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, c->fd, nullptr);
+        connections.erase(c->fd);
+        ::close(c->fd);
+        delete c;
+    }
+
+    // Reads what the client has sent and answers every complete line
+    void readRequests(Connection* c) {
+        char buffer[1 << 16];
+        while (!c->closing) {
+            ssize_t n = recv(c->fd, buffer, sizeof(buffer), 0);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0) {
+                if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+                    c->closing = true;
+                break;
+            }
+            c->in.append(buffer, static_cast<size_t>(n));
+            if (static_cast<size_t>(n) < sizeof(buffer))
+                break;
+        }
+        size_t start = 0;
+        size_t newline;
+        while ((newline = c->in.find('\n', start)) != string::npos) {
+            string_view line(c->in.data() + start, newline - start);
+            if (!line.empty() && line.back() == '\r')
+                line.remove_suffix(1);
+            bool quit = false;
+            try {
+                handleRequest(library, line, c->out, quit);
+            }
+            catch (LibraryException &e) {
+                c->out.append("ERR ").append(e.what()).append("\n");
+            }
+            start = newline + 1;
+            if (quit) {
+                c->closing = true;
+                start = c->in.size();
+                break;
+            }
+        }
+        c->in.erase(0, start);
+        if (c->in.size() > MaxRequestLine) {
+            c->out += "ERR Request too long\n";
+            c->closing = true;
+        }
+    }
+
+    // Writes as much pending output as the socket takes; false if the
+    // connection failed
+    bool writeResponses(Connection* c) {
+        while (c->sent < c->out.size()) {
+            ssize_t n = send(c->fd, c->out.data() + c->sent, c->out.size() - c->sent, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0)
+                return errno == EAGAIN || errno == EWOULDBLOCK;
+            c->sent += static_cast<size_t>(n);
+        }
+        c->out.clear();
+        c->sent = 0;
+        return true;
+    }
+
+    // Handles readiness on a client connection
+    void serve(Connection* c, uint32_t events) {
+        if (events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+            readRequests(c);
+        if (!writeResponses(c) || (c->closing && c->out.empty())) {
+            close(c);
+            return;
+        }
+        // Wait for the client to drain a large backlog before reading more
+        uint32_t interest = 0;
+        if (!c->closing && c->out.size() - c->sent < MaxPendingOutput)
+            interest |= EPOLLIN;
+        if (!c->out.empty())
+            interest |= EPOLLOUT;
+        if (interest != c->interest) {
+            c->interest = interest;
+            watch(EPOLL_CTL_MOD, c->fd, interest, c);
+        }
+    }
+public:
+    Worker(Library &lib, int listenSocket, int stopEvent, bool isTcp)
+        : library(lib), listenFd(listenSocket), stopFd(stopEvent), epollFd(-1), tcp(isTcp) {}
+
+    // Serves until stopFd becomes readable, then closes its connections
+    void run() {
+        epollFd = epoll_create1(EPOLL_CLOEXEC);
+        if (epollFd < 0)
+            return;
+        uint32_t listenEvents = EPOLLIN;
+#ifdef EPOLLEXCLUSIVE
+        listenEvents |= EPOLLEXCLUSIVE;
+#endif
+        watch(EPOLL_CTL_ADD, listenFd, listenEvents, &listenToken);
+        watch(EPOLL_CTL_ADD, stopFd, EPOLLIN, &stopToken);
+        epoll_event events[128];
+        bool stopping = false;
+        while (!stopping) {
+            int n = epoll_wait(epollFd, events, 128, -1);
+            if (n < 0 && errno != EINTR)
+                break;
+            for (int i = 0; i < n; i++) {
+                void* ptr = events[i].data.ptr;
+                if (ptr == &stopToken)
+                    stopping = true;
+                else if (ptr == &listenToken)
+                    acceptAll();
+                else
+                    serve(static_cast<Connection*>(ptr), events[i].events);
+            }
+        }
+        while (!connections.empty())
+            close(connections.begin()->second);
+        ::close(epollFd);
+    }
+};
+
+void usage() {
+    cout << "Usage: library_server [--port N | --unix PATH] [--threads N] [--shard S/N]" << endl;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    int port = 7878;
+    string unixPath;
+    unsigned threads = thread::hardware_concurrency();
+    int shard = 0;
+    int shardCount = 1;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (i + 1 < argc && arg == "--port")
+            port = atoi(argv[++i]);
+        else if (i + 1 < argc && arg == "--unix")
+            unixPath = argv[++i];
+        else if (i + 1 < argc && arg == "--threads")
+            threads = static_cast<unsigned>(atoi(argv[++i]));
+        else if (i + 1 < argc && arg == "--shard" && sscanf(argv[i + 1], "%d/%d", &shard, &shardCount) == 2
+                 && shard >= 0 && shard < shardCount)
+            i++;
+        else {
+            usage();
+            return 1;
+        }
+    }
+    // Workers block while the log syncs, so keep a few more than cores
+    if (threads < 4)
+        threads = 4;
+
+    if (shardCount > 1) {
+        Book::setIDShard(shard, shardCount);
+        User::setIDShard(shard, shardCount);
+        snapshotFile = "library-" + to_string(shard) + ".dat";
+        logFile = "library-" + to_string(shard) + ".log";
+    }
+
+    Library &library = Library::getInstance();
+    try {
+        library.recover(snapshotFile, logFile);
+    }
+    catch (LibraryException &e) {
+        cout << "ERROR: Could not load saved library: " << e.what() << endl;
+        return 1;
+    }
+#ifndef LIBRARY_NO_METRICS
+    MetricsReporter* reporter = nullptr;
+    const char* metricsFile = getenv("LIBRARY_METRICS_FILE");
+    if (metricsFile && *metricsFile)
+        reporter = new MetricsReporter(metricsFile, chrono::seconds(10));
+#endif
+    TransactionLog* log;
+    int listenFd;
+    try {
+        log = new TransactionLog(logFile);
+        library.attachLog(log);
+        listenFd = openListener(unixPath, port);
+    }
+    catch (LibraryException &e) {
+        cout << "ERROR: " << e.what() << endl;
+        return 1;
+    }
+    // Optionally record every library call for library_replay
+    TraceRecorder* recorder = nullptr;
+    const char* traceFile = getenv("LIBRARY_TRACE_FILE");
+    if (traceFile && *traceFile) {
+        try {
+            recorder = new TraceRecorder(traceFile);
+            library.attachTrace(recorder);
+        }
+        catch (LibraryException &e) {
+            cout << "ERROR: " << e.what() << endl;
+            return 1;
+        }
+    }
+
+    // Signals are taken synchronously by the main thread below, so block
+    // them before any worker starts
+    sigset_t stopSignals;
+    sigemptyset(&stopSignals);
+    sigaddset(&stopSignals, SIGINT);
+    sigaddset(&stopSignals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stopSignals, nullptr);
+
+    int stopFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    vector<Worker*> workers;
+    vector<thread> running;
+    for (unsigned i = 0; i < threads; i++) {
+        workers.push_back(new Worker(library, listenFd, stopFd, unixPath.empty()));
+        running.push_back(thread(&Worker::run, workers.back()));
+    }
+    if (unixPath.empty())
+        cout << "Listening on 127.0.0.1:" << port;
+    else
+        cout << "Listening on " << unixPath;
+    cout << " with " << threads << " workers";
+    if (shardCount > 1)
+        cout << " as branch " << shard << " of " << shardCount;
+    cout << endl;
+
+    // Expire holds about once a minute until asked to stop
+    timespec wait = { 60, 0 };
+    while (sigtimedwait(&stopSignals, nullptr, &wait) < 0)
+        library.expireHolds();
+
+    uint64_t one = 1;
+    if (write(stopFd, &one, sizeof(one)) != sizeof(one))
+        cout << "ERROR: Could not stop the workers" << endl;
+    for (size_t i = 0; i < running.size(); i++) {
+        running[i].join();
+        delete workers[i];
+    }
+    ::close(listenFd);
+    ::close(stopFd);
+    if (!unixPath.empty())
+        unlink(unixPath.c_str());
+
+    try {
+        library.checkpoint(snapshotFile);
+    }
+    catch (LibraryException &e) {
+        cout << "ERROR: Could not save library: " << e.what() << endl;
+    }
+    library.attachLog(nullptr);
+    delete log;
+    library.attachTrace(nullptr);
+    delete recorder;
+#ifndef LIBRARY_NO_METRICS
+    delete reporter;
+#endif
+    return 0;
+}
@@ -0,0 +1,176 @@
+// Multithreaded stress test for Library, run by ctest. Worker threads
+// borrow and return books (by copy and by title) while others add and
+// remove copies underneath them, then the loan bookkeeping is checked:
+// every copy has at most one borrower, each user's loans are exactly the
+// copies lent to them, and the available copies plus the loans add up to
+// the copies in the library.
+//
+//   library_stress [--threads N] [--operations N]
+//
+// Exits with 0 if every check passes, otherwise lists what failed.
+
+#include <random>
+#include "Library.h"
+
+namespace {
+
+struct Options {
+    int threads = 0;                // 0: one per core, at least 4
+    int operations = 20000;         // per thread
+    int titles = 200;
+    int copiesPerTitle = 3;
+    int users = 100;
+};
+
+// ISBNs that no other title in the test uses
+atomic<uint64_t> nextISBN(978200000000ULL);
+
+Book* newTitle(int n) {
+    return BookFactory::createBook("Stress Title " + to_string(n), "Stress Author",
+                                   ISBN::withCheckDigit(nextISBN++).str());
+}
+
+// Random traffic from one thread. Book and user IDs are drawn from every
+// ID handed out so far, so some refer to removed books.
+void work(const Options &opt, unsigned seed, atomic<int> &titles) {
+    Library &library = Library::getInstance();
+    mt19937 rng(seed);
+    for (int i = 0; i < opt.operations; i++) {
+        int userID = static_cast<int>(rng() % static_cast<unsigned>(opt.users));
+        int bookID = static_cast<int>(rng() % static_cast<unsigned>(Book::getNextBookID()));
+        unsigned op = rng() % 100;
+        if (op < 30) {
+            library.tryBorrowBook(userID, bookID);
+        } else if (op < 55) {
+            library.tryReturnBook(userID, bookID);
+        } else if (op < 75) {
+            library.tryBorrowAnyCopy(userID, bookID);
+        } else if (op < 90) {
+            library.tryReturnAnyCopy(userID, bookID);
+        } else if (op < 95) {
+            // Another copy of an existing title, or now and then a new one.
+            // The title is read from a snapshot, which keeps its record
+            // alive; a Book* from getBook could be removed meanwhile.
+            shared_ptr<const CatalogSnapshot> snapshot = library.readSnapshot();
+            Book* book;
+            if (snapshot->bookCount() > 0 && rng() % 4 != 0) {
+                const TitleRecord* existing = snapshot->book(rng() % snapshot->bookCount()).record;
+                book = BookFactory::createBook(existing->getTitle(), existing->getAuthor(), existing->getISBN());
+            } else {
+                book = newTitle(titles++);
+            }
+            try {
+                library.addBook(book);
+            }
+            catch (LibraryException &) {
+                // The copy's title was edited or removed meanwhile
+                BookFactory::destroyBook(book);
+            }
+        } else {
+            library.tryRemoveBook(bookID);
+        }
+    }
+}
+
+// Checks the invariants on a quiet library; returns the number of failures
+int check() {
+    Library &library = Library::getInstance();
+    int failures = 0;
+    shared_ptr<const CatalogSnapshot> snapshot = library.readSnapshot();
+    unordered_map<int, int> lentTo;     // book → user, from the users' loans
+    size_t loans = 0;
+    for (size_t i = 0; i < snapshot->userCount(); i++) {
+        int userID = snapshot->user(i).userID;
+        vector<LoanRecord> userLoans = library.getLoans(userID);
+        User* user = library.getUser(userID);
+        if (user->getBorrowedBooks().size() != userLoans.size()) {
+            cout << "FAIL: user " << userID << " lists " << user->getBorrowedBooks().size()
+                 << " books but has " << userLoans.size() << " loans" << endl;
+            failures++;
+        }
+        for (size_t j = 0; j < userLoans.size(); j++) {
+            int bookID = userLoans[j].bookID;
+            if (!lentTo.emplace(bookID, userID).second) {
+                cout << "FAIL: book " << bookID << " is lent to both user " << lentTo[bookID]
+                     << " and user " << userID << endl;
+                failures++;
+            }
+            if (library.getBorrower(bookID) != userID) {
+                cout << "FAIL: user " << userID << " has book " << bookID << " but its borrower is "
+                     << library.getBorrower(bookID) << endl;
+                failures++;
+            }
+            loans++;
+        }
+    }
+    size_t copies = snapshot->bookCount();
+    for (size_t i = 0; i < copies; i++) {
+        int bookID = snapshot->book(i).bookID;
+        int borrower = library.getBorrower(bookID);
+        if (borrower >= 0 && lentTo.count(bookID) == 0) {
+            cout << "FAIL: book " << bookID << " is out to user " << borrower
+                 << ", who does not have it" << endl;
+            failures++;
+        }
+    }
+    size_t available = library.countAvailableBooks();
+    if (available + loans != copies) {
+        cout << "FAIL: " << available << " available + " << loans << " on loan != "
+             << copies << " copies" << endl;
+        failures++;
+    }
+    cout << copies << " copies, " << loans << " on loan, " << available << " available" << endl;
+    return failures;
+}
+
+}
+
+int main(int argc, char** argv) {
+    Options opt;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (i + 1 >= argc) {
+            cout << "Missing value for " << arg << endl;
+            return 1;
+        }
+        string value = argv[++i];
+        if (arg == "--threads")
+            opt.threads = atoi(value.c_str());
+        else if (arg == "--operations")
+            opt.operations = atoi(value.c_str());
+        else {
+            cout << "Unknown option " << arg << endl;
+            return 1;
+        }
+    }
+    if (opt.threads <= 0)
+        opt.threads = max(4, static_cast<int>(thread::hardware_concurrency()));
+
+    Library &library = Library::getInstance();
+    library.clear();
+    for (int t = 0; t < opt.titles; t++) {
+        Book* first = newTitle(t);
+        library.addBook(first);
+        for (int c = 1; c < opt.copiesPerTitle; c++)
+            library.addBook(BookFactory::createBook(first->getTitle(), first->getAuthor(), first->getISBN()));
+    }
+    for (int u = 0; u < opt.users; u++)
+        library.registerUser(UserFactory::createUser(1 + u % UserCategoryCount, "Stress User " + to_string(u)));
+
+    atomic<int> titles(opt.titles);
+    vector<thread> workers;
+    for (int t = 1; t < opt.threads; t++)
+        workers.push_back(thread(work, cref(opt), static_cast<unsigned>(t), ref(titles)));
+    work(opt, 0, titles);
+    for (size_t t = 0; t < workers.size(); t++)
+        workers[t].join();
+
+    int failures = check();
+    library.clear();
+    if (failures) {
+        cout << failures << " checks failed" << endl;
+        return 1;
+    }
+    cout << "All checks passed on " << opt.threads << " threads" << endl;
+    return 0;
+}
@@ -0,0 +1,129 @@
+// Pieces shared by the programs that speak the server's line protocol
+// (library_server, library_router and library_loadgen): parsing request
+// words and opening sockets on localhost or a Unix socket path. Linux only.
+
+#ifndef LINE_PROTOCOL_H
+#define LINE_PROTOCOL_H
+
+#include <cerrno>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "Library.h"
+
+// Reads an integer from the front of text, after any spaces, and removes it
+inline bool takeInt64(string_view &text, int64_t &value) {
+    size_t i = 0;
+    while (i < text.size() && text[i] == ' ')
+        i++;
+    bool negative = i < text.size() && text[i] == '-';
+    if (negative)
+        i++;
+    size_t first = i;
+    uint64_t n = 0;
+    while (i < text.size() && text[i] >= '0' && text[i] <= '9' && n <= static_cast<uint64_t>(INT64_MAX))
+        n = n * 10 + static_cast<uint64_t>(text[i++] - '0');
+    if (i == first || n > static_cast<uint64_t>(INT64_MAX) || (i < text.size() && text[i] != ' '))
+        return false;
+    value = negative ? -static_cast<int64_t>(n) : static_cast<int64_t>(n);
+    text.remove_prefix(i);
+    return true;
+}
+
+inline bool takeInt(string_view &text, int &value) {
+    string_view rest = text;
+    int64_t n;
+    if (!takeInt64(rest, n) || n < INT32_MIN || n > INT32_MAX)
+        return false;
+    value = static_cast<int>(n);
+    text = rest;
+    return true;
+}
+
+// Removes leading spaces
+inline string_view rest(string_view text) {
+    while (!text.empty() && text.front() == ' ')
+        text.remove_prefix(1);
+    return text;
+}
+
+// Connects a blocking socket to unixPath, or to 127.0.0.1:port when the
+// path is empty; returns -1 on failure
+inline int connectSocket(const string &unixPath, int port) {
+    int fd;
+    if (!unixPath.empty()) {
+        sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, unixPath.c_str(), sizeof(addr.sun_path) - 1);
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd >= 0 && connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0)
+            return fd;
+    } else {
+        sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(static_cast<uint16_t>(port));
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd >= 0 && connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0) {
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            return fd;
+        }
+    }
+    if (fd >= 0)
+        close(fd);
+    return -1;
+}
+
+// Opens a non-blocking listening socket on unixPath (replacing any stale
+// socket file), or on 127.0.0.1:port when the path is empty
+inline int openListener(const string &unixPath, int port) {
+    int fd;
+    if (!unixPath.empty()) {
+        sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (unixPath.size() >= sizeof(addr.sun_path))
+            throw LibraryException("Socket path is too long: " + unixPath, LibraryError::SocketError);
+        strcpy(addr.sun_path, unixPath.c_str());
+        unlink(unixPath.c_str());
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0 || ::bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0)
+            throw LibraryException("Cannot bind " + unixPath + ": " + strerror(errno), LibraryError::SocketError);
+    } else {
+        sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(static_cast<uint16_t>(port));
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        int one = 1;
+        if (fd >= 0)
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (fd < 0 || ::bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0)
+            throw LibraryException("Cannot bind 127.0.0.1:" + to_string(port) + ": " + strerror(errno), LibraryError::SocketError);
+    }
+    if (listen(fd, SOMAXCONN) != 0)
+        throw LibraryException(string("Cannot listen: ") + strerror(errno), LibraryError::SocketError);
+    return fd;
+}
+
+// Writes all of data to a blocking socket
+inline bool sendAll(int fd, const string &data) {
+    size_t sent = 0;
+    while (sent < data.size()) {
+        ssize_t n = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        sent += static_cast<size_t>(n);
+    }
+    return true;
+}
+
+#endif
@@ -0,0 +1,384 @@
+// Load generator for library_server. Opens many client connections, keeps
+// a fixed number of requests in flight on each (pipelined), and reports
+// requests per second and latency percentiles when the run ends.
+//
+//   library_loadgen [--port N | --unix PATH] [--clients N] [--pipeline N]
+//                   [--seconds N] [--threads N] [--reads PERCENT]
+//                   [--books N] [--users N] [--populate]
+//
+// Requests are BOOK lookups (--reads percent of them, 50 by default) and
+// otherwise BORROW or RETURN with equal odds, on book IDs below --books
+// and user IDs below --users. Failed borrows and returns are normal
+// traffic: they are counted as ERR responses, not as errors of the run.
+// --populate first adds that many books and users through the server and
+// draws IDs from the ones it gets back.
+
+#include <random>
+#include <sys/epoll.h>
+#include "LineProtocol.h"
+
+namespace {
+
+struct Options {
+    int port = 7878;
+    string unixPath;
+    int clients = 64;
+    int pipeline = 4;
+    int seconds = 10;
+    int threads = 1;
+    int readPercent = 50;
+    int books = 1000;
+    int users = 100;
+    bool populate = false;
+};
+
+// Requests sendBatch keeps in flight. Sending everything before reading
+// stalls once the server stops reading a client that is too far behind.
+const size_t BatchWindow = 1024;
+
+// Sends requests over one blocking connection, a window at a time, and
+// returns the ID in each "OK <id>" response (-1 for anything else)
+vector<int> sendBatch(int fd, const vector<string> &requests) {
+    vector<int> ids;
+    string in;
+    char buffer[1 << 16];
+    size_t start = 0;
+    size_t queued = 0;
+    while (ids.size() < requests.size()) {
+        if (queued - ids.size() < BatchWindow / 2 && queued < requests.size()) {
+            string out;
+            for (; queued < requests.size() && queued - ids.size() < BatchWindow; queued++)
+                out += requests[queued] + "\n";
+            if (!sendAll(fd, out))
+                break;
+        }
+        size_t newline = in.find('\n', start);
+        if (newline == string::npos) {
+            in.erase(0, start);
+            start = 0;
+            ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+            if (n <= 0)
+                break;
+            in.append(buffer, static_cast<size_t>(n));
+            continue;
+        }
+        ids.push_back(in.compare(start, 3, "OK ") == 0 ? atoi(in.c_str() + start + 3) : -1);
+        start = newline + 1;
+    }
+    return ids;
+}
+
+// What one thread measured; latencies go in the same log-linear buckets
+// the library's own metrics use
+struct Tally {
+    uint64_t ok = 0;
+    uint64_t err = 0;
+    uint64_t failedConnections = 0;
+    uint64_t maxNs = 0;
+    vector<uint64_t> histogram = vector<uint64_t>(Metrics::Buckets, 0);
+
+    void add(const Tally &other) {
+        ok += other.ok;
+        err += other.err;
+        failedConnections += other.failedConnections;
+        maxNs = max(maxNs, other.maxNs);
+        for (int b = 0; b < Metrics::Buckets; b++)
+            histogram[b] += other.histogram[b];
+    }
+
+    // Latency at fraction p of the responses, in microseconds
+    double percentile(double p) const {
+        uint64_t count = ok + err;
+        uint64_t rank = static_cast<uint64_t>(p * static_cast<double>(count - 1)) + 1;
+        uint64_t seen = 0;
+        for (int b = 0; b < Metrics::Buckets; b++) {
+            seen += histogram[b];
+            if (seen >= rank)
+                return min(static_cast<double>(maxNs), static_cast<double>(Metrics::bucketFloor(b) + Metrics::bucketFloor(b + 1)) / 2.0) / 1000.0;
+        }
+        return static_cast<double>(maxNs) / 1000.0;
+    }
+};
+
+struct Client {
+    int fd;
+    string in;
+    string out;
+    size_t sent;
+    deque<int64_t> started;     // send time of each request in flight
+    bool writing;
+};
+
+int64_t nowNs() {
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Drives clients connections until the deadline, then waits up to a
+// second for the responses still in flight
+class LoadThread {
+private:
+    const Options &opt;
+    const vector<int> &bookIDs;
+    const vector<int> &userIDs;
+    mt19937 rng;
+    int epollFd;
+
+    void nextRequest(Client &c) {
+        int book = bookIDs[rng() % bookIDs.size()];
+        int user = userIDs[rng() % userIDs.size()];
+        int kind = static_cast<int>(rng() % 100);
+        if (kind < opt.readPercent)
+            c.out += "BOOK " + to_string(book) + "\n";
+        else if (kind % 2 == 0)
+            c.out += "BORROW " + to_string(user) + " " + to_string(book) + "\n";
+        else
+            c.out += "RETURN " + to_string(user) + " " + to_string(book) + "\n";
+        c.started.push_back(nowNs());
+    }
+
+    // Writes what the socket takes and watches for writability if needed
+    bool flush(Client &c) {
+        while (c.sent < c.out.size()) {
+            ssize_t n = send(c.fd, c.out.data() + c.sent, c.out.size() - c.sent, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                break;
+            if (n <= 0)
+                return false;
+            c.sent += static_cast<size_t>(n);
+        }
+        if (c.sent == c.out.size()) {
+            c.out.clear();
+            c.sent = 0;
+        }
+        bool writing = !c.out.empty();
+        if (writing != c.writing) {
+            c.writing = writing;
+            epoll_event ev;
+            ev.events = EPOLLIN | (writing ? static_cast<uint32_t>(EPOLLOUT) : 0u);
+            ev.data.ptr = &c;
+            epoll_ctl(epollFd, EPOLL_CTL_MOD, c.fd, &ev);
+        }
+        return true;
+    }
+
+    // Reads responses, timing each against its request; false once the
+    // connection has failed
+    bool receive(Client &c, bool sending, Tally &tally) {
+        char buffer[1 << 16];
+        ssize_t n = recv(c.fd, buffer, sizeof(buffer), 0);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+            return true;
+        if (n <= 0)
+            return false;
+        c.in.append(buffer, static_cast<size_t>(n));
+        size_t start = 0;
+        size_t newline;
+        int64_t now = nowNs();
+        while ((newline = c.in.find('\n', start)) != string::npos && !c.started.empty()) {
+            uint64_t ns = static_cast<uint64_t>(now - c.started.front());
+            c.started.pop_front();
+            tally.histogram[Metrics::bucketOf(ns)]++;
+            tally.maxNs = max(tally.maxNs, ns);
+            if (c.in.compare(start, 2, "OK") == 0)
+                tally.ok++;
+            else
+                tally.err++;
+            start = newline + 1;
+            if (sending)
+                nextRequest(c);
+        }
+        c.in.erase(0, start);
+        return flush(c);
+    }
+public:
+    LoadThread(const Options &o, const vector<int> &books, const vector<int> &users, unsigned seed)
+        : opt(o), bookIDs(books), userIDs(users), rng(seed), epollFd(-1) {}
+
+    void run(int clients, int64_t deadline, Tally &tally) {
+        epollFd = epoll_create1(EPOLL_CLOEXEC);
+        vector<Client> conns(static_cast<size_t>(clients));
+        size_t open = 0;
+        for (size_t i = 0; i < conns.size(); i++) {
+            Client &c = conns[i];
+            c.fd = connectSocket(opt.unixPath, opt.port);
+            c.sent = 0;
+            c.writing = false;
+            if (c.fd < 0) {
+                tally.failedConnections++;
+                continue;
+            }
+            int flags = fcntl(c.fd, F_GETFL);
+            fcntl(c.fd, F_SETFL, flags | O_NONBLOCK);
+            epoll_event ev;
+            ev.events = EPOLLIN;
+            ev.data.ptr = &c;
+            epoll_ctl(epollFd, EPOLL_CTL_ADD, c.fd, &ev);
+            open++;
+        }
+        for (size_t i = 0; i < conns.size(); i++) {
+            if (conns[i].fd < 0)
+                continue;
+            for (int k = 0; k < opt.pipeline; k++)
+                nextRequest(conns[i]);
+            flush(conns[i]);
+        }
+
+        epoll_event events[256];
+        int64_t drainUntil = deadline + 1000000000LL;
+        bool swept = false;
+        while (open > 0) {
+            int64_t now = nowNs();
+            if (now >= drainUntil)
+                break;
+            bool sending = now < deadline;
+            // Past the deadline, connections with nothing in flight are done
+            if (!sending && !swept) {
+                for (size_t i = 0; i < conns.size(); i++) {
+                    if (conns[i].fd >= 0 && conns[i].started.empty()) {
+                        close(conns[i].fd);
+                        conns[i].fd = -1;
+                        open--;
+                    }
+                }
+                swept = true;
+                continue;
+            }
+            int n = epoll_wait(epollFd, events, 256, 100);
+            for (int i = 0; i < n; i++) {
+                Client &c = *static_cast<Client*>(events[i].data.ptr);
+                bool ok = true;
+                if (events[i].events & EPOLLOUT)
+                    ok = flush(c);
+                if (ok && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+                    ok = receive(c, sending, tally);
+                if (!ok || (!sending && c.started.empty())) {
+                    epoll_ctl(epollFd, EPOLL_CTL_DEL, c.fd, nullptr);
+                    close(c.fd);
+                    c.fd = -1;
+                    open--;
+                }
+            }
+        }
+        for (size_t i = 0; i < conns.size(); i++)
+            if (conns[i].fd >= 0)
+                close(conns[i].fd);
+        close(epollFd);
+    }
+};
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    Options opt;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--populate") {
+            opt.populate = true;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            cout << "Missing value for " << arg << endl;
+            return 1;
+        }
+        string value = argv[++i];
+        if (arg == "--port")
+            opt.port = atoi(value.c_str());
+        else if (arg == "--unix")
+            opt.unixPath = value;
+        else if (arg == "--clients")
+            opt.clients = atoi(value.c_str());
+        else if (arg == "--pipeline")
+            opt.pipeline = atoi(value.c_str());
+        else if (arg == "--seconds")
+            opt.seconds = atoi(value.c_str());
+        else if (arg == "--threads")
+            opt.threads = atoi(value.c_str());
+        else if (arg == "--reads")
+            opt.readPercent = atoi(value.c_str());
+        else if (arg == "--books")
+            opt.books = atoi(value.c_str());
+        else if (arg == "--users")
+            opt.users = atoi(value.c_str());
+        else {
+            cout << "Unknown option " << arg << endl;
+            return 1;
+        }
+    }
+    if (opt.clients < 1 || opt.pipeline < 1 || opt.threads < 1 || opt.books < 1 || opt.users < 1) {
+        cout << "Counts must be at least 1" << endl;
+        return 1;
+    }
+
+    vector<int> bookIDs;
+    vector<int> userIDs;
+    if (opt.populate) {
+        int fd = connectSocket(opt.unixPath, opt.port);
+        if (fd < 0) {
+            cout << "ERROR: Cannot connect to the server" << endl;
+            return 1;
+        }
+        vector<string> requests;
+        for (int i = 0; i < opt.books; i++)
+            requests.push_back("ADDBOOK Load Test Book " + to_string(i) + "\tLoad Generator\t"
+                               + ISBN::withCheckDigit(978000000000ULL + static_cast<uint64_t>(i)).str());
+        vector<int> ids = sendBatch(fd, requests);
+        for (size_t i = 0; i < ids.size(); i++)
+            if (ids[i] >= 0)
+                bookIDs.push_back(ids[i]);
+        requests.clear();
+        for (int i = 0; i < opt.users; i++)
+            requests.push_back("ADDUSER " + to_string(1 + i % UserCategoryCount) + " Load User " + to_string(i));
+        ids = sendBatch(fd, requests);
+        for (size_t i = 0; i < ids.size(); i++)
+            if (ids[i] >= 0)
+                userIDs.push_back(ids[i]);
+        close(fd);
+        if (bookIDs.empty() || userIDs.empty()) {
+            cout << "ERROR: The server did not accept the test books and users" << endl;
+            return 1;
+        }
+    } else {
+        for (int i = 0; i < opt.books; i++)
+            bookIDs.push_back(i);
+        for (int i = 0; i < opt.users; i++)
+            userIDs.push_back(i);
+    }
+
+    int64_t start = nowNs();
+    int64_t deadline = start + static_cast<int64_t>(opt.seconds) * 1000000000LL;
+    vector<LoadThread*> loaders;
+    vector<Tally> tallies(static_cast<size_t>(opt.threads));
+    vector<thread> running;
+    for (int t = 0; t < opt.threads; t++) {
+        int clients = opt.clients / opt.threads + (t < opt.clients % opt.threads ? 1 : 0);
+        loaders.push_back(new LoadThread(opt, bookIDs, userIDs, static_cast<unsigned>(t + 1)));
+        running.push_back(thread(&LoadThread::run, loaders.back(), clients, deadline, ref(tallies[static_cast<size_t>(t)])));
+    }
+    Tally total;
+    for (size_t t = 0; t < running.size(); t++) {
+        running[t].join();
+        delete loaders[t];
+        total.add(tallies[t]);
+    }
+    double elapsed = static_cast<double>(nowNs() - start) / 1e9;
+
+    uint64_t responses = total.ok + total.err;
+    cout << "clients      " << opt.clients - static_cast<int>(total.failedConnections) << " connected";
+    if (total.failedConnections)
+        cout << ", " << total.failedConnections << " failed to connect";
+    cout << ", " << opt.pipeline << " requests in flight each" << endl;
+    cout << "responses    " << responses << " (" << total.ok << " OK, " << total.err << " ERR) in "
+         << elapsed << " s" << endl;
+    if (responses == 0)
+        return 1;
+    char line[160];
+    snprintf(line, sizeof(line), "throughput   %.0f requests/s\n", static_cast<double>(responses) / elapsed);
+    cout << line;
+    snprintf(line, sizeof(line), "latency_us   p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n",
+             total.percentile(0.50), total.percentile(0.90), total.percentile(0.99), total.percentile(0.999),
+             static_cast<double>(total.maxNs) / 1000.0);
+    cout << line;
+    return 0;
+}